@@ -0,0 +1,237 @@
+#include "accesslog.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <iostream>
+
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
+
+// entries per thread, a power of two
+#define ACCESS_LOG_RING_SIZE 1024
+// ms between writes of the collected entries
+#define ACCESS_LOG_FLUSH_INTERVAL 200
+
+struct AccessLog::Ring {
+    Ring()
+        : head(0),
+          tail(0),
+          seen(0),
+          sampledOut(0),
+          orphaned(false),
+          entries(ACCESS_LOG_RING_SIZE)
+    { }
+
+    // only the owner thread moves head and only the writer moves tail, the
+    // entries in between belong to the writer until it moves tail past them
+    std::atomic<std::uint64_t> head;
+    std::atomic<std::uint64_t> tail;
+
+    std::uint64_t seen; // owner thread only
+    std::atomic<std::uint64_t> sampledOut;
+    std::atomic<bool> orphaned;
+
+    std::vector<Entry> entries;
+};
+
+struct AccessLog::RingRef {
+    explicit RingRef(const RingPtr &ring)
+        : ring(ring)
+    { }
+
+    ~RingRef()
+    {
+        ring->orphaned.store(true, std::memory_order_release);
+    }
+
+    const RingPtr ring;
+};
+
+namespace {
+
+std::string formatTime(std::chrono::system_clock::time_point time)
+{
+    const std::time_t seconds = std::chrono::system_clock::to_time_t(time);
+    const unsigned ms = std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count() % 1000;
+
+    std::tm tm;
+    gmtime_r(&seconds, &tm);
+    char buf[32];
+    const std::size_t length = std::strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+    std::snprintf(buf + length, sizeof(buf) - length, ".%03uZ", ms);
+    return buf;
+}
+
+void writeEntry(const AccessLog::Entry &entry, std::string &batch)
+{
+    rapidjson::StringBuffer s;
+    rapidjson::Writer<rapidjson::StringBuffer> w(s);
+
+    const std::string time = formatTime(entry.time);
+    const std::string peer = entry.peer.to_string();
+
+    w.StartObject();
+    w.String("time");
+    w.String(time.c_str(), time.size());
+    w.String("ip");
+    w.String(peer.c_str(), peer.size());
+    w.String("method");
+    w.String(entry.method.c_str(), entry.method.size());
+    w.String("url");
+    w.String(entry.url.c_str(), entry.url.size());
+    w.String("status");
+    w.Uint(entry.httpCode);
+    w.String("bytes");
+    w.Uint64(entry.bytes);
+    w.String("cache");
+    if (entry.cache) {
+        w.String(entry.cache);
+    } else {
+        w.Null();
+    }
+    w.String("readUs");
+    w.Uint(entry.readUs);
+    w.String("handleUs");
+    w.Uint(entry.handleUs);
+    w.String("writeUs");
+    w.Uint(entry.writeUs);
+    w.EndObject();
+
+    batch.append(s.GetString(), s.GetSize());
+    batch += '\n';
+}
+
+} // namespace
+
+AccessLog::AccessLog(const std::string &path, unsigned sampling)
+    : mOut(nullptr),
+      mSampling(sampling),
+      mWritten(0),
+      mDropped(0),
+      mRetiredSampledOut(0)
+{
+    if (path == "-") {
+        mOut = &std::cout;
+    } else {
+        mFile.open(path, std::ios::out | std::ios::app);
+        if (!mFile) {
+            return;
+        }
+        mOut = &mFile;
+    }
+
+    mWriter.reset(new FlushThread(ACCESS_LOG_FLUSH_INTERVAL, [this]() {
+        flush();
+    }));
+}
+
+AccessLog::~AccessLog()
+{
+    // stopped before the rings and the file go
+    mWriter.reset();
+}
+
+AccessLog::Ring &AccessLog::getRing()
+{
+    RingRef *ref = mLocalRing.get();
+    if (!ref) {
+        // once per thread
+        RingPtr ring = std::make_shared<Ring>();
+        {
+            LockGuard g(mRingsMutex);
+            mRings.push_back(ring);
+        }
+        ref = new RingRef(ring);
+        mLocalRing.reset(ref);
+    }
+    return *ref->ring;
+}
+
+bool AccessLog::sample()
+{
+    const unsigned sampling = mSampling.load(std::memory_order_relaxed);
+    if (!isOpen() || sampling == 0) {
+        return false;
+    }
+
+    Ring &ring = getRing();
+    if (ring.seen++ % sampling != 0) {
+        ring.sampledOut.store(ring.sampledOut.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+AccessLog::Entry *AccessLog::acquire()
+{
+    Ring &ring = getRing();
+    const std::uint64_t head = ring.head.load(std::memory_order_relaxed);
+    if (head - ring.tail.load(std::memory_order_acquire) >= ACCESS_LOG_RING_SIZE) {
+        mDropped.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    return &ring.entries[head % ACCESS_LOG_RING_SIZE];
+}
+
+void AccessLog::publish()
+{
+    Ring &ring = getRing();
+    ring.head.store(ring.head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+AccessLog::Stats AccessLog::getStats() const
+{
+    Stats stats;
+    stats.written = mWritten;
+    stats.dropped = mDropped;
+
+    LockGuard g(mRingsMutex);
+    stats.sampledOut = mRetiredSampledOut;
+    for (auto it = mRings.begin(); it != mRings.end(); it++) {
+        stats.sampledOut += (*it)->sampledOut.load(std::memory_order_relaxed);
+    }
+    return stats;
+}
+
+void AccessLog::flush()
+{
+    std::vector<RingPtr> rings;
+    {
+        LockGuard g(mRingsMutex);
+        rings = mRings;
+    }
+
+    std::uint64_t count = 0;
+    std::vector<RingPtr> orphans;
+    for (auto it = rings.begin(); it != rings.end(); it++) {
+        Ring &ring = **it;
+        // checked first: an orphan drained now stays empty for good
+        if (ring.orphaned.load(std::memory_order_acquire)) {
+            orphans.push_back(*it);
+        }
+
+        const std::uint64_t head = ring.head.load(std::memory_order_acquire);
+        std::uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+        for (; tail != head; tail++) {
+            writeEntry(ring.entries[tail % ACCESS_LOG_RING_SIZE], mBatch);
+            count++;
+        }
+        ring.tail.store(tail, std::memory_order_release);
+    }
+
+    if (!orphans.empty()) {
+        LockGuard g(mRingsMutex);
+        for (auto it = orphans.begin(); it != orphans.end(); it++) {
+            mRetiredSampledOut += (*it)->sampledOut.load(std::memory_order_relaxed);
+            mRings.erase(std::find(mRings.begin(), mRings.end(), *it));
+        }
+    }
+
+    if (!mBatch.empty()) {
+        mOut->write(mBatch.data(), mBatch.size());
+        mOut->flush();
+        mBatch.clear();
+        mWritten += count;
+    }
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+
+#include "flushthread.h"
+
+/// Structured access log (one JSON object per line). Every thread adding
+/// entries fills its own single-producer ring, a background thread drains
+/// the rings in batches and does all the writing, so the request path never
+/// takes a lock or waits for the disk. An entry that finds its ring full is
+/// dropped and counted instead.
+class AccessLog
+{
+public:
+    /// path "-" writes to stdout; one of sampling requests is logged
+    AccessLog(const std::string &path, unsigned sampling);
+    /// writes what the rings still hold, then stops the writer thread
+    ~AccessLog();
+
+    bool isOpen() const { return mOut != nullptr; }
+
+    void setSampling(unsigned sampling) { mSampling = sampling; }
+
+    struct Entry {
+        std::chrono::system_clock::time_point time;
+        boost::asio::ip::address peer;
+        std::string method;
+        std::string url;
+        unsigned httpCode;
+        std::uint64_t bytes;
+        const char *cache; // static string, null if the response didn't involve a cache
+        // phases, us: reading the request, handling it, writing the response
+        std::uint32_t readUs;
+        std::uint32_t handleUs;
+        std::uint32_t writeUs;
+    };
+
+    /// whether the calling thread's next request is to be logged
+    bool sample();
+
+    /// slot for the calling thread's next entry, null if its ring is full;
+    /// publish() hands the filled slot over to the writer
+    Entry *acquire();
+    void publish();
+
+    struct Stats {
+        std::uint64_t written;
+        std::uint64_t dropped;
+        std::uint64_t sampledOut;
+    };
+    Stats getStats() const;
+
+private:
+    struct Ring;
+    typedef std::shared_ptr<Ring> RingPtr;
+    /// owned by its thread, marks the ring orphaned when the thread exits
+    struct RingRef;
+
+    AccessLog(const AccessLog &) = delete;
+    AccessLog &operator=(const AccessLog &) = delete;
+
+    Ring &getRing();
+
+    /// moves entries of all rings to the output, drops rings of gone threads
+    void flush();
+
+    std::ofstream mFile;
+    std::ostream *mOut;
+    std::atomic<unsigned> mSampling;
+
+    boost::thread_specific_ptr<RingRef> mLocalRing;
+    std::vector<RingPtr> mRings;
+    mutable boost::mutex mRingsMutex;
+
+    std::atomic<std::uint64_t> mWritten;
+    std::atomic<std::uint64_t> mDropped;
+    std::uint64_t mRetiredSampledOut; // of rings dropped already, under mRingsMutex
+
+    std::string mBatch; // writer thread only
+    std::unique_ptr<FlushThread> mWriter;
+    typedef boost::lock_guard<boost::mutex> LockGuard;
+};
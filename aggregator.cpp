@@ -0,0 +1,209 @@
+#include "aggregator.h"
+
+#include <algorithm>
+#include <queue>
+
+#include "rssconverter.h"
+
+namespace {
+
+struct NewerFirst {
+    template <typename T>
+    bool operator()(const T &a, const T &b) const {
+        return a.pubDate > b.pubDate;
+    }
+};
+
+// position of the next unmerged item of a feed
+struct Cursor {
+    std::time_t pubDate;
+    std::size_t feed;
+    std::size_t pos;
+
+    bool operator<(const Cursor &other) const {
+        // std::priority_queue is a max-heap: newest item first, lower feed index wins ties
+        if (pubDate != other.pubDate) {
+            return pubDate < other.pubDate;
+        }
+        return feed > other.feed;
+    }
+};
+
+} // namespace
+
+Aggregator::Aggregator(boost::asio::io_service &service, Upstream &upstream, ComputePool &computePool)
+    : mIOService(service),
+      mUpstream(upstream),
+      mComputePool(computePool),
+      mStrand(service),
+      mTimer(service),
+      mPending(0),
+      mFinished(false)
+{ }
+
+void Aggregator::fetch(const std::vector<std::string> &urls, const Options &options, HandlerFunc func)
+{
+    mUrls = urls;
+    mBodies.assign(urls.size(), std::string());
+    mPending = urls.size();
+    mFinished = false;
+    mOptions = options;
+    mHandler = func;
+
+    auto thisPtr = shared_from_this();
+
+    if (mPending == 0) {
+        mStrand.post([thisPtr]() {
+            thisPtr->finish();
+        });
+        return;
+    }
+
+    if (options.timeout > 0) {
+        mTimer.expires_from_now(boost::posix_time::milliseconds(options.timeout));
+        mTimer.async_wait(mStrand.wrap([thisPtr](const boost::system::error_code &err) {
+            if (!err) {
+                // batch deadline: merge whatever has arrived so far
+                thisPtr->finish();
+            }
+        }));
+    }
+
+    for (std::size_t i = 0; i < mUrls.size(); i++) {
+        mUpstream.fetch(mUrls[i], options.timeout, mStrand.wrap([thisPtr, i](const Client::ResponsePtr &res) {
+            thisPtr->onFeedFetched(i, res);
+        }));
+    }
+}
+
+void Aggregator::onFeedFetched(std::size_t index, const Client::ResponsePtr &res)
+{
+    if (mFinished) {
+        return;
+    }
+
+    if (res->httpCode == 200) {
+        mBodies[index].swap(res->body);
+    }
+
+    if (--mPending == 0) {
+        finish();
+    }
+}
+
+void Aggregator::finish()
+{
+    if (mFinished) {
+        return;
+    }
+    mFinished = true;
+
+    boost::system::error_code ec;
+    mTimer.cancel(ec);
+
+    // late responses are dropped by mFinished, the bodies are not touched anymore
+    auto thisPtr = shared_from_this();
+    auto json = std::make_shared<std::string>();
+    mComputePool.post([thisPtr, json]() {
+        *json = merge(thisPtr->mUrls, thisPtr->mBodies, thisPtr->mOptions.limit, thisPtr->mOptions.since);
+    }, mIOService, [thisPtr, json]() {
+        thisPtr->mHandler(*json);
+    });
+}
+
+bool Aggregator::loadFeed(const std::string &body, std::size_t limit, std::time_t since, Feed &feed)
+{
+    if (!feed.doc->load_buffer(body.c_str(), body.size())) {
+        return false;
+    }
+
+    pugi::xml_node channel = findRssChannel(*feed.doc);
+    if (!channel) {
+        return false;
+    }
+
+    for (pugi::xml_node item = channel.child("item"); item; item = item.next_sibling("item")) {
+        Entry entry;
+        entry.pubDate = 0;
+        entry.hasDate = false;
+        entry.item = item;
+
+        // a malformed date costs its item the date, not the whole feed its place
+        if (!parseRssPubDate(item, entry.pubDate, entry.hasDate)) {
+            entry.pubDate = 0;
+            entry.hasDate = false;
+        }
+
+        if (since > 0 && (!entry.hasDate || entry.pubDate < since)) {
+            continue;
+        }
+        feed.entries.push_back(entry);
+    }
+
+    // feeds are usually published newest first already, so sorting is rarely needed
+    std::vector<Entry> &entries = feed.entries;
+    if (limit > 0 && entries.size() > limit) {
+        std::partial_sort(entries.begin(), entries.begin() + limit, entries.end(), NewerFirst());
+        entries.resize(limit);
+    } else if (!std::is_sorted(entries.begin(), entries.end(), NewerFirst())) {
+        std::stable_sort(entries.begin(), entries.end(), NewerFirst());
+    }
+
+    return true;
+}
+
+std::string Aggregator::merge(const std::vector<std::string> &urls,
+                              const std::vector<std::string> &bodies,
+                              std::size_t limit, std::time_t since)
+{
+    std::vector<Feed> feeds(bodies.size());
+    std::priority_queue<Cursor> heap;
+
+    for (std::size_t i = 0; i < bodies.size(); i++) {
+        if (bodies[i].empty() || !loadFeed(bodies[i], limit, since, feeds[i])) {
+            continue;
+        }
+
+        if (!feeds[i].entries.empty()) {
+            Cursor cursor = { feeds[i].entries.front().pubDate, i, 0 };
+            heap.push(cursor);
+        }
+    }
+
+    rapidjson::StringBuffer s;
+    RssJsonWriter w(s);
+
+    w.StartArray();
+    std::size_t count = 0;
+    while (!heap.empty() && (limit == 0 || count < limit)) {
+        Cursor cursor = heap.top();
+        heap.pop();
+
+        const Feed &feed = feeds[cursor.feed];
+        const Entry &entry = feed.entries[cursor.pos];
+        const pugi::xml_node &item = entry.item;
+
+        w.StartObject();
+        w.String("feed");
+        w.String(Uri::decode(urls[cursor.feed]).c_str());
+        writeRssText(w, "title", item.child("title"));
+        writeRssText(w, "link", item.child("link"));
+        writeRssText(w, "description", item.child("description"));
+        w.String("pubDate");
+        if (entry.hasDate) {
+            w.Int64(cursor.pubDate);
+        } else {
+            w.Null();
+        }
+        w.EndObject();
+        count++;
+
+        if (++cursor.pos < feed.entries.size()) {
+            cursor.pubDate = feed.entries[cursor.pos].pubDate;
+            heap.push(cursor);
+        }
+    }
+    w.EndArray();
+
+    return s.GetString();
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include <pugixml.hpp>
+
+#include "client.h"
+#include "computepool.h"
+#include "upstream.h"
+
+/// Fetches a batch of feeds concurrently and merges their items into a single
+/// json array ordered by pubDate (newest first)
+class Aggregator : public std::enable_shared_from_this<Aggregator>
+{
+public:
+    /// feeds are merged on the compute pool, the handler is called on service
+    Aggregator(boost::asio::io_service &service, Upstream &upstream, ComputePool &computePool);
+
+    struct Options {
+        Options()
+            : timeout(0),
+              limit(100),
+              since(0)
+        { }
+
+        unsigned timeout;  // per batch deadline, ms
+        std::size_t limit; // max count of items in result, 0 means unlimited
+        std::time_t since; // items published before are skipped
+    };
+
+    typedef std::function<void(const std::string &json)> HandlerFunc;
+    void fetch(const std::vector<std::string> &urls, const Options &options, HandlerFunc func);
+
+    static std::string merge(const std::vector<std::string> &urls,
+                             const std::vector<std::string> &bodies,
+                             std::size_t limit, std::time_t since);
+
+private:
+    struct Entry {
+        std::time_t pubDate;
+        bool hasDate;
+        pugi::xml_node item;
+    };
+
+    struct Feed {
+        Feed()
+            : doc(new pugi::xml_document)
+        { }
+
+        std::shared_ptr<pugi::xml_document> doc;
+        std::vector<Entry> entries;
+    };
+
+    static bool loadFeed(const std::string &body, std::size_t limit, std::time_t since, Feed &feed);
+
+    void onFeedFetched(std::size_t index, const Client::ResponsePtr &res);
+    void finish();
+
+    boost::asio::io_service &mIOService;
+    Upstream &mUpstream;
+    ComputePool &mComputePool;
+    boost::asio::io_service::strand mStrand;
+    boost::asio::deadline_timer mTimer;
+
+    std::vector<std::string> mUrls;
+    std::vector<std::string> mBodies;
+    std::size_t mPending;
+    bool mFinished;
+
+    Options mOptions;
+    HandlerFunc mHandler;
+};
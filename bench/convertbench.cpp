@@ -0,0 +1,167 @@
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include <boost/program_options.hpp>
+#include <boost/thread.hpp>
+
+#include "computepool.h"
+#include "rssconverter.h"
+
+#include "syntheticfeed.h"
+
+/// Parallel conversion of large feeds: converts synthetic feeds of growing
+/// item count serially and with compute pools of growing size, reporting
+/// the speedup over the serial conversion, e.g.
+///
+///   bin/rssproxy_convertbench --items 100,1000,5000,20000 --threads 1,2,4,8
+
+typedef std::chrono::steady_clock Clock;
+
+namespace {
+
+struct Options {
+    std::string items;
+    std::string threads;
+    unsigned itemSize;
+    unsigned minTime;
+};
+
+bool parseList(const std::string &str, std::vector<unsigned> &list)
+{
+    std::stringstream ss(str);
+    std::string value;
+    while (std::getline(ss, value, ',')) {
+        std::stringstream vs(value);
+        unsigned n = 0;
+        vs >> n;
+        if (vs.fail() || !vs.eof()) {
+            return false;
+        }
+        list.push_back(n);
+    }
+    return !list.empty();
+}
+
+bool parseOptions(int argc, char *argv[], Options &options)
+{
+    using namespace boost::program_options;
+
+    std::ostringstream threads;
+    threads << "1,2,4," << std::max(boost::thread::hardware_concurrency(), 1u);
+
+    options_description desc("Allowed options");
+    desc.add_options()
+            ("help", "produce help message")
+            ("items", value<std::string>(&options.items)->default_value("100,1000,5000,20000"), "comma separated item counts")
+            ("threads", value<std::string>(&options.threads)->default_value(threads.str()), "comma separated compute pool sizes, the caller converts too")
+            ("item-size", value<unsigned>(&options.itemSize)->default_value(512), "bytes of description per item")
+            ("min-time", value<unsigned>(&options.minTime)->default_value(500), "min measured time per case, ms");
+
+    variables_map vars;
+    try {
+        store(parse_command_line(argc, argv, desc), vars);
+        notify(vars);
+    } catch (const boost::program_options::error &err) {
+        std::cerr << err.what() << std::endl;
+        return false;
+    }
+
+    if (vars.count("help") > 0) {
+        std::cout << "rssproxy parallel conversion benchmark" << std::endl << desc << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+/// ms per call of func, repeated until minTime passes
+template<typename Func>
+double measure(unsigned minTime, Func func)
+{
+    func();
+
+    std::size_t iterations = 0;
+    const Clock::time_point start = Clock::now();
+    Clock::duration elapsed;
+    do {
+        func();
+        iterations++;
+        elapsed = Clock::now() - start;
+    } while (elapsed < std::chrono::milliseconds(minTime));
+
+    return std::chrono::duration<double, std::milli>(elapsed).count() / iterations;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    std::vector<unsigned> itemCounts;
+    std::vector<unsigned> threadCounts;
+    if (!parseOptions(argc, argv, options) ||
+            !parseList(options.items, itemCounts) || !parseList(options.threads, threadCounts)) {
+        return 1;
+    }
+
+    std::cout << std::left << std::setw(10) << "items"
+              << std::right << std::setw(12) << "feed KB"
+              << std::setw(10) << "threads"
+              << std::setw(12) << "ms/op"
+              << std::setw(10) << "speedup" << std::endl;
+
+    for (auto items = itemCounts.begin(); items != itemCounts.end(); items++) {
+        const std::string rss = makeSyntheticFeed(*items, options.itemSize);
+
+        bool ok = false;
+        const std::string expected = convertRssToJson(rss, RssConvertOptions(), ok);
+        if (!ok) {
+            std::cerr << "failed to convert feed of " << *items << " items" << std::endl;
+            return 1;
+        }
+
+        const double serialMs = measure(options.minTime, [&rss]() {
+            bool ok = false;
+            convertRssToJson(rss, RssConvertOptions(), ok);
+        });
+
+        std::cout << std::left << std::setw(10) << *items
+                  << std::right << std::setw(12) << rss.size() / 1024
+                  << std::setw(10) << "serial"
+                  << std::fixed << std::setprecision(3)
+                  << std::setw(12) << serialMs
+                  << std::setprecision(2) << std::setw(10) << 1.0 << std::endl;
+
+        for (auto threads = threadCounts.begin(); threads != threadCounts.end(); threads++) {
+            // the caller converts ranges as well, so the pool has one thread less
+            std::unique_ptr<ComputePool> pool;
+            if (*threads > 1) {
+                pool.reset(new ComputePool(*threads - 1));
+            }
+
+            auto convert = [&rss, &pool, &ok]() {
+                return pool ? convertRssToJson(rss, RssConvertOptions(), *pool, ok)
+                            : convertRssToJson(rss, RssConvertOptions(), ok);
+            };
+            if (convert() != expected) {
+                std::cerr << "output of " << *threads << " threads differs from the serial one" << std::endl;
+                return 1;
+            }
+
+            const double ms = measure(options.minTime, convert);
+            std::cout << std::left << std::setw(10) << *items
+                      << std::right << std::setw(12) << rss.size() / 1024
+                      << std::setw(10) << *threads
+                      << std::fixed << std::setprecision(3)
+                      << std::setw(12) << ms
+                      << std::setprecision(2) << std::setw(10) << serialMs / ms << std::endl;
+        }
+    }
+
+    return 0;
+}
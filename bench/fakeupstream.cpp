@@ -0,0 +1,102 @@
+#include "fakeupstream.h"
+
+#include <sstream>
+
+#include <boost/asio/steady_timer.hpp>
+
+#define CHUNK_SIZE 8192
+
+namespace {
+
+const char *httpCodeText(unsigned httpCode)
+{
+    switch (httpCode) {
+    case 200: return "OK";
+    case 404: return "Not Found";
+    case 500: return "Internal Server Error";
+    case 503: return "Service Unavailable";
+    }
+    return "Unknown";
+}
+
+} // namespace
+
+FakeUpstream::FakeUpstream(boost::asio::io_service &service, unsigned short port, HandlerFunc handler)
+    : mIOService(service),
+      mAcceptor(service, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), port)),
+      mHandler(handler)
+{
+    accept();
+}
+
+unsigned short FakeUpstream::getPort() const
+{
+    return mAcceptor.local_endpoint().port();
+}
+
+void FakeUpstream::accept()
+{
+    SocketPtr socket = std::make_shared<boost::asio::ip::tcp::socket>(mIOService);
+    mAcceptor.async_accept(*socket, [this, socket](const boost::system::error_code &err) {
+        accept();
+
+        if (!err) {
+            socket->set_option(boost::asio::ip::tcp::no_delay(true));
+            readRequest(socket);
+        }
+    });
+}
+
+void FakeUpstream::readRequest(const SocketPtr &socket)
+{
+    auto buf = std::make_shared<boost::asio::streambuf>();
+    boost::asio::async_read_until(*socket, *buf, "\r\n\r\n",
+    [this, socket, buf](const boost::system::error_code &err, std::size_t) {
+        if (err) {
+            return;
+        }
+
+        std::istream s(buf.get());
+        std::string type, path;
+        s >> type >> path;
+
+        Reply reply = mHandler(path);
+        if (reply.latency == 0) {
+            writeReply(socket, reply);
+            return;
+        }
+
+        auto timer = std::make_shared<boost::asio::steady_timer>(mIOService);
+        timer->expires_from_now(std::chrono::milliseconds(reply.latency));
+        timer->async_wait([this, socket, timer, reply](const boost::system::error_code &) {
+            writeReply(socket, reply);
+        });
+    });
+}
+
+void FakeUpstream::writeReply(const SocketPtr &socket, const Reply &reply)
+{
+    std::ostringstream o;
+    o << "HTTP/1.1 " << reply.httpCode << " " << httpCodeText(reply.httpCode) << "\r\n"
+      << "Content-Type: application/rss+xml; charset=utf-8\r\n"
+      << "Connection: close\r\n";
+
+    if (reply.chunked) {
+        o << "Transfer-Encoding: chunked\r\n\r\n" << std::hex;
+        for (std::size_t pos = 0; pos < reply.body.size(); pos += CHUNK_SIZE) {
+            const std::string chunk = reply.body.substr(pos, CHUNK_SIZE);
+            o << chunk.size() << "\r\n" << chunk << "\r\n";
+        }
+        o << "0\r\n\r\n";
+    } else {
+        o << "Content-Length: " << reply.body.size() << "\r\n\r\n" << reply.body;
+    }
+
+    auto data = std::make_shared<std::string>(o.str());
+    boost::asio::async_write(*socket, boost::asio::buffer(*data),
+    [socket, data](const boost::system::error_code &, std::size_t) {
+        boost::system::error_code ec;
+        socket->shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+        socket->close(ec);
+    });
+}
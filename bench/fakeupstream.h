@@ -0,0 +1,44 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <boost/asio.hpp>
+
+/// Minimal http origin for benchmarks: answers every GET with whatever
+/// the handler returns for the request path, then closes the connection
+class FakeUpstream
+{
+public:
+    struct Reply {
+        Reply()
+            : httpCode(200),
+              chunked(false),
+              latency(0)
+        { }
+
+        unsigned httpCode;
+        std::string body;
+        bool chunked;     // Transfer-Encoding: chunked instead of Content-Length
+        unsigned latency; // ms before the response is sent
+    };
+
+    typedef std::function<Reply(const std::string &path)> HandlerFunc;
+
+    /// port 0 picks any free port, see getPort()
+    FakeUpstream(boost::asio::io_service &service, unsigned short port, HandlerFunc handler);
+
+    unsigned short getPort() const;
+
+private:
+    typedef std::shared_ptr<boost::asio::ip::tcp::socket> SocketPtr;
+
+    void accept();
+    void readRequest(const SocketPtr &socket);
+    void writeReply(const SocketPtr &socket, const Reply &reply);
+
+    boost::asio::io_service &mIOService;
+    boost::asio::ip::tcp::acceptor mAcceptor;
+    HandlerFunc mHandler;
+};
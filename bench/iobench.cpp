@@ -0,0 +1,364 @@
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include <dlfcn.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <boost/program_options.hpp>
+#include <boost/thread.hpp>
+
+#include "server.h"
+#include "serverconfig.h"
+
+/// Requests/sec and syscalls/request of the server's io path: runs Server
+/// with a handler answering at once, and drives it from a forked process
+/// with blocking sockets, so every counted call is the server's, e.g.
+///
+///   bin/rssproxy_iobench --connections 16 --requests 20000
+///
+/// Calls are counted by wrapping the libc functions asio uses for sockets
+/// and its reactor; futex calls behind mutexes aren't seen. Server only
+/// runs on asio's epoll reactor, so there is no other backend to compare
+/// against; the figures are the baseline for one.
+
+typedef std::chrono::steady_clock Clock;
+
+namespace {
+
+enum Call {
+    Call_Accept,
+    Call_Recv,
+    Call_Send,
+    Call_Read,
+    Call_Write,
+    Call_EpollWait,
+    Call_EpollCtl,
+    Call_TimerfdSettime,
+    Call_Setsockopt,
+    Call_Getpeername,
+    Call_Ioctl,
+    Call_Shutdown,
+    Call_Close,
+    Call_Count
+};
+
+const char *gCallNames[Call_Count] = {
+    "accept", "recv", "send", "read", "write", "epoll_wait", "epoll_ctl",
+    "timerfd_settime", "setsockopt", "getpeername", "ioctl", "shutdown", "close"
+};
+
+std::atomic<std::uint64_t> gCalls[Call_Count];
+
+template <typename Func>
+Func next(const char *name)
+{
+    return reinterpret_cast<Func>(dlsym(RTLD_NEXT, name));
+}
+
+} // namespace
+
+// the executable's definitions take precedence over libc's for asio's calls
+extern "C" {
+
+int accept(int fd, sockaddr *addr, socklen_t *len)
+{
+    static auto real = next<int (*)(int, sockaddr *, socklen_t *)>("accept");
+    gCalls[Call_Accept]++;
+    return real(fd, addr, len);
+}
+
+int accept4(int fd, sockaddr *addr, socklen_t *len, int flags)
+{
+    static auto real = next<int (*)(int, sockaddr *, socklen_t *, int)>("accept4");
+    gCalls[Call_Accept]++;
+    return real(fd, addr, len, flags);
+}
+
+ssize_t recv(int fd, void *buf, size_t len, int flags)
+{
+    static auto real = next<ssize_t (*)(int, void *, size_t, int)>("recv");
+    gCalls[Call_Recv]++;
+    return real(fd, buf, len, flags);
+}
+
+ssize_t recvmsg(int fd, msghdr *msg, int flags)
+{
+    static auto real = next<ssize_t (*)(int, msghdr *, int)>("recvmsg");
+    gCalls[Call_Recv]++;
+    return real(fd, msg, flags);
+}
+
+ssize_t send(int fd, const void *buf, size_t len, int flags)
+{
+    static auto real = next<ssize_t (*)(int, const void *, size_t, int)>("send");
+    gCalls[Call_Send]++;
+    return real(fd, buf, len, flags);
+}
+
+ssize_t sendmsg(int fd, const msghdr *msg, int flags)
+{
+    static auto real = next<ssize_t (*)(int, const msghdr *, int)>("sendmsg");
+    gCalls[Call_Send]++;
+    return real(fd, msg, flags);
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+    static auto real = next<ssize_t (*)(int, void *, size_t)>("read");
+    gCalls[Call_Read]++;
+    return real(fd, buf, count);
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+    static auto real = next<ssize_t (*)(int, const void *, size_t)>("write");
+    gCalls[Call_Write]++;
+    return real(fd, buf, count);
+}
+
+int epoll_wait(int epfd, epoll_event *events, int maxevents, int timeout)
+{
+    static auto real = next<int (*)(int, epoll_event *, int, int)>("epoll_wait");
+    gCalls[Call_EpollWait]++;
+    return real(epfd, events, maxevents, timeout);
+}
+
+int epoll_ctl(int epfd, int op, int fd, epoll_event *event)
+{
+    static auto real = next<int (*)(int, int, int, epoll_event *)>("epoll_ctl");
+    gCalls[Call_EpollCtl]++;
+    return real(epfd, op, fd, event);
+}
+
+int timerfd_settime(int fd, int flags, const itimerspec *value, itimerspec *old)
+{
+    static auto real = next<int (*)(int, int, const itimerspec *, itimerspec *)>("timerfd_settime");
+    gCalls[Call_TimerfdSettime]++;
+    return real(fd, flags, value, old);
+}
+
+int setsockopt(int fd, int level, int name, const void *value, socklen_t len)
+{
+    static auto real = next<int (*)(int, int, int, const void *, socklen_t)>("setsockopt");
+    gCalls[Call_Setsockopt]++;
+    return real(fd, level, name, value, len);
+}
+
+int getpeername(int fd, sockaddr *addr, socklen_t *len)
+{
+    static auto real = next<int (*)(int, sockaddr *, socklen_t *)>("getpeername");
+    gCalls[Call_Getpeername]++;
+    return real(fd, addr, len);
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+    static auto real = next<int (*)(int, unsigned long, void *)>("ioctl");
+    va_list args;
+    va_start(args, request);
+    void *arg = va_arg(args, void *);
+    va_end(args);
+    gCalls[Call_Ioctl]++;
+    return real(fd, request, arg);
+}
+
+int shutdown(int fd, int how)
+{
+    static auto real = next<int (*)(int, int)>("shutdown");
+    gCalls[Call_Shutdown]++;
+    return real(fd, how);
+}
+
+int close(int fd)
+{
+    static auto real = next<int (*)(int)>("close");
+    gCalls[Call_Close]++;
+    return real(fd);
+}
+
+} // extern "C"
+
+namespace {
+
+struct Options {
+    unsigned short port;
+    unsigned threads;
+    unsigned connections;
+    unsigned requests;
+};
+
+bool parseOptions(int argc, char *argv[], Options &options)
+{
+    using namespace boost::program_options;
+
+    options_description desc("Allowed options");
+    desc.add_options()
+            ("help", "produce help message")
+            ("port", value<unsigned short>(&options.port)->default_value(18080), "server port")
+            ("threads", value<unsigned>(&options.threads)->default_value(1), "server threads")
+            ("connections", value<unsigned>(&options.connections)->default_value(16), "concurrent client connections")
+            ("requests", value<unsigned>(&options.requests)->default_value(20000), "requests in total");
+
+    variables_map vars;
+    try {
+        store(parse_command_line(argc, argv, desc), vars);
+        notify(vars);
+    } catch (const boost::program_options::error &err) {
+        std::cerr << err.what() << std::endl;
+        return false;
+    }
+
+    if (vars.count("help") > 0) {
+        std::cout << "rssproxy io path benchmark" << std::endl << desc << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+/// one request per connection, as the server closes each after the response
+bool sendRequest(unsigned short port)
+{
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return false;
+    }
+
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    static const char request[] = "GET /bench HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    bool ok = connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0 &&
+            ::send(fd, request, sizeof(request) - 1, 0) == ssize_t(sizeof(request) - 1);
+
+    char buf[4096];
+    ssize_t n = 0;
+    std::size_t received = 0;
+    while (ok && (n = ::recv(fd, buf, sizeof(buf), 0)) > 0) {
+        received += n;
+    }
+    ::close(fd);
+    return ok && n == 0 && received > 0;
+}
+
+/// runs in the forked process, writes the count of failed requests to out
+void runClients(const Options &options, int out)
+{
+    std::atomic<unsigned> next(0);
+    std::atomic<unsigned> failed(0);
+
+    boost::thread_group threads;
+    for (unsigned i = 0; i < options.connections; i++) {
+        threads.create_thread([&options, &next, &failed]() {
+            while (next++ < options.requests) {
+                if (!sendRequest(options.port)) {
+                    failed++;
+                }
+            }
+        });
+    }
+    threads.join_all();
+
+    const unsigned result = failed;
+    ::write(out, &result, sizeof(result));
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        return 1;
+    }
+
+    char path[] = "/tmp/rssproxy_iobench_XXXXXX";
+    const int configFd = mkstemp(path);
+    if (configFd < 0) {
+        std::cerr << "cannot create config file" << std::endl;
+        return 1;
+    }
+    ::close(configFd);
+    std::ofstream(path) << "{\"port\": " << options.port << ", \"threads\": " << options.threads
+                        << ", \"timeout\": 1000, \"maxConnectionsPerIp\": 0, \"maxConnections\": 0}";
+
+    const char *configArgv[] = { argv[0], "--config", path };
+    auto config = std::make_shared<ServerConfig>(3, const_cast<char **>(configArgv));
+    unlink(path);
+    if (!*config) {
+        return 1;
+    }
+
+    // forked before any thread is started
+    int pipeFds[2];
+    if (pipe(pipeFds) != 0) {
+        return 1;
+    }
+    const pid_t child = fork();
+    if (child == 0) {
+        ::close(pipeFds[0]);
+        // lets the server bind and start listening first
+        usleep(200000);
+        runClients(options, pipeFds[1]);
+        _exit(0);
+    }
+    ::close(pipeFds[1]);
+
+    boost::asio::io_service ioService;
+    Server server(std::make_shared<ConfigStore>(config), ioService);
+    server.setHandlerFunc([](const Server::RequestPtr &, Server::ResponsePtr &res, Server::ResponseCallback callback) {
+        res->body = "{}";
+        callback(res);
+    });
+
+    std::uint64_t before[Call_Count];
+    for (unsigned i = 0; i < Call_Count; i++) {
+        before[i] = gCalls[i];
+    }
+    const Clock::time_point start = Clock::now();
+
+    unsigned failed = 0;
+    const bool done = ::read(pipeFds[0], &failed, sizeof(failed)) == sizeof(failed);
+    const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    waitpid(child, nullptr, 0);
+
+    if (!done) {
+        std::cerr << "load generator failed" << std::endl;
+        return 1;
+    }
+
+    // start includes the generator's head start
+    const unsigned requests = options.requests;
+    std::cout << "requests:\t" << requests << " (" << failed << " failed)" << std::endl
+              << "requests/s:\t" << std::fixed << std::setprecision(0) << requests / std::max(elapsed - 0.2, 1e-3) << std::endl;
+
+    std::uint64_t total = 0;
+    std::cout << std::setprecision(2);
+    for (unsigned i = 0; i < Call_Count; i++) {
+        const std::uint64_t calls = gCalls[i] - before[i];
+        total += calls;
+        if (calls > 0) {
+            std::cout << gCallNames[i] << "/request:\t" << double(calls) / requests << std::endl;
+        }
+    }
+    std::cout << "syscalls/request:\t" << double(total) / requests << std::endl;
+
+    _exit(failed > 0 ? 1 : 0);
+}
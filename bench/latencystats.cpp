@@ -0,0 +1,54 @@
+#include "latencystats.h"
+
+#include <algorithm>
+#include <iomanip>
+
+namespace {
+
+double percentile(const std::vector<std::uint64_t> &sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    std::size_t index = static_cast<std::size_t>(p * (sorted.size() - 1) + 0.5);
+    return sorted[index] / 1000.0;
+}
+
+} // namespace
+
+void LatencyStats::add(std::uint64_t micros, unsigned httpCode)
+{
+    LockGuard g(mMutex);
+    mSamples.push_back(micros);
+    mCodes[httpCode]++;
+}
+
+std::size_t LatencyStats::getCount() const
+{
+    LockGuard g(mMutex);
+    return mSamples.size();
+}
+
+void LatencyStats::print(std::ostream &o, double seconds) const
+{
+    std::vector<std::uint64_t> sorted;
+    std::map<unsigned, std::uint64_t> codes;
+    {
+        LockGuard g(mMutex);
+        sorted = mSamples;
+        codes = mCodes;
+    }
+    std::sort(sorted.begin(), sorted.end());
+
+    o << std::fixed << std::setprecision(2)
+      << "requests:\t" << sorted.size() << std::endl
+      << "throughput:\t" << (seconds > 0 ? sorted.size() / seconds : 0) << " req/s" << std::endl
+      << "latency ms:\tp50 " << percentile(sorted, 0.5)
+      << "\tp99 " << percentile(sorted, 0.99)
+      << "\tp999 " << percentile(sorted, 0.999)
+      << "\tmax " << (sorted.empty() ? 0 : sorted.back() / 1000.0) << std::endl;
+
+    for (auto it = codes.begin(); it != codes.end(); it++) {
+        o << "http " << it->first << ":\t" << it->second << std::endl;
+    }
+}
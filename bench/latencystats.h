@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+/// Thread-safe collector of request latencies and response codes
+class LatencyStats
+{
+public:
+    void add(std::uint64_t micros, unsigned httpCode);
+
+    std::size_t getCount() const;
+
+    /// prints throughput over the given wall time, latency percentiles and code counts
+    void print(std::ostream &o, double seconds) const;
+
+private:
+    std::vector<std::uint64_t> mSamples;
+    std::map<unsigned, std::uint64_t> mCodes;
+
+    mutable boost::mutex mMutex;
+    typedef boost::lock_guard<boost::mutex> LockGuard;
+};
@@ -0,0 +1,266 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <sstream>
+
+#include <boost/asio/steady_timer.hpp>
+#include <boost/program_options.hpp>
+#include <boost/thread.hpp>
+
+#include "client.h"
+
+#include "fakeupstream.h"
+#include "latencystats.h"
+#include "syntheticfeed.h"
+
+/// End-to-end load test: serves synthetic feeds from an in-process fake
+/// origin and drives a running rssproxy with closed or open loop load, e.g.
+///
+///   bin/rssproxy --config bin/conf.json &
+///   bin/rssproxy_loadtest --target 127.0.0.1:8080 --items 50 --concurrency 64 --duration 10
+
+typedef std::chrono::steady_clock Clock;
+
+namespace {
+
+struct Options {
+    std::string target;
+    unsigned short upstreamPort;
+    unsigned items;
+    unsigned itemSize;
+    bool chunked;
+    unsigned latency;
+    double errorRate;
+    std::string mode;
+    unsigned concurrency;
+    unsigned rate;
+    unsigned duration;
+    unsigned threads;
+    unsigned timeout;
+};
+
+bool parseOptions(int argc, char *argv[], Options &options)
+{
+    using namespace boost::program_options;
+
+    options_description desc("Allowed options");
+    desc.add_options()
+            ("help", "produce help message")
+            ("target", value<std::string>(&options.target)->default_value("127.0.0.1:8080"), "rssproxy host:port")
+            ("upstream-port", value<unsigned short>(&options.upstreamPort)->default_value(0), "fake upstream port, 0 picks a free one")
+            ("items", value<unsigned>(&options.items)->default_value(20), "items per feed")
+            ("item-size", value<unsigned>(&options.itemSize)->default_value(512), "bytes of description per item")
+            ("chunked", bool_switch(&options.chunked), "serve feeds with chunked transfer encoding")
+            ("latency", value<unsigned>(&options.latency)->default_value(0), "upstream latency, ms")
+            ("error-rate", value<double>(&options.errorRate)->default_value(0), "share of upstream 500 responses, 0..1")
+            ("mode", value<std::string>(&options.mode)->default_value("closed"), "closed (fixed concurrency) or open (fixed rate)")
+            ("concurrency", value<unsigned>(&options.concurrency)->default_value(16), "requests in flight, closed loop")
+            ("rate", value<unsigned>(&options.rate)->default_value(100), "requests per second, open loop")
+            ("duration", value<unsigned>(&options.duration)->default_value(10), "test duration, s")
+            ("threads", value<unsigned>(&options.threads)->default_value(2), "load generator threads")
+            ("timeout", value<unsigned>(&options.timeout)->default_value(5000), "request timeout, ms");
+
+    variables_map vars;
+    try {
+        store(parse_command_line(argc, argv, desc), vars);
+        notify(vars);
+    } catch (const boost::program_options::error &err) {
+        std::cerr << err.what() << std::endl;
+        return false;
+    }
+
+    if (vars.count("help") > 0 || (options.mode != "closed" && options.mode != "open")) {
+        std::cout << "rssproxy load test" << std::endl << desc << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+class LoadGenerator
+{
+public:
+    LoadGenerator(boost::asio::io_service &service, const Options &options, const std::string &url)
+        : mIOService(service),
+          mOptions(options),
+          mUrl(url),
+          mClientContext(std::make_shared<Client::Context>(service, options.threads == 1)),
+          mTimer(service),
+          mInFlight(0),
+          mStopping(false)
+    { }
+
+    void start()
+    {
+        mStart = Clock::now();
+        mEnd = mStart + std::chrono::seconds(mOptions.duration);
+
+        if (mOptions.mode == "closed") {
+            for (unsigned i = 0; i < mOptions.concurrency; i++) {
+                send(Clock::now());
+            }
+        } else {
+            mNextSend = mStart;
+            tick();
+        }
+    }
+
+    void wait()
+    {
+        boost::unique_lock<boost::mutex> lock(mMutex);
+        while (!mStopping || mInFlight > 0) {
+            mDone.wait(lock);
+        }
+    }
+
+    double getElapsed() const
+    {
+        return std::chrono::duration<double>(mFinish - mStart).count();
+    }
+
+    const LatencyStats &getStats() const { return mStats; }
+
+private:
+    void tick()
+    {
+        if (Clock::now() >= mEnd) {
+            stop();
+            return;
+        }
+
+        // latency is measured from the scheduled send time, so a slow proxy
+        // can't hide its queueing delay (coordinated omission)
+        send(mNextSend);
+
+        mNextSend += std::chrono::microseconds(1000000 / std::max(mOptions.rate, 1u));
+        mTimer.expires_at(mNextSend);
+        mTimer.async_wait([this](const boost::system::error_code &err) {
+            if (!err) {
+                tick();
+            }
+        });
+    }
+
+    void send(Clock::time_point scheduled)
+    {
+        {
+            boost::lock_guard<boost::mutex> g(mMutex);
+            mInFlight++;
+        }
+
+        auto client = std::make_shared<Client>(mIOService, mClientContext);
+        client->sendRequest("GET", mUrl, mOptions.timeout, [this, scheduled](const Client::ResponsePtr &res) {
+            const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - scheduled);
+            mStats.add(latency.count(), res->httpCode);
+
+            if (mOptions.mode == "closed") {
+                if (Clock::now() < mEnd) {
+                    send(Clock::now());
+                } else {
+                    stop();
+                }
+            }
+
+            boost::lock_guard<boost::mutex> g(mMutex);
+            if (--mInFlight == 0 && mStopping) {
+                mDone.notify_all();
+            }
+        });
+    }
+
+    void stop()
+    {
+        boost::lock_guard<boost::mutex> g(mMutex);
+        if (!mStopping) {
+            mStopping = true;
+            mFinish = Clock::now();
+        }
+        mDone.notify_all();
+    }
+
+    boost::asio::io_service &mIOService;
+    const Options &mOptions;
+    const std::string mUrl;
+    const Client::ContextPtr mClientContext;
+    boost::asio::steady_timer mTimer;
+
+    Clock::time_point mStart;
+    Clock::time_point mEnd;
+    Clock::time_point mFinish;
+    Clock::time_point mNextSend;
+
+    unsigned mInFlight;
+    bool mStopping;
+    boost::mutex mMutex;
+    boost::condition_variable mDone;
+
+    LatencyStats mStats;
+};
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        return 1;
+    }
+
+    // fake origin runs on its own threads so it doesn't compete with the load generator
+    boost::asio::io_service upstreamService;
+    const std::string feed = makeSyntheticFeed(options.items, options.itemSize);
+
+    std::mt19937 random(std::random_device{}());
+    boost::mutex randomMutex;
+
+    FakeUpstream upstream(upstreamService, options.upstreamPort, [&](const std::string &) {
+        FakeUpstream::Reply reply;
+        reply.chunked = options.chunked;
+        reply.latency = options.latency;
+
+        boost::lock_guard<boost::mutex> g(randomMutex);
+        if (std::uniform_real_distribution<double>(0, 1)(random) < options.errorRate) {
+            reply.httpCode = 500;
+        } else {
+            reply.body = feed;
+        }
+        return reply;
+    });
+
+    std::ostringstream url;
+    url << "http://" << options.target << "/?url=http://127.0.0.1:" << upstream.getPort() << "/feed.xml";
+
+    std::cout << "feed size:\t" << feed.size() << " bytes" << std::endl
+              << "request url:\t" << url.str() << std::endl;
+
+    boost::thread_group threads;
+    std::unique_ptr<boost::asio::io_service::work> upstreamWork(new boost::asio::io_service::work(upstreamService));
+    threads.create_thread([&upstreamService]() {
+        upstreamService.run();
+    });
+
+    boost::asio::io_service service;
+    std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(service));
+    for (unsigned i = 0; i < options.threads; i++) {
+        threads.create_thread([&service]() {
+            service.run();
+        });
+    }
+
+    LoadGenerator generator(service, options, url.str());
+    service.post([&generator]() {
+        generator.start();
+    });
+    generator.wait();
+
+    work.reset();
+    upstreamWork.reset();
+    service.stop();
+    upstreamService.stop();
+    threads.join_all();
+
+    generator.getStats().print(std::cout, generator.getElapsed());
+
+    return 0;
+}
@@ -0,0 +1,504 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <vector>
+
+#include <dirent.h>
+
+#include <boost/program_options.hpp>
+
+#include "client.h"
+#include "rfc882/rfc882.h"
+#include "rssconverter.h"
+#include "server.h"
+#include "serverconfig.h"
+#include "uri.h"
+
+#include "fakeupstream.h"
+
+/// Micro-benchmarks of the request/conversion hot path. Feeds are read from
+/// the corpus directory, every *.xml file gives its own conversion case, e.g.
+///
+///   bin/rssproxy_microbench --corpus bench/corpus --json > bench.json
+
+typedef std::chrono::steady_clock Clock;
+
+namespace {
+
+// allocation counters, the benchmarks run on a single thread
+std::size_t gAllocs = 0;
+std::size_t gAllocBytes = 0;
+
+// results are folded in here so the compiler can't drop the measured calls
+volatile std::size_t gSink = 0;
+
+void *countedAlloc(std::size_t size)
+{
+    gAllocs++;
+    gAllocBytes += size;
+    return std::malloc(size == 0 ? 1 : size);
+}
+
+} // namespace
+
+void *operator new(std::size_t size)
+{
+    void *p = countedAlloc(size);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+    return countedAlloc(size);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+    return countedAlloc(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+namespace {
+
+struct Options {
+    std::string corpus;
+    std::string filter;
+    unsigned minTime;
+    bool json;
+};
+
+struct Result {
+    std::string name;
+    std::size_t inputBytes;
+    std::size_t iterations;
+    double nsPerOp;
+    double bytesPerOp;
+    double allocsPerOp;
+};
+
+class Bench
+{
+public:
+    Bench(const Options &options)
+        : mOptions(options)
+    { }
+
+    /// runs func with growing iteration count until a run takes at least
+    /// minTime, the last run is reported
+    template<typename Func>
+    void run(const std::string &name, std::size_t inputBytes, Func func)
+    {
+        if (!mOptions.filter.empty() && name.find(mOptions.filter) == std::string::npos) {
+            return;
+        }
+
+        // warm up caches and lazily initialized state (locale, timezone)
+        func();
+
+        const auto minTime = std::chrono::milliseconds(mOptions.minTime);
+
+        std::size_t iterations = 1;
+        for (;;) {
+            const std::size_t allocs = gAllocs;
+            const std::size_t allocBytes = gAllocBytes;
+
+            const Clock::time_point start = Clock::now();
+            for (std::size_t i = 0; i < iterations; i++) {
+                func();
+            }
+            const Clock::duration elapsed = Clock::now() - start;
+
+            if (elapsed >= minTime || iterations >= (std::size_t(1) << 40)) {
+                Result r;
+                r.name = name;
+                r.inputBytes = inputBytes;
+                r.iterations = iterations;
+                r.nsPerOp = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+                r.bytesPerOp = double(gAllocBytes - allocBytes) / iterations;
+                r.allocsPerOp = double(gAllocs - allocs) / iterations;
+                mResults.push_back(r);
+
+                if (!mOptions.json) {
+                    print(std::cout, r);
+                }
+                return;
+            }
+
+            // aim slightly past minTime so the next run is usually the last one
+            const double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+            const double target = std::chrono::duration<double, std::nano>(minTime).count() * 1.2;
+            const std::size_t next = ns > 0 ? std::size_t(iterations * target / ns) : iterations * 100;
+            iterations = std::max(iterations * 2, std::min(next, iterations * 100));
+        }
+    }
+
+    static void printHeader(std::ostream &o)
+    {
+        o << std::left << std::setw(44) << "benchmark"
+          << std::right << std::setw(12) << "iterations"
+          << std::setw(14) << "ns/op"
+          << std::setw(12) << "B/op"
+          << std::setw(12) << "allocs/op"
+          << std::setw(10) << "MB/s" << std::endl;
+    }
+
+    static void print(std::ostream &o, const Result &r)
+    {
+        o << std::left << std::setw(44) << r.name
+          << std::right << std::setw(12) << r.iterations
+          << std::fixed << std::setprecision(1)
+          << std::setw(14) << r.nsPerOp
+          << std::setw(12) << r.bytesPerOp
+          << std::setw(12) << r.allocsPerOp;
+        if (r.inputBytes > 0) {
+            o << std::setw(10) << r.inputBytes / r.nsPerOp * 1e9 / (1 << 20);
+        }
+        o << std::endl;
+    }
+
+    void printJson(std::ostream &o) const
+    {
+        rapidjson::StringBuffer s;
+        rapidjson::Writer<rapidjson::StringBuffer> w(s);
+
+        w.StartObject();
+        w.String("benchmarks");
+        w.StartArray();
+        for (auto it = mResults.begin(); it != mResults.end(); it++) {
+            w.StartObject();
+            w.String("name");
+            w.String(it->name.c_str(), it->name.size());
+            w.String("inputBytes");
+            w.Uint64(it->inputBytes);
+            w.String("iterations");
+            w.Uint64(it->iterations);
+            w.String("nsPerOp");
+            w.Double(it->nsPerOp);
+            w.String("bytesPerOp");
+            w.Double(it->bytesPerOp);
+            w.String("allocsPerOp");
+            w.Double(it->allocsPerOp);
+            w.EndObject();
+        }
+        w.EndArray();
+        w.EndObject();
+
+        o << s.GetString() << std::endl;
+    }
+
+private:
+    const Options &mOptions;
+    std::vector<Result> mResults;
+};
+
+bool parseOptions(int argc, char *argv[], Options &options)
+{
+    using namespace boost::program_options;
+
+    options_description desc("Allowed options");
+    desc.add_options()
+            ("help", "produce help message")
+            ("corpus", value<std::string>(&options.corpus)->default_value("bench/corpus"), "directory with *.xml feeds")
+            ("filter", value<std::string>(&options.filter)->default_value(""), "run only benchmarks with names containing it")
+            ("min-time", value<unsigned>(&options.minTime)->default_value(200), "min measured time per benchmark, ms")
+            ("json", bool_switch(&options.json), "print results as json");
+
+    variables_map vars;
+    try {
+        store(parse_command_line(argc, argv, desc), vars);
+        notify(vars);
+    } catch (const boost::program_options::error &err) {
+        std::cerr << err.what() << std::endl;
+        return false;
+    }
+
+    if (vars.count("help") > 0) {
+        std::cout << "rssproxy micro-benchmarks" << std::endl << desc << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+/// returns sorted names of *.xml files in dir
+std::vector<std::string> listCorpus(const std::string &dir)
+{
+    std::vector<std::string> names;
+
+    DIR *d = opendir(dir.c_str());
+    if (!d) {
+        return names;
+    }
+
+    while (dirent *entry = readdir(d)) {
+        const std::string name = entry->d_name;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".xml") == 0) {
+            names.push_back(name);
+        }
+    }
+    closedir(d);
+
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+bool readFile(const std::string &path, std::string &content)
+{
+    std::ifstream in(path.c_str(), std::ios::binary);
+    if (!in) {
+        return false;
+    }
+
+    std::ostringstream o;
+    o << in.rdbuf();
+    content = o.str();
+    return true;
+}
+
+void benchConversion(Bench &bench, const Options &options)
+{
+    const std::vector<std::string> names = listCorpus(options.corpus);
+    if (names.empty()) {
+        std::cerr << "no feeds found in " << options.corpus << std::endl;
+    }
+
+    RssConvertOptions projection;
+    projection.parseFields("title,link");
+
+    for (auto it = names.begin(); it != names.end(); it++) {
+        std::string rss;
+        if (!readFile(options.corpus + "/" + *it, rss)) {
+            std::cerr << "failed to read " << *it << std::endl;
+            continue;
+        }
+
+        bool ok = false;
+        convertRssToJson(rss, ok);
+        if (!ok) {
+            std::cerr << "failed to convert " << *it << ", skipped" << std::endl;
+            continue;
+        }
+
+        const std::string feed = it->substr(0, it->size() - 4);
+
+        bench.run("convertRssToJson/" + feed, rss.size(), [&rss]() {
+            bool ok = false;
+            gSink += convertRssToJson(rss, ok).size();
+        });
+
+        bench.run("convertRssToJson/" + feed + "/title,link", rss.size(), [&rss, &projection]() {
+            bool ok = false;
+            gSink += convertRssToJson(rss, projection, ok).size();
+        });
+    }
+}
+
+void benchParsing(Bench &bench)
+{
+    const std::string date = "Sat, 12 Nov 2016 18:02:00 +0300";
+    bench.run("RFC882::toUTC", date.size(), [&date]() {
+        bool ok = false;
+        gSink += RFC882::toUTC(date, ok);
+    });
+
+    const std::string url = "https://example.org:8443/rss/feed.xml?utm_source=rss&utm_medium=feed";
+    bench.run("Uri::Uri", url.size(), [&url]() {
+        Uri uri(url);
+        gSink += uri.getPath().size();
+    });
+
+    const std::string decoded = "https://example.org/rss/feed.xml?q=async io&lang=ru&tag=c++";
+    const std::string encoded = Uri::encode(decoded);
+    bench.run("Uri::encode", decoded.size(), [&decoded]() {
+        gSink += Uri::encode(decoded).size();
+    });
+
+    bench.run("Uri::decode", encoded.size(), [&encoded]() {
+        gSink += Uri::decode(encoded).size();
+    });
+
+    // request and response heads are copied into a fresh buffer each time,
+    // just like the server and client read them from sockets
+    const std::string requestHead =
+            "GET /?fields=title,link&limit=20&url=https%3A%2F%2Fexample.org%2Frss%2Ffeed.xml HTTP/1.1\r\n"
+            "Host: localhost:8080\r\n"
+            "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko)\r\n"
+            "Accept: application/json, text/plain, */*\r\n"
+            "Accept-Encoding: gzip, deflate\r\n"
+            "Accept-Language: en-US,en;q=0.9,ru;q=0.8\r\n"
+            "Connection: keep-alive\r\n"
+            "\r\n";
+    bench.run("Server::Request::parse", requestHead.size(), [&requestHead]() {
+        Server::Request req(Server::ConnectionPtr(), 8192);
+        req.buf.sputn(requestHead.data(), requestHead.size());
+        req.parse();
+        gSink += req.headers.size();
+    });
+
+    const std::string responseHead =
+            "HTTP/1.1 200 OK\r\n"
+            "Server: nginx\r\n"
+            "Date: Sat, 12 Nov 2016 18:30:00 GMT\r\n"
+            "Content-Type: application/rss+xml; charset=utf-8\r\n"
+            "Content-Length: 51024\r\n"
+            "Connection: close\r\n"
+            "Last-Modified: Sat, 12 Nov 2016 18:02:00 GMT\r\n"
+            "ETag: \"5827603a-c750\"\r\n"
+            "Cache-Control: max-age=300\r\n"
+            "\r\n";
+    bench.run("Client::Response::parseHeaders", responseHead.size(), [&responseHead]() {
+        Client::Response res;
+        res.buf.sputn(responseHead.data(), responseHead.size());
+        res.parseHeaders();
+        gSink += res.headers.size();
+    });
+}
+
+/// what every request pays for its config snapshot, next to the
+/// std::atomic_load the store used before; single threaded, so the shared
+/// lock pool behind atomic_load shows its uncontended cost only
+void benchConfig(Bench &bench)
+{
+    ConfigStore store((ServerConfigPtr()));
+    bench.run("ConfigStore::get", 0, [&store]() {
+        gSink += store.get() ? 1 : 0;
+    });
+
+    ServerConfigPtr config;
+    bench.run("std::atomic_load(ServerConfigPtr)", 0, [&config]() {
+        gSink += std::atomic_load(&config) ? 1 : 0;
+    });
+}
+
+void benchSerialization(Bench &bench, const Options &options)
+{
+    Server::Response res;
+    res.httpCode = Server::Response::HttpCode_OK;
+    res.headers["Content-Type"] = "application/json";
+
+    std::string rss;
+    bool ok = false;
+    if (readFile(options.corpus + "/medium.xml", rss)) {
+        res.body = convertRssToJson(rss, ok);
+    }
+    if (!ok) {
+        res.body = std::string(32 * 1024, 'x');
+    }
+
+    bench.run("operator<<(Server::Response)", res.body.size(), [&res]() {
+        boost::asio::streambuf buf;
+        std::ostream o(&buf);
+        o << res;
+        gSink += buf.size();
+    });
+}
+
+/// fetches url with a fresh Client, running the service until the client
+/// is done with the exchange and has dropped all its handlers
+void fetch(boost::asio::io_service &service, const Client::ContextPtr &context, const std::string &url)
+{
+    auto client = std::make_shared<Client>(service, context);
+    client->sendRequest("GET", url, 5000, [](const Client::ResponsePtr &res) {
+        gSink += res->body.size();
+    });
+
+    while (client.use_count() > 1) {
+        service.run_one();
+    }
+}
+
+void benchClient(Bench &bench, const Options &options)
+{
+    std::string rss;
+    if (!readFile(options.corpus + "/medium.xml", rss)) {
+        rss = std::string(32 * 1024, 'x');
+    }
+
+    // client and origin share one thread, so the figures include both sides
+    // of a loopback exchange; the origin's share is the same for every client
+    boost::asio::io_service service;
+    FakeUpstream upstream(service, 0, [&rss](const std::string &path) {
+        FakeUpstream::Reply reply;
+        reply.body = rss;
+        reply.chunked = path == "/chunked.xml";
+        return reply;
+    });
+
+    std::ostringstream o;
+    o << "http://127.0.0.1:" << upstream.getPort();
+    const std::string url = o.str() + "/feed.xml";
+    const std::string chunkedUrl = o.str() + "/chunked.xml";
+
+    // the service runs on this thread only, so both contexts are valid here
+    const auto context = std::make_shared<Client::Context>(service, true);
+    const auto strandContext = std::make_shared<Client::Context>(service, false);
+
+    bench.run("Client::sendRequest/loopback", rss.size(), [&service, &context, &url]() {
+        fetch(service, context, url);
+    });
+    bench.run("Client::sendRequest/loopback/chunked", rss.size(), [&service, &context, &chunkedUrl]() {
+        fetch(service, context, chunkedUrl);
+    });
+    bench.run("Client::sendRequest/loopback/strand", rss.size(), [&service, &strandContext, &url]() {
+        fetch(service, strandContext, url);
+    });
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        return 1;
+    }
+
+    Bench bench(options);
+    if (!options.json) {
+        Bench::printHeader(std::cout);
+    }
+
+    benchConversion(bench, options);
+    benchParsing(bench);
+    benchConfig(bench);
+    benchSerialization(bench, options);
+    benchClient(bench, options);
+
+    if (options.json) {
+        bench.printJson(std::cout);
+    }
+
+    return 0;
+}
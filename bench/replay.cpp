@@ -0,0 +1,490 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+
+#include <boost/asio/steady_timer.hpp>
+#include <boost/program_options.hpp>
+#include <boost/thread.hpp>
+
+#include "rapidjson/document.h"
+
+#include "client.h"
+
+#include "fakeupstream.h"
+#include "latencystats.h"
+#include "syntheticfeed.h"
+
+/// Replays recorded traffic against a running rssproxy. Every feed url of
+/// the recording is served by an in-process origin with the recorded body,
+/// so the proxy sees production-shaped request mix and timing, e.g.
+///
+///   bin/rssproxy_replay --input traffic.jsonl --target 127.0.0.1:8080 --speed 10
+///
+/// Input is one json object per line:
+///
+///   {"timestamp": 1479000000.25, "url": "https://example.org/rss.xml",
+///    "query": "fields=title,link&limit=10", "status": 200, "body": "<rss>...</rss>"}
+///
+/// timestamp (seconds) and url are required. query holds extra proxy
+/// parameters. body and status, when recorded, replace what the origin
+/// serves for that url from the record's replay time on; urls without a
+/// recorded body get a synthetic feed.
+
+typedef std::chrono::steady_clock Clock;
+
+namespace {
+
+struct Options {
+    std::string input;
+    std::string target;
+    unsigned short upstreamPort;
+    double speed;
+    unsigned threads;
+    unsigned timeout;
+    unsigned items;
+    unsigned itemSize;
+    unsigned top;
+};
+
+struct Record {
+    Record()
+        : timestamp(0),
+          feed(0),
+          status(0)
+    { }
+
+    /// recorded upstream reply replaces what the origin serves for the feed
+    bool hasReply() const { return status != 0; }
+
+    double timestamp;
+    std::size_t feed; // index in Origin feeds
+    std::string query;
+    unsigned status;  // 0 if no upstream reply was recorded
+    std::string body;
+};
+
+/// Stand-in for all upstream hosts of the recording, counts fetches per feed
+class Origin
+{
+public:
+    Origin(const std::string &defaultBody)
+        : mDefaultBody(defaultBody)
+    { }
+
+    std::size_t addFeed(const std::string &url)
+    {
+        auto it = mIndex.find(url);
+        if (it != mIndex.end()) {
+            return it->second;
+        }
+
+        mFeeds.push_back(Feed());
+        mFeeds.back().url = url;
+        mFeeds.back().body = mDefaultBody;
+        mIndex[url] = mFeeds.size() - 1;
+        return mFeeds.size() - 1;
+    }
+
+    void update(std::size_t feed, unsigned status, const std::string &body)
+    {
+        LockGuard g(mMutex);
+        mFeeds[feed].status = status;
+        mFeeds[feed].body = body;
+    }
+
+    void countRequest(std::size_t feed)
+    {
+        LockGuard g(mMutex);
+        mFeeds[feed].requests++;
+    }
+
+    /// serves "/feed/<index>"
+    FakeUpstream::Reply serve(const std::string &path)
+    {
+        FakeUpstream::Reply reply;
+
+        std::size_t feed = 0;
+        std::istringstream s(path);
+        if (path.compare(0, 6, "/feed/") != 0 || !(s.ignore(6) >> feed) || feed >= mFeeds.size()) {
+            reply.httpCode = 404;
+            return reply;
+        }
+
+        LockGuard g(mMutex);
+        Feed &f = mFeeds[feed];
+        f.fetches++;
+        reply.httpCode = f.status;
+        reply.body = f.body;
+        return reply;
+    }
+
+    std::size_t getFeedCount() const { return mFeeds.size(); }
+
+    /// proxy requests vs upstream fetches: overall, by feed hit ratio and for the busiest feeds
+    void printCacheStats(std::ostream &o, unsigned top) const;
+
+private:
+    struct Feed {
+        Feed()
+            : status(200),
+              requests(0),
+              fetches(0)
+        { }
+
+        std::string url;
+        unsigned status;
+        std::string body;
+        std::uint64_t requests;
+        std::uint64_t fetches;
+    };
+
+    const std::string mDefaultBody;
+    std::vector<Feed> mFeeds;
+    std::map<std::string, std::size_t> mIndex;
+
+    mutable boost::mutex mMutex;
+    typedef boost::lock_guard<boost::mutex> LockGuard;
+};
+
+double hitRatio(std::uint64_t requests, std::uint64_t fetches)
+{
+    if (requests == 0 || fetches >= requests) {
+        return 0;
+    }
+    return double(requests - fetches) / requests;
+}
+
+void Origin::printCacheStats(std::ostream &o, unsigned top) const
+{
+    std::vector<Feed> feeds;
+    {
+        LockGuard g(mMutex);
+        feeds = mFeeds;
+    }
+
+    std::uint64_t requests = 0;
+    std::uint64_t fetches = 0;
+    // feeds by hit ratio: 0%, (0, 25%), [25, 50%), [50, 75%), [75%, 100%]
+    const char *bucketNames[] = { "0%", "<25%", "<50%", "<75%", "<=100%" };
+    std::uint64_t buckets[5] = { 0, 0, 0, 0, 0 };
+
+    for (auto it = feeds.begin(); it != feeds.end(); it++) {
+        if (it->requests == 0) {
+            continue;
+        }
+        requests += it->requests;
+        fetches += it->fetches;
+
+        const double ratio = hitRatio(it->requests, it->fetches);
+        buckets[ratio == 0 ? 0 : 1 + std::min(3, int(ratio * 4))]++;
+    }
+
+    o << std::fixed << std::setprecision(2)
+      << "upstream fetches:\t" << fetches << std::endl
+      << "cache hit ratio:\t" << hitRatio(requests, fetches) * 100 << "%" << std::endl
+      << "feeds by hit ratio:";
+    for (int i = 0; i < 5; i++) {
+        o << "\t" << bucketNames[i] << " " << buckets[i];
+    }
+    o << std::endl;
+
+    std::sort(feeds.begin(), feeds.end(), [](const Feed &a, const Feed &b) {
+        return a.requests > b.requests;
+    });
+    if (feeds.size() > top) {
+        feeds.resize(top);
+    }
+
+    o << "busiest feeds:\trequests\tfetches\thit ratio\turl" << std::endl;
+    for (auto it = feeds.begin(); it != feeds.end() && it->requests > 0; it++) {
+        o << "\t\t" << it->requests << "\t\t" << it->fetches << "\t"
+          << hitRatio(it->requests, it->fetches) * 100 << "%\t\t" << it->url << std::endl;
+    }
+}
+
+bool parseOptions(int argc, char *argv[], Options &options)
+{
+    using namespace boost::program_options;
+
+    options_description desc("Allowed options");
+    desc.add_options()
+            ("help", "produce help message")
+            ("input", value<std::string>(&options.input), "recorded requests, jsonl")
+            ("target", value<std::string>(&options.target)->default_value("127.0.0.1:8080"), "rssproxy host:port")
+            ("upstream-port", value<unsigned short>(&options.upstreamPort)->default_value(0), "stand-in upstream port, 0 picks a free one")
+            ("speed", value<double>(&options.speed)->default_value(1), "replay rate relative to the recording, 0 sends all at once")
+            ("threads", value<unsigned>(&options.threads)->default_value(2), "client threads")
+            ("timeout", value<unsigned>(&options.timeout)->default_value(5000), "request timeout, ms")
+            ("items", value<unsigned>(&options.items)->default_value(20), "items per synthetic feed")
+            ("item-size", value<unsigned>(&options.itemSize)->default_value(512), "bytes of description per synthetic item")
+            ("top", value<unsigned>(&options.top)->default_value(10), "count of busiest feeds to report");
+
+    variables_map vars;
+    try {
+        store(parse_command_line(argc, argv, desc), vars);
+        notify(vars);
+    } catch (const boost::program_options::error &err) {
+        std::cerr << err.what() << std::endl;
+        return false;
+    }
+
+    if (vars.count("help") > 0 || options.input.empty() || options.speed < 0) {
+        std::cout << "rssproxy traffic replay" << std::endl << desc << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+/// reads records sorted by timestamp, malformed lines are reported and skipped
+bool loadRecords(const std::string &path, Origin &origin, std::vector<Record> &records)
+{
+    std::ifstream in(path.c_str());
+    if (!in) {
+        std::cerr << "failed to open " << path << std::endl;
+        return false;
+    }
+
+    std::string line;
+    for (unsigned lineNo = 1; std::getline(in, line); lineNo++) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+
+        rapidjson::Document doc;
+        doc.Parse(line.c_str());
+        if (doc.HasParseError() || !doc.IsObject() ||
+            !doc.HasMember("url") || !doc["url"].IsString() ||
+            !doc.HasMember("timestamp") || !doc["timestamp"].IsNumber()) {
+            std::cerr << path << ":" << lineNo << ": malformed record, skipped" << std::endl;
+            continue;
+        }
+
+        Record r;
+        r.timestamp = doc["timestamp"].GetDouble();
+        r.feed = origin.addFeed(doc["url"].GetString());
+        if (doc.HasMember("query") && doc["query"].IsString()) {
+            r.query = doc["query"].GetString();
+        }
+        if (doc.HasMember("body") && doc["body"].IsString()) {
+            r.body.assign(doc["body"].GetString(), doc["body"].GetStringLength());
+            r.status = 200;
+        }
+        if (doc.HasMember("status") && doc["status"].IsUint()) {
+            r.status = doc["status"].GetUint();
+        }
+
+        records.push_back(r);
+    }
+
+    std::stable_sort(records.begin(), records.end(), [](const Record &a, const Record &b) {
+        return a.timestamp < b.timestamp;
+    });
+
+    return !records.empty();
+}
+
+class Replayer
+{
+public:
+    Replayer(boost::asio::io_service &service, const Options &options, Origin &origin,
+             const std::vector<Record> &records, unsigned short upstreamPort)
+        : mIOService(service),
+          mOptions(options),
+          mOrigin(origin),
+          mRecords(records),
+          mClientContext(std::make_shared<Client::Context>(service, options.threads == 1)),
+          mTimer(service),
+          mNext(0),
+          mInFlight(0),
+          mStopping(false)
+    {
+        std::ostringstream o;
+        o << "http://127.0.0.1:" << upstreamPort << "/feed/";
+        mUpstreamPrefix = o.str();
+    }
+
+    void start()
+    {
+        mStart = Clock::now();
+        tick();
+    }
+
+    void wait()
+    {
+        boost::unique_lock<boost::mutex> lock(mMutex);
+        while (!mStopping || mInFlight > 0) {
+            mDone.wait(lock);
+        }
+    }
+
+    double getElapsed() const
+    {
+        return std::chrono::duration<double>(mFinish - mStart).count();
+    }
+
+    const LatencyStats &getStats() const { return mStats; }
+
+private:
+    Clock::time_point scheduledAt(const Record &r) const
+    {
+        if (mOptions.speed == 0) {
+            return mStart;
+        }
+        const double offset = (r.timestamp - mRecords.front().timestamp) / mOptions.speed;
+        return mStart + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(offset));
+    }
+
+    void tick()
+    {
+        // everything due is sent at once, the timer only sleeps over gaps
+        const Clock::time_point now = Clock::now();
+        while (mNext < mRecords.size() && scheduledAt(mRecords[mNext]) <= now) {
+            send(mRecords[mNext]);
+            mNext++;
+        }
+
+        if (mNext == mRecords.size()) {
+            stop();
+            return;
+        }
+
+        mTimer.expires_at(scheduledAt(mRecords[mNext]));
+        mTimer.async_wait([this](const boost::system::error_code &err) {
+            if (!err) {
+                tick();
+            }
+        });
+    }
+
+    void send(const Record &r)
+    {
+        {
+            boost::lock_guard<boost::mutex> g(mMutex);
+            mInFlight++;
+        }
+
+        if (r.hasReply()) {
+            mOrigin.update(r.feed, r.status, r.body);
+        }
+        mOrigin.countRequest(r.feed);
+
+        std::ostringstream url;
+        url << "http://" << mOptions.target << "/?";
+        if (!r.query.empty()) {
+            url << r.query << "&";
+        }
+        // plain url goes last, the proxy takes the rest of the query as is
+        url << "url=" << mUpstreamPrefix << r.feed;
+
+        // latency is measured from the scheduled time, a proxy falling behind
+        // the recording can't hide its queueing delay
+        const Clock::time_point scheduled = scheduledAt(r);
+
+        auto client = std::make_shared<Client>(mIOService, mClientContext);
+        client->sendRequest("GET", url.str(), mOptions.timeout, [this, scheduled](const Client::ResponsePtr &res) {
+            const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - scheduled);
+            mStats.add(latency.count(), res->httpCode);
+
+            boost::lock_guard<boost::mutex> g(mMutex);
+            if (--mInFlight == 0 && mStopping) {
+                mFinish = Clock::now();
+                mDone.notify_all();
+            }
+        });
+    }
+
+    void stop()
+    {
+        boost::lock_guard<boost::mutex> g(mMutex);
+        mStopping = true;
+        if (mInFlight == 0) {
+            mFinish = Clock::now();
+        }
+        mDone.notify_all();
+    }
+
+    boost::asio::io_service &mIOService;
+    const Options &mOptions;
+    Origin &mOrigin;
+    const std::vector<Record> &mRecords;
+    std::string mUpstreamPrefix;
+    const Client::ContextPtr mClientContext;
+    boost::asio::steady_timer mTimer;
+
+    Clock::time_point mStart;
+    Clock::time_point mFinish;
+    std::size_t mNext;
+
+    unsigned mInFlight;
+    bool mStopping;
+    boost::mutex mMutex;
+    boost::condition_variable mDone;
+
+    LatencyStats mStats;
+};
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        return 1;
+    }
+
+    Origin origin(makeSyntheticFeed(options.items, options.itemSize));
+    std::vector<Record> records;
+    if (!loadRecords(options.input, origin, records)) {
+        std::cerr << "no records to replay" << std::endl;
+        return 1;
+    }
+
+    const double span = records.back().timestamp - records.front().timestamp;
+    std::cout << std::fixed << std::setprecision(2)
+              << "records:\t" << records.size() << std::endl
+              << "feeds:\t\t" << origin.getFeedCount() << std::endl
+              << "recorded span:\t" << span << " s" << std::endl
+              << "replay span:\t" << (options.speed > 0 ? span / options.speed : 0) << " s" << std::endl;
+
+    // stand-in origin runs on its own thread so it doesn't compete with the client
+    boost::asio::io_service upstreamService;
+    FakeUpstream upstream(upstreamService, options.upstreamPort, [&origin](const std::string &path) {
+        return origin.serve(path);
+    });
+
+    boost::thread_group threads;
+    std::unique_ptr<boost::asio::io_service::work> upstreamWork(new boost::asio::io_service::work(upstreamService));
+    threads.create_thread([&upstreamService]() {
+        upstreamService.run();
+    });
+
+    boost::asio::io_service service;
+    std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(service));
+    for (unsigned i = 0; i < options.threads; i++) {
+        threads.create_thread([&service]() {
+            service.run();
+        });
+    }
+
+    Replayer replayer(service, options, origin, records, upstream.getPort());
+    service.post([&replayer]() {
+        replayer.start();
+    });
+    replayer.wait();
+
+    work.reset();
+    upstreamWork.reset();
+    service.stop();
+    upstreamService.stop();
+    threads.join_all();
+
+    replayer.getStats().print(std::cout, replayer.getElapsed());
+    origin.printCacheStats(std::cout, options.top);
+
+    return 0;
+}
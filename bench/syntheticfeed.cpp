@@ -0,0 +1,36 @@
+#include "syntheticfeed.h"
+
+#include <ctime>
+#include <sstream>
+
+std::string makeSyntheticFeed(unsigned items, unsigned itemSize)
+{
+    std::ostringstream o;
+    o << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+      << "<rss version=\"2.0\"><channel>\n"
+      << "<title>Synthetic feed</title>\n"
+      << "<link>http://localhost/</link>\n"
+      << "<description>Generated by rssproxy benchmarks</description>\n";
+
+    std::time_t now = std::time(nullptr);
+    const std::string text(itemSize, 'x');
+
+    for (unsigned i = 0; i < items; i++) {
+        std::time_t pubDate = now - i * 3600;
+        std::tm tm;
+        gmtime_r(&pubDate, &tm);
+        char date[64];
+        std::strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S +0000", &tm);
+
+        o << "<item>"
+          << "<title>Item " << i << " &amp; friends</title>"
+          << "<link>http://localhost/items/" << i << "</link>"
+          << "<guid>http://localhost/items/" << i << "</guid>"
+          << "<description>&lt;p&gt;" << text << "&lt;/p&gt;</description>"
+          << "<pubDate>" << date << "</pubDate>"
+          << "</item>\n";
+    }
+
+    o << "</channel></rss>\n";
+    return o.str();
+}
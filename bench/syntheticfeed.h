@@ -0,0 +1,7 @@
+#pragma once
+
+#include <string>
+
+/// rss 2.0 feed with the given count of items published an hour apart,
+/// newest first, each carrying itemSize bytes of escaped html description
+std::string makeSyntheticFeed(unsigned items, unsigned itemSize);
@@ -1,11 +1,34 @@
 #include "client.h"
 
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
 #include <iostream>
-#include <boost/bind.hpp>
+
+#include <strings.h>
 
 #include "uri.h"
 
 #define SUPPORTED_HTTP_VERSION "HTTP/1.1"
+#define REQUESTED_HOST_UNAVAILABLE 434
+#define SERVICE_UNAVAILABLE 503
+// larger bodies grow as they arrive, so a bogus Content-Length can't pin memory
+#define MAX_BODY_PREALLOCATION (1 << 20)
+// a chunk is buffered whole before it goes to the body
+#define MAX_CHUNK_SIZE (16 * 1024 * 1024)
+// a whole chunk plus what was read along with its size line
+#define MAX_RESPONSE_BUFFER (MAX_CHUNK_SIZE + 64 * 1024)
+// ms, request deadlines fire up to that late
+#define DEADLINE_RESOLUTION 10
+#define MAX_IDLE_CONNECTIONS_PER_HOST 8
+// ms, origins commonly drop idle keep-alive connections after 15-75 s
+#define IDLE_CONNECTION_TIMEOUT 15000
+#define LOOP_DETECTED 508
+#define MAX_REDIRECTS 5
+#define MAX_CACHED_REDIRECTS 4096
+// ms, a cached permanent redirect is followed anew after that long
+#define CACHED_REDIRECT_TTL (24 * 3600 * 1000)
 
 namespace {
 
@@ -23,6 +46,46 @@ inline std::string &trim(std::string &s) {
     return ltrim(rtrim(s));
 }
 
+// ex_data slots leading new session tickets back to the Context and the
+// Connection key to cache them under; asio keeps app_data for itself
+int contextIndex()
+{
+    static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+int connectionIndex()
+{
+    static const int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+bool isRedirect(uint httpCode)
+{
+    return httpCode == 301 || httpCode == 302 || httpCode == 303 || httpCode == 307 || httpCode == 308;
+}
+
+/// absolute url of a Location header relative to base
+std::string resolveLocation(const Uri &base, const std::string &location)
+{
+    const std::size_t scheme = location.find("://");
+    if (scheme != std::string::npos && scheme < location.find_first_of("/?")) {
+        return location;
+    }
+    if (location.compare(0, 2, "//") == 0) {
+        return base.getProtocol() + ":" + location;
+    }
+
+    const std::string origin = base.getProtocol() + "://" + base.getHost() + ":" + base.getPort();
+    if (!location.empty() && location[0] == '/') {
+        return origin + location;
+    }
+
+    const std::string &path = base.getPath();
+    const std::size_t slash = path.rfind('/');
+    return origin + (slash == std::string::npos ? "/" : path.substr(0, slash + 1)) + location;
+}
+
 } // namespace
 
 std::ostream &operator <<(std::ostream &o, const Client::Request &req)
@@ -31,11 +94,60 @@ std::ostream &operator <<(std::ostream &o, const Client::Request &req)
     o << req.type << " " << path << " " << SUPPORTED_HTTP_VERSION << "\r\n"
       << "Host: " << req.host << "\r\n"
       << "Accept: " << "*/*" << "\r\n"
-      << "Connection: " << "close" << "\r\n\r\n";
+      << "Connection: " << (req.keepAlive ? "keep-alive" : "close") << "\r\n\r\n";
 
     return o;
 }
 
+Client::BufferBudget::BufferBudget(std::size_t maxBytes)
+    : mUsed(0),
+      mMax(maxBytes),
+      mRejected(0)
+{ }
+
+bool Client::BufferBudget::reserve(std::size_t bytes)
+{
+    const std::size_t max = mMax.load();
+    std::size_t used = mUsed.load();
+    do {
+        if (max > 0 && used + bytes > max) {
+            mRejected++;
+            return false;
+        }
+    } while (!mUsed.compare_exchange_weak(used, used + bytes));
+    return true;
+}
+
+void Client::BufferBudget::release(std::size_t bytes)
+{
+    mUsed -= bytes;
+}
+
+Client::Response::Response()
+    : httpCode(0),
+      buf(MAX_RESPONSE_BUFFER),
+      mReserved(0)
+{ }
+
+Client::Response::~Response()
+{
+    if (mBudget) {
+        mBudget->release(mReserved);
+    }
+}
+
+bool Client::Response::reserve(std::size_t bytes)
+{
+    if (!mBudget) {
+        return true;
+    }
+    if (!mBudget->reserve(bytes)) {
+        return false;
+    }
+    mReserved += bytes;
+    return true;
+}
+
 void Client::Response::parseHeaders()
 {
     std::istream bufStream(&buf);
@@ -78,228 +190,750 @@ void Client::Response::parseHeaders()
     }
 }
 
+std::string Client::Response::getHeader(const std::string &name) const
+{
+    for (auto it = headers.begin(); it != headers.end(); it++) {
+        if (it->first.size() == name.size() && strncasecmp(it->first.c_str(), name.c_str(), name.size()) == 0) {
+            return it->second;
+        }
+    }
+    return std::string();
+}
+
 /// ==========================================================================
 
-Client::Client(boost::asio::io_service &service)
-    : mIOService(service),
-      mResolver(service),
-      mStrand(service)
+Client::Connection::Connection(boost::asio::io_service &service, boost::asio::ssl::context *tls)
+    : mSocket(service)
 {
-    mSocket = std::make_shared<boost::asio::ip::tcp::socket>(service);
+    if (tls) {
+        mTls.reset(new TlsStream(mSocket, *tls));
+        SSL_set_ex_data(mTls->native_handle(), connectionIndex(), this);
+    }
 }
 
-void Client::sendRequest(const std::string &reqType, const std::string &url, unsigned timeout, HandlerFunc func)
+void Client::Connection::close()
 {
-    mUri = Uri(url);
-    mRequestType = reqType;
+    // no close_notify is sent, but the session must not be marked bad for
+    // that or OpenSSL refuses to resume it
+    if (mTls) {
+        SSL_set_shutdown(mTls->native_handle(), SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    }
+
+    boost::system::error_code ec;
+    mSocket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+    mSocket.close(ec);
+}
+
+Client::Context::Context(boost::asio::io_service &service, bool singleThread)
+    : mTimers(service, DEADLINE_RESOLUTION),
+      mSingleThread(singleThread),
+      mTls(boost::asio::ssl::context::tls_client),
+      mHandshakes(0),
+      mResumedHandshakes(0),
+      mReusedConnections(0),
+      mRedirects(0),
+      mCachedRedirects(0),
+      mRedirectLoops(0)
+{
+    mTls.set_options(boost::asio::ssl::context::default_workarounds |
+                     boost::asio::ssl::context::no_sslv2 |
+                     boost::asio::ssl::context::no_sslv3);
+    mTls.set_verify_mode(boost::asio::ssl::verify_peer);
+
+    boost::system::error_code ec;
+    mTls.set_default_verify_paths(ec);
+
+    // sessions are kept per host by onNewSession, OpenSSL's own client cache is never looked up
+    SSL_CTX *ctx = mTls.native_handle();
+    SSL_CTX_set_ex_data(ctx, contextIndex(), this);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, &Context::onNewSession);
+}
 
-    const std::string &port = mUri.getPort();
-    if (port.empty()) {
-        mUri.setPort("80");
+Client::Context::~Context()
+{
+    for (auto &session : mSessions) {
+        SSL_SESSION_free(session.second);
+    }
+    for (auto &idle : mIdle) {
+        for (auto &connection : idle.second) {
+            connection->close();
+        }
     }
+}
 
-    auto thisPtr = shared_from_this();
+bool Client::Context::loadCaFile(const std::string &path)
+{
+    boost::system::error_code ec;
+    mTls.load_verify_file(path, ec);
+    return !ec;
+}
 
-    mFinished = false;
-    mWithTimeout = false;
+int Client::Context::onNewSession(SSL *ssl, SSL_SESSION *session)
+{
+    Context *context = static_cast<Context *>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), contextIndex()));
+    Connection *connection = static_cast<Connection *>(SSL_get_ex_data(ssl, connectionIndex()));
+    if (!context || !connection) {
+        return 0;
+    }
 
-    if (timeout > 0) {
-        mWithTimeout = true;
-        mTimer = std::make_shared<boost::asio::deadline_timer>(mIOService);
-        mTimer->expires_from_now(boost::posix_time::milliseconds(timeout));
-        mTimer->async_wait(mStrand.wrap([thisPtr, func](const boost::system::error_code &err) {
-            if (!err) {
-                if (!thisPtr->mFinished) {
-                    thisPtr->mFinished = true;
-
-                    boost::system::error_code ec;
-                    thisPtr->mSocket->lowest_layer().shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
-                    thisPtr->mSocket->lowest_layer().close();
-
-                    ResponsePtr res(new Response);
-                    res->httpCode = 434;
-                    res->version = SUPPORTED_HTTP_VERSION;
-                    func(res);
-                }
-            }
-        }));
+    // TLS 1.3 servers send tickets after the handshake, so this runs on
+    // whichever thread reads the response
+    SSL_SESSION *replaced = nullptr;
+    {
+        LockGuard g(context->mMutex);
+        SSL_SESSION *&cached = context->mSessions[connection->getKey()];
+        replaced = cached;
+        cached = session;
     }
+    if (replaced) {
+        SSL_SESSION_free(replaced);
+    }
+    // the session is ours now
+    return 1;
+}
 
-    boost::asio::ip::tcp::resolver::query query(mUri.getHost(), mUri.getPort());
-    //socket->set_option(boost::asio::ip::tcp::no_delay(true));
+void Client::Context::prepareHandshake(Connection &connection, const std::string &host)
+{
+    SSL *ssl = connection.getSSL();
 
-    mResolver.async_resolve(query, mStrand.wrap(
-    [func, thisPtr](const boost::system::error_code& err, boost::asio::ip::tcp::resolver::iterator it) {
-        if (err) {
-            if (!thisPtr->mFinished) {
-                thisPtr->finished();
+    // SNI carries host names only, not address literals
+    boost::system::error_code ec;
+    boost::asio::ip::address::from_string(host, ec);
+    if (ec) {
+        SSL_set_tlsext_host_name(ssl, host.c_str());
+    }
+    connection.mTls->set_verify_callback(boost::asio::ssl::host_name_verification(host));
 
-                ResponsePtr res(new Response);
-                res->httpCode = 434;
-                res->version = SUPPORTED_HTTP_VERSION;
-                func(res);
+    LockGuard g(mMutex);
+    auto it = mSessions.find(connection.getKey());
+    if (it != mSessions.end()) {
+        // takes its own reference, a stale session just falls back to a full handshake
+        SSL_set_session(ssl, it->second);
+    }
+}
+
+void Client::Context::addHandshake(bool resumed)
+{
+    mHandshakes++;
+    if (resumed) {
+        mResumedHandshakes++;
+    }
+}
+
+Client::ConnectionPtr Client::Context::takeConnection(const std::string &key)
+{
+    const auto now = std::chrono::steady_clock::now();
+    ConnectionPtr connection;
+    std::vector<ConnectionPtr> expired;
+    {
+        LockGuard g(mMutex);
+        auto it = mIdle.find(key);
+        if (it == mIdle.end()) {
+            return connection;
+        }
+
+        std::vector<ConnectionPtr> &idle = it->second;
+        while (!idle.empty() && !connection) {
+            connection = idle.back();
+            idle.pop_back();
+            if (now - connection->mIdleSince > std::chrono::milliseconds(IDLE_CONNECTION_TIMEOUT)) {
+                // the rest is older still
+                expired.swap(idle);
+                expired.push_back(connection);
+                connection.reset();
             }
+        }
+        if (idle.empty()) {
+            mIdle.erase(it);
+        }
+    }
+
+    for (auto &stale : expired) {
+        stale->close();
+    }
+    if (connection) {
+        mReusedConnections++;
+    }
+    return connection;
+}
+
+void Client::Context::putConnection(const ConnectionPtr &connection)
+{
+    connection->mIdleSince = std::chrono::steady_clock::now();
+    {
+        LockGuard g(mMutex);
+        std::vector<ConnectionPtr> &idle = mIdle[connection->getKey()];
+        if (idle.size() < MAX_IDLE_CONNECTIONS_PER_HOST) {
+            idle.push_back(connection);
             return;
         }
+    }
+    connection->close();
+}
 
-        if (!thisPtr->mFinished) {
-            boost::asio::ip::tcp::endpoint endpoint = *it;
-            thisPtr->mSocket->async_connect(endpoint, thisPtr->mStrand.wrap(boost::bind(&Client::onConnect, thisPtr, func,
-                                                                            boost::asio::placeholders::error, ++it)));
+void Client::Context::addRedirect(const std::string &url, const std::string &location)
+{
+    const std::chrono::steady_clock::time_point expires =
+            std::chrono::steady_clock::now() + std::chrono::milliseconds(CACHED_REDIRECT_TTL);
+
+    LockGuard g(mMutex);
+    auto it = mMovedUrlIndex.find(url);
+    if (it != mMovedUrlIndex.end()) {
+        it->second->second.location = location;
+        it->second->second.expires = expires;
+        mMovedUrls.splice(mMovedUrls.begin(), mMovedUrls, it->second);
+        return;
+    }
+
+    MovedUrl moved = { location, expires };
+    mMovedUrls.emplace_front(url, moved);
+    mMovedUrlIndex[url] = mMovedUrls.begin();
+    if (mMovedUrls.size() > MAX_CACHED_REDIRECTS) {
+        mMovedUrlIndex.erase(mMovedUrls.back().first);
+        mMovedUrls.pop_back();
+    }
+}
+
+void Client::Context::findRedirects(std::vector<std::string> &chain, std::size_t maxLength)
+{
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    LockGuard g(mMutex);
+    while (chain.size() < maxLength) {
+        auto it = mMovedUrlIndex.find(chain.back());
+        if (it == mMovedUrlIndex.end()) {
+            break;
         }
-    }));
+        if (it->second->second.expires <= now) {
+            mMovedUrls.erase(it->second);
+            mMovedUrlIndex.erase(it);
+            break;
+        }
+
+        const std::string &location = it->second->second.location;
+        if (std::find(chain.begin(), chain.end(), location) != chain.end()) {
+            break;
+        }
+        mMovedUrls.splice(mMovedUrls.begin(), mMovedUrls, it->second);
+        chain.push_back(location);
+        mCachedRedirects++;
+    }
 }
 
-void Client::onConnect(HandlerFunc func, const boost::system::error_code &err, boost::asio::ip::tcp::resolver::iterator it)
+Client::Context::Stats Client::Context::getStats() const
 {
-    if (!err) {
-        RequestPtr req(new Request);
-        req->type = mRequestType;
-        req->host = mUri.getHost();
-        req->path = mUri.getPath();
+    Stats stats;
+    stats.handshakes = mHandshakes;
+    stats.resumedHandshakes = mResumedHandshakes;
+    stats.reusedConnections = mReusedConnections;
+    stats.redirects = mRedirects;
+    stats.cachedRedirects = mCachedRedirects;
+    stats.redirectLoops = mRedirectLoops;
+    return stats;
+}
 
-        std::ostream s(&req->buf);
-        s << *req;
+void *Client::HandlerMemory::allocate(std::size_t size)
+{
+    if (!mInUse && size <= sizeof(mStorage)) {
+        mInUse = true;
+        return &mStorage;
+    }
+    return ::operator new(size);
+}
 
-        auto thisPtr = shared_from_this();
+void Client::HandlerMemory::deallocate(void *p)
+{
+    if (p == &mStorage) {
+        mInUse = false;
+    } else {
+        ::operator delete(p);
+    }
+}
 
-        if (mFinished) {
-            return;
+Client::Client(boost::asio::io_service &service, const ContextPtr &context)
+    : mIOService(service),
+      mContext(context),
+      mStrand(service),
+      mResolver(service),
+      mReused(false),
+      mFirstByteTimeout(0),
+      mFinished(false),
+      mAlternateEndpoint(false),
+      mContentLength(0),
+      mChunked(false),
+      mChunkSize(0),
+      mKeepAlive(false)
+{ }
+
+void Client::sendRequest(const std::string &reqType, const std::string &url, unsigned timeout, HandlerFunc func)
+{
+    // known permanent redirects are skipped without asking the origin again
+    mRedirectChain.assign(1, url);
+    mContext->findRedirects(mRedirectChain, MAX_REDIRECTS + 1);
+
+    mRequest.type = reqType;
+    setUrl(mRedirectChain.back());
+
+    mHandler = func;
+    mFinished = false;
+    mKeepAlive = false;
+    mCoroutine = boost::asio::coroutine();
+    if (mTrace) {
+        mTraceMark = std::chrono::steady_clock::now();
+    }
+
+    auto thisPtr = shared_from_this();
+
+    if (timeout > 0) {
+        mContext->getTimers().schedule(mDeadline, timeout, [thisPtr]() {
+            thisPtr->cancel();
+        });
+    }
+    if (mFirstByteTimeout > 0 && (timeout == 0 || mFirstByteTimeout < timeout)) {
+        mContext->getTimers().schedule(mFirstByteDeadline, mFirstByteTimeout, [thisPtr]() {
+            thisPtr->cancel();
+        });
+    }
+
+    if (mContext->isSingleThread()) {
+        mIOService.dispatch(Step(thisPtr));
+    } else {
+        mStrand.dispatch(Step(thisPtr));
+    }
+}
+
+void Client::setUrl(const std::string &url)
+{
+    mUri = Uri(url);
+    const bool https = mUri.getProtocol() == "https";
+    if (mUri.getPort().empty()) {
+        mUri.setPort(https ? "443" : "80");
+    }
+
+    mRequest.host = mUri.getHost();
+    // only TLS connections are pooled, they are the ones worth keeping
+    mRequest.keepAlive = https;
+    mRequest.path = mUri.getPath();
+    if (!mUri.getQuery().empty()) {
+        mRequest.path += "?" + mUri.getQuery();
+    }
+}
+
+bool Client::followRedirect()
+{
+    const std::string location = resolveLocation(mUri, mResponse->getHeader("Location"));
+    if (mRedirectChain.size() > MAX_REDIRECTS ||
+        std::find(mRedirectChain.begin(), mRedirectChain.end(), location) != mRedirectChain.end()) {
+        mContext->addRedirectLoop();
+        return false;
+    }
+
+    const uint httpCode = mResponse->httpCode;
+    if (httpCode == 301 || httpCode == 308) {
+        mContext->addRedirect(mRedirectChain.back(), location);
+    }
+    // only 307 and 308 keep the method
+    if ((httpCode == 301 || httpCode == 302 || httpCode == 303) && mRequest.type != "HEAD") {
+        mRequest.type = "GET";
+    }
+    mContext->addRedirectHop();
+
+    mRedirectChain.push_back(location);
+    setUrl(location);
+    return true;
+}
+
+void Client::Step::operator()(const boost::system::error_code &err, std::size_t) const
+{
+    client->resume(err);
+}
+
+void Client::Step::operator()(const boost::system::error_code &err, boost::asio::ip::tcp::resolver::iterator it) const
+{
+    client->mEndpoint = it;
+    client->resume(err);
+}
+
+void Client::Resume::operator()() const
+{
+    step.client->run(err);
+}
+
+void Client::resume(const boost::system::error_code &err)
+{
+    if (mContext->isSingleThread()) {
+        run(err);
+    } else {
+        mStrand.dispatch(Resume(Step(shared_from_this()), err));
+    }
+}
+
+void Client::cancel()
+{
+    if (mContext->isSingleThread()) {
+        if (!mFinished) {
+            finish(REQUESTED_HOST_UNAVAILABLE);
         }
+        return;
+    }
+
+    auto thisPtr = shared_from_this();
+    mStrand.dispatch([thisPtr]() {
+        if (!thisPtr->mFinished) {
+            thisPtr->finish(REQUESTED_HOST_UNAVAILABLE);
+        }
+    });
+}
+
+#include <boost/asio/yield.hpp>
+
+void Client::run(const boost::system::error_code &err)
+{
+    if (mFinished) {
+        // answered on timeout, steps still in flight complete with errors
+        return;
+    }
 
-        boost::asio::async_write(*thisPtr->mSocket, req->buf, mStrand.wrap(
-        [thisPtr, req, func](const boost::system::error_code &err, std::size_t) {
-            if (err) {
-                if (!thisPtr->mFinished) {
-                    thisPtr->finished();
+    const Step step(shared_from_this());
 
-                    ResponsePtr res(new Response);
-                    res->httpCode = 434;
-                    res->version = SUPPORTED_HTTP_VERSION;
-                    func(res);
+    reenter (mCoroutine) {
+        // a round per redirect
+        for (;;) {
+            // a round per stale pooled connection
+            for (;;) {
+                mConnection.reset();
+                if (mRequest.keepAlive) {
+                    mConnection = mContext->takeConnection(mUri.getHost() + ":" + mUri.getPort());
                 }
-                return;
-            }
+                mReused = bool(mConnection);
 
-            if (thisPtr->mFinished) {
-                return;
-            }
+                if (!mConnection) {
+                    yield {
+                        boost::asio::ip::tcp::resolver::query query(mUri.getHost(), mUri.getPort());
+                        mResolver.async_resolve(query, step);
+                    }
+                    traceStep("dns");
+                    if (err) {
+                        finish(REQUESTED_HOST_UNAVAILABLE);
+                        return;
+                    }
 
-            ResponsePtr res(new Response);
+                    mConnection = std::make_shared<Connection>(mIOService,
+                                                               mUri.getProtocol() == "https" ? &mContext->getTlsContext() : nullptr);
+                    mConnection->mKey = mUri.getHost() + ":" + mUri.getPort();
 
-            boost::asio::async_read_until(*thisPtr->mSocket, res->buf, "\r\n\r\n", thisPtr->mStrand.wrap(
-            [thisPtr, res, func](const boost::system::error_code &err, size_t) {
-                if (thisPtr->mFinished) {
-                    return;
+                    if (mAlternateEndpoint && std::next(mEndpoint) != boost::asio::ip::tcp::resolver::iterator()) {
+                        mEndpoint++;
+                    }
+
+                    yield boost::asio::async_connect(mConnection->getSocket(), mEndpoint, step);
+                    traceStep("connect");
+                    if (err) {
+                        finish(REQUESTED_HOST_UNAVAILABLE);
+                        return;
+                    }
+
+                    {
+                        // handshake flights and the request go out as separate
+                        // writes, Nagle would hold each back for a delayed ACK
+                        boost::system::error_code ec;
+                        mConnection->getSocket().set_option(boost::asio::ip::tcp::no_delay(true), ec);
+                    }
+
+                    if (mConnection->isTls()) {
+                        mContext->prepareHandshake(*mConnection, mUri.getHost());
+                        yield mConnection->mTls->async_handshake(boost::asio::ssl::stream_base::client, step);
+                        traceStep("tls");
+                        if (err) {
+                            finish(REQUESTED_HOST_UNAVAILABLE);
+                            return;
+                        }
+                        mContext->addHandshake(SSL_session_reused(mConnection->getSSL()));
+                    }
                 }
 
+                yield {
+                    mRequest.buf.consume(mRequest.buf.size());
+                    std::ostream s(&mRequest.buf);
+                    s << mRequest;
+                    boost::asio::async_write(*mConnection, mRequest.buf, step);
+                }
+                traceStep("request");
                 if (err) {
-                    thisPtr->finished();
-                    ResponsePtr res(new Response);
-                    res->httpCode = 434;
-                    res->version = SUPPORTED_HTTP_VERSION;
-                    func(res);
+                    if (mReused) {
+                        mConnection->close();
+                        continue;
+                    }
+                    finish(REQUESTED_HOST_UNAVAILABLE);
                     return;
                 }
 
-                res->parseHeaders();
+                mResponse = std::make_shared<Response>();
+                mResponse->mBudget = mBufferBudget;
 
-                if (res->version != SUPPORTED_HTTP_VERSION) {
-                    thisPtr->finished();
+                yield boost::asio::async_read_until(*mConnection, mResponse->buf, "\r\n\r\n", step);
+                traceStep("ttfb");
+                if (err) {
+                    if (mReused && mResponse->buf.size() == 0) {
+                        // closed by the origin while idle, the request never got there
+                        mConnection->close();
+                        continue;
+                    }
+                    finish(REQUESTED_HOST_UNAVAILABLE);
+                    return;
+                }
+                break;
+            }
 
-                    res->httpCode = 434;
-                    res->version = SUPPORTED_HTTP_VERSION;
+            mResponse->parseHeaders();
+            if (mResponse->version != SUPPORTED_HTTP_VERSION && mResponse->version != "HTTP/1.0") {
+                finish(REQUESTED_HOST_UNAVAILABLE);
+                return;
+            }
 
-                    func(res);
-                } else if (res->httpCode == 200 && !thisPtr->mFinished) {
+            if (isRedirect(mResponse->httpCode) && !mResponse->getHeader("Location").empty()) {
+                mConnection->close();
+                if (!followRedirect()) {
+                    finish(LOOP_DETECTED);
+                    return;
+                }
+                continue;
+            }
+            break;
+        }
+
+        mContext->getTimers().cancel(mFirstByteDeadline);
+        if (mFirstByteFunc) {
+            std::function<void()> func;
+            func.swap(mFirstByteFunc);
+            func();
+        }
 
-                    auto it = res->headers.find("Content-Length");
-                    if (it != res->headers.end()) {
-                        std::stringstream ss(it->second);
-                        size_t length = 0;
-                        ss >> length;
+        // only feeds are read, other responses are passed on with head only
+        if (mResponse->httpCode != 200) {
+            finish();
+            return;
+        }
 
-                        if (length > 0) {
-                            boost::asio::async_read(*thisPtr->mSocket, res->buf, boost::asio::transfer_at_least(1),
-                                                    thisPtr->mStrand.wrap(boost::bind(&Client::onDataRead, thisPtr, func, res,
-                                                                          boost::asio::placeholders::error)));
-                        } else {
-                            thisPtr->finished();
+        if (!prepareBody()) {
+            finish(REQUESTED_HOST_UNAVAILABLE);
+            return;
+        }
 
-                            func(res);
-                        }
-                    } else {
-                        it = res->headers.find("Transfer-Encoding");
-                        if (it != res->headers.end() && it->second == "chunked") {
-                            boost::asio::async_read(*thisPtr->mSocket, res->buf, boost::asio::transfer_at_least(1),
-                                                    thisPtr->mStrand.wrap(boost::bind(&Client::onDataRead, thisPtr, func, res,
-                                                                          boost::asio::placeholders::error)));
-                        } else {
-                            // malformed http response
-                            thisPtr->finished();
-
-                            res->httpCode = 434;
-                            res->version = SUPPORTED_HTTP_VERSION;
-
-                            func(res);
+        if (mChunked) {
+            for (;;) {
+                yield boost::asio::async_read_until(*mConnection, mResponse->buf, "\r\n", step);
+                if (err || !parseChunkSize()) {
+                    finish(REQUESTED_HOST_UNAVAILABLE);
+                    return;
+                }
+                // charged before the chunk is read into the buffer, not after
+                if (!mResponse->reserve(mChunkSize)) {
+                    finish(SERVICE_UNAVAILABLE);
+                    return;
+                }
+                if (mChunkSize == 0) {
+                    // trailers are of no interest unless the connection is kept
+                    while (mKeepAlive) {
+                        yield boost::asio::async_read_until(*mConnection, mResponse->buf, "\r\n", step);
+                        if (err) {
+                            mKeepAlive = false;
+                        } else if (skipTrailer()) {
+                            mKeepAlive = mResponse->buf.size() == 0;
+                            break;
                         }
                     }
-                } else {
-                    thisPtr->finished();
-                    func(res);
+                    break;
                 }
-            }));
-        }));
-    } else if (it != boost::asio::ip::tcp::resolver::iterator()) {
-        mSocket->close();
-        boost::asio::ip::tcp::endpoint endpoint = *it;
-        mSocket->async_connect(endpoint, mStrand.wrap(boost::bind(&Client::onConnect, shared_from_this(), func,
-                                                      boost::asio::placeholders::error, ++it)));
-    } else {
-        //std::cout << err.message() << std::endl;
-        if (mFinished) {
-            return;
+
+                // chunk data is followed by CRLF
+                yield boost::asio::async_read(*mConnection, mResponse->buf,
+                                              boost::asio::transfer_exactly(mChunkSize + 2 > mResponse->buf.size() ?
+                                                                            mChunkSize + 2 - mResponse->buf.size() : 0),
+                                              step);
+                if (err) {
+                    finish(REQUESTED_HOST_UNAVAILABLE);
+                    return;
+                }
+                if (!takeChunk()) {
+                    finish(REQUESTED_HOST_UNAVAILABLE);
+                    return;
+                }
+            }
+        } else {
+            for (;;) {
+                if (!takeBody()) {
+                    finish(SERVICE_UNAVAILABLE);
+                    return;
+                }
+                if (mResponse->body.size() >= mContentLength) {
+                    break;
+                }
+
+                yield boost::asio::async_read(*mConnection, mResponse->buf, boost::asio::transfer_at_least(1), step);
+                if (err == boost::asio::error::eof && mContentLength == std::string::npos) {
+                    // body without length ends with the connection
+                    mContentLength = mResponse->body.size() + mResponse->buf.size();
+                } else if (err) {
+                    finish(REQUESTED_HOST_UNAVAILABLE);
+                    return;
+                }
+            }
         }
 
-        finished();
+        traceStep("body");
+        finish();
+    }
+}
 
-        ResponsePtr res(new Response);
-        res->httpCode = 434;
-        res->version = SUPPORTED_HTTP_VERSION;
+#include <boost/asio/unyield.hpp>
 
-        func(res);
+void Client::traceStep(const char *name)
+{
+    if (mTrace) {
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        mTrace->add(name, mTraceMark, now);
+        mTraceMark = now;
     }
 }
 
-void Client::onDataRead(HandlerFunc func, ResponsePtr res, const boost::system::error_code &err)
+bool Client::prepareBody()
 {
-    if (!err) {
-        std::istream ss(&res->buf);
-        std::copy(std::istreambuf_iterator<char>(ss), {}, std::back_inserter(res->body));
+    mChunked = false;
+    mContentLength = std::string::npos;
 
-        boost::asio::async_read(*mSocket, res->buf, boost::asio::transfer_at_least(1),
-                                mStrand.wrap(boost::bind(&Client::onDataRead, shared_from_this(), func,
-                                             res, boost::asio::placeholders::error)));
-    } else if (err != boost::asio::error::eof) {
-        finished();
-        ResponsePtr res(new Response);
+    // the connection outlives the response only if its end is framed
+    mKeepAlive = mRequest.keepAlive && mResponse->version == SUPPORTED_HTTP_VERSION &&
+            mResponse->getHeader("Connection") != "close";
 
-        res->httpCode = 434;
-        res->version = SUPPORTED_HTTP_VERSION;
+    if (mResponse->getHeader("Transfer-Encoding") == "chunked") {
+        mChunked = true;
+        return true;
+    }
 
-        func(res);
+    const std::string contentLength = mResponse->getHeader("Content-Length");
+    if (!contentLength.empty()) {
+        char *end = nullptr;
+        mContentLength = std::strtoul(contentLength.c_str(), &end, 10);
+        if (*end != '\0') {
+            return false;
+        }
+        mResponse->body.reserve(std::min<std::size_t>(mContentLength, MAX_BODY_PREALLOCATION));
     } else {
-        finished();
-        func(res);
+        mKeepAlive = false;
+    }
+
+    return true;
+}
+
+bool Client::takeBody()
+{
+    boost::asio::streambuf &buf = mResponse->buf;
+    std::string &body = mResponse->body;
+
+    // anything past Content-Length is dropped, along with the connection
+    const std::size_t size = std::min(buf.size(), mContentLength - body.size());
+    if (size < buf.size()) {
+        mKeepAlive = false;
+    }
+    if (size > 0) {
+        if (!mResponse->reserve(size)) {
+            return false;
+        }
+        body.append(static_cast<const char *>(buf.data().data()), size);
+    }
+    buf.consume(buf.size());
+    return true;
+}
+
+bool Client::parseChunkSize()
+{
+    std::istream s(&mResponse->buf);
+    std::string line;
+    std::getline(s, line);
+
+    return parseChunkSize(line, mChunkSize);
+}
+
+bool Client::parseChunkSize(const std::string &line, std::size_t &size)
+{
+    // strtoull would skip blanks and take a sign
+    if (line.size() < 2 || !std::isxdigit(static_cast<unsigned char>(line[0])) || line[line.size() - 1] != '\r') {
+        return false;
+    }
+
+    errno = 0;
+    char *end = nullptr;
+    const unsigned long long value = std::strtoull(line.c_str(), &end, 16);
+    if (errno == ERANGE || value > MAX_CHUNK_SIZE) {
+        return false;
+    }
+
+    // chunk extensions after ';' are ignored
+    const char *cr = line.c_str() + line.size() - 1;
+    while (end != cr && (*end == ' ' || *end == '\t')) {
+        end++;
+    }
+    if (end != cr && *end != ';') {
+        return false;
     }
+
+    size = value;
+    return true;
+}
+
+bool Client::takeChunk()
+{
+    boost::asio::streambuf &buf = mResponse->buf;
+
+    // short if the buffer filled up before the chunk did
+    const char *data = static_cast<const char *>(buf.data().data());
+    if (buf.size() < mChunkSize + 2 || data[mChunkSize] != '\r' || data[mChunkSize + 1] != '\n') {
+        return false;
+    }
+
+    mResponse->body.append(data, mChunkSize);
+    buf.consume(mChunkSize + 2);
+    return true;
 }
 
-void Client::finished()
+bool Client::skipTrailer()
 {
-    if (!mFinished) {
-        mFinished = true;
-        if (mWithTimeout) {
-            mTimer->cancel();
+    std::istream s(&mResponse->buf);
+    std::string line;
+    std::getline(s, line);
+    return line == "\r";
+}
+
+void Client::finish(uint httpCode)
+{
+    mFinished = true;
+
+    mContext->getTimers().cancel(mDeadline);
+    mContext->getTimers().cancel(mFirstByteDeadline);
+
+    // the connection and response stay referenced: an operation cut short
+    // by a timeout or cancel still completes into their buffers
+    mResolver.cancel();
+    if (mConnection) {
+        if (httpCode == 0 && mKeepAlive) {
+            mContext->putConnection(mConnection);
+        } else {
+            mConnection->close();
         }
     }
+
+    ResponsePtr res = mResponse;
+    if (httpCode != 0) {
+        res = std::make_shared<Response>();
+        res->httpCode = httpCode;
+        res->version = SUPPORTED_HTTP_VERSION;
+    }
+    mFirstByteFunc = std::function<void()>();
+    mTrace.reset();
+
+    HandlerFunc func;
+    func.swap(mHandler);
+    func(res);
 }
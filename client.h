@@ -1,24 +1,197 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <functional>
+#include <list>
+#include <map>
 #include <memory>
+#include <type_traits>
+#include <vector>
 
 #include <boost/asio.hpp>
+#include <boost/asio/coroutine.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/thread.hpp>
 
+#include "timerwheel.h"
+#include "tracer.h"
 #include "uri.h"
 
 class Client : public std::enable_shared_from_this<Client>
 {
 public:
-    Client(boost::asio::io_service &service);
+    class Context;
+
+    /// socket to an origin, https goes through a TLS stream over it
+    class Connection {
+        friend class Client;
+        friend class Context;
+
+    public:
+        /// plain connection unless tls context is given
+        Connection(boost::asio::io_service &service, boost::asio::ssl::context *tls);
+
+        boost::asio::ip::tcp::socket &getSocket() { return mSocket; }
+        bool isTls() const { return bool(mTls); }
+        SSL *getSSL() { return mTls->native_handle(); }
+
+        /// host:port the connection is pooled and its TLS session cached under
+        const std::string &getKey() const { return mKey; }
+
+        void close();
+
+        // AsyncReadStream and AsyncWriteStream, so one read/write path serves both
+        typedef boost::asio::ip::tcp::socket::executor_type executor_type;
+        executor_type get_executor() { return mSocket.get_executor(); }
+
+        template <typename Buffers, typename Handler>
+        void async_read_some(const Buffers &buffers, Handler &&handler)
+        {
+            if (mTls) {
+                mTls->async_read_some(buffers, std::forward<Handler>(handler));
+            } else {
+                mSocket.async_read_some(buffers, std::forward<Handler>(handler));
+            }
+        }
+
+        template <typename Buffers, typename Handler>
+        void async_write_some(const Buffers &buffers, Handler &&handler)
+        {
+            if (mTls) {
+                mTls->async_write_some(buffers, std::forward<Handler>(handler));
+            } else {
+                mSocket.async_write_some(buffers, std::forward<Handler>(handler));
+            }
+        }
+
+    private:
+        typedef boost::asio::ssl::stream<boost::asio::ip::tcp::socket &> TlsStream;
+
+        boost::asio::ip::tcp::socket mSocket;
+        std::unique_ptr<TlsStream> mTls;
+        std::string mKey;
+        std::chrono::steady_clock::time_point mIdleSince;
+    };
+    typedef std::shared_ptr<Connection> ConnectionPtr;
+
+    /// state shared by all clients running on one io_service
+    class Context {
+    public:
+        /// with singleThread the service must be run by one thread only,
+        /// clients then run their steps without a strand
+        Context(boost::asio::io_service &service, bool singleThread);
+        ~Context();
+
+        TimerWheel &getTimers() { return mTimers; }
+        bool isSingleThread() const { return mSingleThread; }
+
+        /// origin certificates are verified against system CAs, or the
+        /// bundle at path once loaded
+        bool loadCaFile(const std::string &path);
+        boost::asio::ssl::context &getTlsContext() { return mTls; }
+
+        /// sets SNI and hostname verification up and offers the session
+        /// last cached for connection's host to resume
+        void prepareHandshake(Connection &connection, const std::string &host);
+        void addHandshake(bool resumed);
+
+        /// idle keep-alive connection to key, null if there is none
+        ConnectionPtr takeConnection(const std::string &key);
+        /// keeps connection open for the next request to its key
+        void putConnection(const ConnectionPtr &connection);
+
+        /// remembers a permanent (301/308) redirect of url for a while
+        void addRedirect(const std::string &url, const std::string &location);
+        /// appends cached locations the last url of chain permanently
+        /// redirects to, stopping short of a loop or maxLength
+        void findRedirects(std::vector<std::string> &chain, std::size_t maxLength);
+        void addRedirectHop() { mRedirects++; }
+        void addRedirectLoop() { mRedirectLoops++; }
+
+        struct Stats {
+            std::uint64_t handshakes;
+            std::uint64_t resumedHandshakes;
+            std::uint64_t reusedConnections;
+            std::uint64_t redirects;
+            std::uint64_t cachedRedirects;
+            std::uint64_t redirectLoops;
+        };
+        Stats getStats() const;
+
+    private:
+        Context(const Context &) = delete;
+        Context &operator=(const Context &) = delete;
+
+        static int onNewSession(SSL *ssl, SSL_SESSION *session);
+
+        TimerWheel mTimers;
+        const bool mSingleThread;
+        boost::asio::ssl::context mTls;
+
+        // newest session ticket per host:port, owned
+        std::map<std::string, SSL_SESSION *> mSessions;
+        // idle connections per host:port, most recently used last
+        std::map<std::string, std::vector<ConnectionPtr>> mIdle;
+        struct MovedUrl {
+            std::string location;
+            std::chrono::steady_clock::time_point expires;
+        };
+        typedef std::list<std::pair<std::string, MovedUrl>> MovedUrlList;
+        // permanently moved urls, most recently used first
+        MovedUrlList mMovedUrls;
+        std::map<std::string, MovedUrlList::iterator> mMovedUrlIndex;
+        mutable boost::mutex mMutex;
+        typedef boost::lock_guard<boost::mutex> LockGuard;
+
+        std::atomic<std::uint64_t> mHandshakes;
+        std::atomic<std::uint64_t> mResumedHandshakes;
+        std::atomic<std::uint64_t> mReusedConnections;
+        std::atomic<std::uint64_t> mRedirects;
+        std::atomic<std::uint64_t> mCachedRedirects;
+        std::atomic<std::uint64_t> mRedirectLoops;
+    };
+    typedef std::shared_ptr<Context> ContextPtr;
+
+    Client(boost::asio::io_service &service, const ContextPtr &context);
+
+    /// limits memory held by response bodies of all clients sharing the budget
+    class BufferBudget {
+    public:
+        explicit BufferBudget(std::size_t maxBytes);
+
+        bool reserve(std::size_t bytes);
+        void release(std::size_t bytes);
+
+        std::size_t getUsed() const { return mUsed; }
+        std::size_t getMax() const { return mMax; }
+        /// reservations refused, each one drops a response
+        std::uint64_t getRejected() const { return mRejected; }
+        /// bytes already reserved over a lowered max are kept until released
+        void setMax(std::size_t maxBytes) { mMax = maxBytes; }
+
+    private:
+        std::atomic<std::size_t> mUsed;
+        std::atomic<std::size_t> mMax;
+        std::atomic<std::uint64_t> mRejected;
+    };
+    typedef std::shared_ptr<BufferBudget> BufferBudgetPtr;
+
+    /// responses exceeding the shared budget are dropped with 503 code
+    void setBufferBudget(const BufferBudgetPtr &budget) { mBufferBudget = budget; }
 
     class Request {
         friend class Client;
 
     public:
+        Request()
+            : keepAlive(false)
+        { }
+
         std::string type;
         std::string host;
         std::string path;
+        bool keepAlive;
 
     private:
         boost::asio::streambuf buf;
@@ -29,6 +202,9 @@ public:
         friend class Client;
 
     public:
+        Response();
+        ~Response();
+
         std::string version;
         uint httpCode;
 
@@ -36,38 +212,167 @@ public:
 
         std::map<std::string, std::string> headers;
 
-    private:
+        /// parses status line and headers from buf
         void parseHeaders();
+        /// value of the header named so in any case, empty if there is none
+        std::string getHeader(const std::string &name) const;
 
         boost::asio::streambuf buf;
+
+    private:
+        bool reserve(std::size_t bytes);
+
+        BufferBudgetPtr mBudget;
+        std::size_t mReserved;
     };
     typedef std::shared_ptr<Response> ResponsePtr;
 
     typedef std::function<void(const ResponsePtr &res)> HandlerFunc;
+    /// redirects are followed up to a limit within the same timeout,
+    /// loops and longer chains are answered with 508
     void sendRequest(const std::string &reqType, const std::string &url, unsigned timeout, HandlerFunc func);
 
+    /// called once the head of the final response is in, before its body
+    void setFirstByteFunc(std::function<void()> func) { mFirstByteFunc = func; }
+    /// ms the head of the final response may take, answered with 434 like a
+    /// timeout otherwise; 0 or one not shorter than the timeout has no effect
+    void setFirstByteTimeout(unsigned timeout) { mFirstByteTimeout = timeout; }
+    /// connect to the second resolved address first if there are several,
+    /// so a duplicate request doesn't queue behind the same endpoint
+    void setAlternateEndpoint(bool alternate) { mAlternateEndpoint = alternate; }
+    /// spans of the next request (dns, connect, tls, request, ttfb, body) go to trace
+    void setTrace(const TracePtr &trace) { mTrace = trace; }
+
+    /// answers the request in flight with 434 as if it timed out
+    void cancel();
+
+    /// size from a chunk's size line, CR included; false if it is malformed
+    /// or over the largest chunk taken
+    static bool parseChunkSize(const std::string &line, std::size_t &size);
+
 private:
+    /// memory of the async operation in flight, reused by every step of a
+    /// request; falls back to the heap if asked for more than one block
+    class HandlerMemory {
+    public:
+        HandlerMemory()
+            : mInUse(false)
+        { }
+
+        void *allocate(std::size_t size);
+        void deallocate(void *p);
+
+    private:
+        std::aligned_storage<256>::type mStorage;
+        bool mInUse;
+    };
+
+    /// completion handler of every async step, resumes the request coroutine
+    /// directly or through the strand, its memory comes from HandlerMemory
+    struct Step {
+        explicit Step(const std::shared_ptr<Client> &client)
+            : client(client)
+        { }
+
+        void operator()(const boost::system::error_code &err = boost::system::error_code(), std::size_t bytes = 0) const;
+        void operator()(const boost::system::error_code &err, boost::asio::ip::tcp::resolver::iterator it) const;
+
+        void *allocate(std::size_t size) const { return client->mHandlerMemory.allocate(size); }
+        void deallocate(void *p) const { client->mHandlerMemory.deallocate(p); }
+
+        friend void *asio_handler_allocate(std::size_t size, Step *step)
+        {
+            return step->allocate(size);
+        }
+
+        friend void asio_handler_deallocate(void *p, std::size_t, Step *step)
+        {
+            step->deallocate(p);
+        }
+
+        std::shared_ptr<Client> client;
+    };
+
+    /// Step completion carried through the strand
+    struct Resume {
+        Resume(const Step &step, const boost::system::error_code &err)
+            : step(step),
+              err(err)
+        { }
+
+        void operator()() const;
+
+        friend void *asio_handler_allocate(std::size_t size, Resume *resume)
+        {
+            return resume->step.allocate(size);
+        }
+
+        friend void asio_handler_deallocate(void *p, std::size_t, Resume *resume)
+        {
+            resume->step.deallocate(p);
+        }
+
+        Step step;
+        boost::system::error_code err;
+    };
+
+    void resume(const boost::system::error_code &err);
+
+    /// points mUri and mRequest to url
+    void setUrl(const std::string &url);
+    /// false if the response's Location was visited already or the chain is too long
+    bool followRedirect();
+
+    /// take a pooled connection or resolve, connect and handshake, write
+    /// request, read head and body; runs on the strand
+    void run(const boost::system::error_code &err = boost::system::error_code());
+
+    /// the only exit of a request: cancels the timer, pools or closes the
+    /// connection and calls the handler once, non-zero httpCode answers with
+    /// an empty response carrying that code instead of the one being read
+    void finish(uint httpCode = 0);
+
+    /// adds span name ending now and starting where the last one ended
+    void traceStep(const char *name);
+
+    bool prepareBody();
+    bool takeBody();
+    bool parseChunkSize();
+    bool takeChunk();
+    /// true once the empty line ending the trailers is read
+    bool skipTrailer();
+
     boost::asio::io_service &mIOService;
-    std::shared_ptr<boost::asio::ip::tcp::socket> mSocket;
-    std::shared_ptr<boost::asio::deadline_timer> mTimer;
+    const ContextPtr mContext;
+    boost::asio::io_service::strand mStrand;
     boost::asio::ip::tcp::resolver mResolver;
+    boost::asio::ip::tcp::resolver::iterator mEndpoint;
+    ConnectionPtr mConnection;
+    bool mReused; // mConnection came from the pool and may have been closed by the origin
+    TimerWheel::Timer mDeadline;
+    unsigned mFirstByteTimeout;
+    TimerWheel::Timer mFirstByteDeadline;
+    boost::asio::coroutine mCoroutine;
+    HandlerMemory mHandlerMemory;
     bool mFinished;
-    bool mWithTimeout;
 
-    void finished();
-
-    boost::asio::strand mStrand;
+    BufferBudgetPtr mBufferBudget;
 
     Uri mUri;
-    std::string mRequestType;
-
-    void onConnect(HandlerFunc func,
-                   const boost::system::error_code &err,
-                   boost::asio::ip::tcp::resolver::iterator it);
+    std::vector<std::string> mRedirectChain; // urls requested so far, mUri last
+    Request mRequest;
+    ResponsePtr mResponse;
+    HandlerFunc mHandler;
+    std::function<void()> mFirstByteFunc;
+    bool mAlternateEndpoint;
+    TracePtr mTrace;
+    std::chrono::steady_clock::time_point mTraceMark;
 
-    void onDataRead(HandlerFunc func,
-                    ResponsePtr res,
-                    const boost::system::error_code &err);
+    // body framing of the response being read
+    std::size_t mContentLength; // npos until the peer closes the connection
+    bool mChunked;
+    std::size_t mChunkSize;
+    bool mKeepAlive; // connection may serve the next request once the body is read
 };
 
 std::ostream &operator<< (std::ostream &o, const Client::Request &req);
@@ -0,0 +1,148 @@
+#include "computepool.h"
+
+#include <algorithm>
+#include <cassert>
+
+#define QUEUE_WAIT_SMOOTHING 0.05
+
+ComputePool::ComputePool(unsigned threadCount)
+    : mNext(0),
+      mPending(0),
+      mStopping(false),
+      mTasks(0),
+      mSteals(0),
+      mQueueWaitUs(0)
+{
+    if (threadCount == 0) {
+        threadCount = std::max(boost::thread::hardware_concurrency(), 1u);
+    }
+
+    for (unsigned i = 0; i < threadCount; i++) {
+        mWorkers.emplace_back(new Worker);
+    }
+    for (std::size_t i = 0; i < mWorkers.size(); i++) {
+        mThreads.create_thread([this, i]() {
+            run(i);
+        });
+    }
+}
+
+ComputePool::~ComputePool()
+{
+    {
+        boost::lock_guard<boost::mutex> g(mSleepMutex);
+        mStopping = true;
+    }
+    mWake.notify_all();
+    mThreads.join_all();
+}
+
+void ComputePool::post(Task task)
+{
+    Worker &worker = *mWorkers[mNext++ % mWorkers.size()];
+    {
+        // counted before the job is queued, a thief taking it at once would
+        // otherwise decrement first. Under the lock, so a worker about to
+        // sleep sees the job
+        boost::lock_guard<boost::mutex> g(mSleepMutex);
+        mPending++;
+    }
+    {
+        boost::lock_guard<boost::mutex> g(worker.mutex);
+        Job job;
+        job.task.swap(task);
+        job.queued = Clock::now();
+        worker.jobs.push_back(std::move(job));
+    }
+    mWake.notify_one();
+}
+
+void ComputePool::post(Task work, boost::asio::io_service &service, Task done)
+{
+    post([work, &service, done]() {
+        work();
+        service.post(done);
+    });
+}
+
+ComputePool::Metrics ComputePool::getMetrics() const
+{
+    Metrics metrics;
+    metrics.threads = mWorkers.size();
+    metrics.queueDepth = std::max<std::ptrdiff_t>(mPending, 0);
+    metrics.tasks = mTasks;
+    metrics.steals = mSteals;
+    {
+        LockGuard g(mStatsMutex);
+        metrics.queueWaitUs = mQueueWaitUs;
+    }
+    return metrics;
+}
+
+void ComputePool::run(std::size_t index)
+{
+    for (;;) {
+        Job job;
+        if (take(index, job)) {
+            execute(job);
+            continue;
+        }
+
+        boost::unique_lock<boost::mutex> lock(mSleepMutex);
+        while (mPending == 0 && !mStopping) {
+            mWake.wait(lock);
+        }
+        if (mPending == 0 && mStopping) {
+            return;
+        }
+    }
+}
+
+bool ComputePool::take(std::size_t index, Job &job)
+{
+    {
+        Worker &own = *mWorkers[index];
+        boost::lock_guard<boost::mutex> g(own.mutex);
+        if (!own.jobs.empty()) {
+            job = std::move(own.jobs.front());
+            own.jobs.pop_front();
+            taken();
+            return true;
+        }
+    }
+
+    // oldest first here as well: the victim is busy with a long task, and
+    // whatever waits in its queue has waited longest
+    for (std::size_t i = 1; i < mWorkers.size(); i++) {
+        Worker &victim = *mWorkers[(index + i) % mWorkers.size()];
+        boost::lock_guard<boost::mutex> g(victim.mutex);
+        if (!victim.jobs.empty()) {
+            job = std::move(victim.jobs.front());
+            victim.jobs.pop_front();
+            taken();
+            mSteals++;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void ComputePool::taken()
+{
+    const std::ptrdiff_t pending = --mPending;
+    assert(pending >= 0);
+    (void)pending;
+}
+
+void ComputePool::execute(Job &job)
+{
+    const double waitUs = std::chrono::duration<double, std::micro>(Clock::now() - job.queued).count();
+    {
+        LockGuard g(mStatsMutex);
+        mQueueWaitUs += (waitUs - mQueueWaitUs) * QUEUE_WAIT_SMOOTHING;
+    }
+    mTasks++;
+
+    job.task();
+}
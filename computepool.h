@@ -0,0 +1,86 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+
+/// Threads for CPU-bound work (feed conversion, merging) kept off the
+/// io_service threads, so a large feed doesn't stall every socket served
+/// by the thread converting it. Each worker has its own queue, tasks are
+/// spread over the queues round robin and an idle worker steals from the
+/// others before going to sleep.
+class ComputePool
+{
+public:
+    typedef std::function<void()> Task;
+
+    /// threadCount 0 starts one thread per hardware thread
+    explicit ComputePool(unsigned threadCount);
+    /// runs the tasks still queued, then joins the threads
+    ~ComputePool();
+
+    void post(Task task);
+    /// runs work on the pool, then done on service, e.g. to write the
+    /// response from the thread serving the connection
+    void post(Task work, boost::asio::io_service &service, Task done);
+
+    struct Metrics {
+        unsigned threads;
+        std::size_t queueDepth;
+        std::uint64_t tasks;
+        std::uint64_t steals;
+        double queueWaitUs; // moving average of time tasks wait for a thread
+    };
+    Metrics getMetrics() const;
+
+    unsigned getThreadCount() const { return mWorkers.size(); }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Job {
+        Task task;
+        Clock::time_point queued;
+    };
+
+    struct Worker {
+        std::deque<Job> jobs;
+        boost::mutex mutex;
+    };
+
+    ComputePool(const ComputePool &) = delete;
+    ComputePool &operator=(const ComputePool &) = delete;
+
+    void run(std::size_t index);
+    /// oldest job of the worker's own queue, else of the next non-empty one
+    bool take(std::size_t index, Job &job);
+    /// counts a job off mPending once it's out of a queue
+    void taken();
+    void execute(Job &job);
+
+    std::vector<std::unique_ptr<Worker>> mWorkers;
+    boost::thread_group mThreads;
+    std::atomic<std::size_t> mNext;
+
+    // jobs posted and not yet taken over all workers, sleeping workers wait
+    // for it to grow
+    std::atomic<std::ptrdiff_t> mPending;
+    bool mStopping;
+    boost::mutex mSleepMutex;
+    boost::condition_variable mWake;
+
+    std::atomic<std::uint64_t> mTasks;
+    std::atomic<std::uint64_t> mSteals;
+    double mQueueWaitUs;
+    mutable boost::mutex mStatsMutex;
+    typedef boost::lock_guard<boost::mutex> LockGuard;
+};
+typedef std::shared_ptr<ComputePool> ComputePoolPtr;
@@ -0,0 +1,114 @@
+#include "configwatcher.h"
+
+#include <iostream>
+
+#include <sys/stat.h>
+
+// ms between checks of the config file's modification time
+#define CONFIG_WATCH_INTERVAL 2000
+
+ConfigWatcher::ConfigWatcher(boost::asio::io_service &service, const ConfigStorePtr &store, ReloadFunc func)
+    : mStore(store),
+      mReloadFunc(func),
+      mSignals(service, SIGHUP),
+      mTimer(service),
+      mModified(0),
+      mModifiedNs(0)
+{ }
+
+void ConfigWatcher::start()
+{
+    {
+        LockGuard g(mMutex);
+        readModified(mModified, mModifiedNs);
+    }
+    waitSignal();
+    waitChange();
+}
+
+void ConfigWatcher::reload()
+{
+    LockGuard g(mMutex);
+    // so the file check doesn't reload the same edit again after SIGHUP
+    readModified(mModified, mModifiedNs);
+
+    const ServerConfigPtr current = mStore->get();
+    std::shared_ptr<ServerConfig> config = current->reload();
+    if (!config) {
+        std::cerr << "config reload failed, keeping the running config" << std::endl;
+        return;
+    }
+
+    // upstream clients skip strands only while a single thread runs them
+    if ((config->getThreadCount() == 1) != (current->getThreadCount() == 1)) {
+        std::cerr << "config reload rejected: switching between one and several threads needs a restart" << std::endl;
+        return;
+    }
+
+    if (config->getPort() != current->getPort()) {
+        std::cerr << "port change takes effect after a restart" << std::endl;
+    }
+    if (config->getCaFile() != current->getCaFile()) {
+        std::cerr << "caFile change takes effect after a restart" << std::endl;
+    }
+    if (config->getComputeThreads() != current->getComputeThreads()) {
+        std::cerr << "computeThreads change takes effect after a restart" << std::endl;
+    }
+    if (config->getAccessLog() != current->getAccessLog()) {
+        std::cerr << "accessLog change takes effect after a restart" << std::endl;
+    }
+    if (config->getTraceFile() != current->getTraceFile() || config->getTraceFileSize() != current->getTraceFileSize()) {
+        std::cerr << "traceFile and traceFileSize changes take effect after a restart" << std::endl;
+    }
+
+    mStore->set(config);
+    mReloadFunc(*config);
+
+    std::cout << "config reloaded" << std::endl;
+    config->print();
+}
+
+void ConfigWatcher::waitSignal()
+{
+    mSignals.async_wait([this](const boost::system::error_code &err, int) {
+        if (err) {
+            return;
+        }
+        reload();
+        waitSignal();
+    });
+}
+
+void ConfigWatcher::waitChange()
+{
+    mTimer.expires_from_now(boost::posix_time::milliseconds(CONFIG_WATCH_INTERVAL));
+    mTimer.async_wait([this](const boost::system::error_code &err) {
+        if (err) {
+            return;
+        }
+
+        bool changed = false;
+        {
+            LockGuard g(mMutex);
+            std::time_t modified;
+            long modifiedNs;
+            changed = readModified(modified, modifiedNs) && (modified != mModified || modifiedNs != mModifiedNs);
+        }
+
+        if (changed) {
+            reload();
+        }
+        waitChange();
+    });
+}
+
+bool ConfigWatcher::readModified(std::time_t &seconds, long &nanoseconds) const
+{
+    struct stat st;
+    if (stat(mStore->get()->getConfigFilePath().c_str(), &st) != 0) {
+        return false;
+    }
+    seconds = st.st_mtim.tv_sec;
+    nanoseconds = st.st_mtim.tv_nsec;
+    return true;
+}
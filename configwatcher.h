@@ -0,0 +1,41 @@
+#pragma once
+
+#include <ctime>
+#include <functional>
+#include <memory>
+
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+
+#include "serverconfig.h"
+
+/// Reloads the config file on SIGHUP or once it is seen modified. A file
+/// that doesn't parse or validate is reported and the running config kept;
+/// a valid one replaces the store's snapshot, then the reload function
+/// applies whatever has to be pushed to running parts of the server.
+class ConfigWatcher
+{
+public:
+    typedef std::function<void(const ServerConfig &config)> ReloadFunc;
+
+    ConfigWatcher(boost::asio::io_service &service, const ConfigStorePtr &store, ReloadFunc func);
+
+    void start();
+    void reload();
+
+private:
+    void waitSignal();
+    void waitChange();
+    bool readModified(std::time_t &seconds, long &nanoseconds) const;
+
+    const ConfigStorePtr mStore;
+    ReloadFunc mReloadFunc;
+    boost::asio::signal_set mSignals;
+    boost::asio::deadline_timer mTimer;
+
+    std::time_t mModified;
+    long mModifiedNs;
+
+    boost::mutex mMutex;
+    typedef boost::lock_guard<boost::mutex> LockGuard;
+};
@@ -0,0 +1,284 @@
+#include "feedcache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <unordered_set>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+
+#include "murmurhash.h"
+#include "rssconverter.h"
+
+// versions a cursor may lag behind and still get a delta
+#define CURSOR_VERSIONS 16
+
+FeedCache::FeedCache(std::size_t maxEntries, std::size_t maxBytes)
+    : mMaxEntries(maxEntries),
+      mMaxBytes(maxBytes),
+      mBytes(0),
+      // a restarted proxy doesn't take cursors it didn't issue for its own
+      mNextGeneration(std::random_device()() | std::uint64_t(std::random_device()()) << 32),
+      mHits(0),
+      mMisses(0),
+      mNotModified(0),
+      mReusedItems(0),
+      mConvertedItems(0),
+      mDeltas(0)
+{ }
+
+FeedCache::EntryPtr FeedCache::find(const std::string &key)
+{
+    LockGuard g(mMutex);
+
+    auto it = mEntries.find(key);
+    if (it == mEntries.end()) {
+        return EntryPtr();
+    }
+
+    mLru.splice(mLru.begin(), mLru, it->second);
+    return it->second->second;
+}
+
+void FeedCache::put(const std::string &key, const std::shared_ptr<Entry> &entry)
+{
+    LockGuard g(mMutex);
+
+    // against what is cached now, a conversion finishing first may have
+    // replaced the entry this one started from
+    auto it = mEntries.find(key);
+    setVersion(*entry, it != mEntries.end() ? it->second->second.get() : nullptr);
+
+    if (mMaxEntries == 0) {
+        return;
+    }
+
+    if (it != mEntries.end()) {
+        mBytes -= getSize(key, *it->second->second);
+        it->second->second = entry;
+        mLru.splice(mLru.begin(), mLru, it->second);
+    } else {
+        mLru.emplace_front(key, entry);
+        mEntries[key] = mLru.begin();
+    }
+    mBytes += getSize(key, *entry);
+    // an entry over the whole budget goes right away
+    evict();
+}
+
+void FeedCache::setVersion(Entry &entry, const Entry *previous)
+{
+    if (!previous) {
+        entry.generation = mNextGeneration++;
+        entry.version = 1;
+        return;
+    }
+
+    entry.generation = previous->generation;
+    entry.version = previous->version;
+    entry.added = previous->added;
+
+    std::vector<std::uint64_t> added;
+    const RssItemIndex::Spans &before = previous->items.spans;
+    for (auto it = entry.items.spans.begin(); it != entry.items.spans.end(); it++) {
+        if (before.find(it->first) == before.end()) {
+            added.push_back(it->first);
+        }
+    }
+    // removed items don't make a new version, a delta has no way to tell about them;
+    // an edited one hashes differently and is added again
+    if (added.empty()) {
+        return;
+    }
+
+    entry.version++;
+    entry.added.push_back(std::move(added));
+    if (entry.added.size() > CURSOR_VERSIONS) {
+        entry.added.pop_front();
+    }
+}
+
+bool FeedCache::spill(Entry &entry, const std::string &dir)
+{
+    entry.bodyFile = SpillFile::create(dir, entry.json);
+    if (!entry.bodyFile) {
+        return false;
+    }
+    std::string().swap(entry.json);
+    return true;
+}
+
+bool FeedCache::readJson(const Entry &entry, std::string &json)
+{
+    json.clear();
+    if (!entry.bodyFile) {
+        json = entry.json;
+        return true;
+    }
+    return entry.bodyFile->read(0, entry.bodyFile->getSize(), json);
+}
+
+bool FeedCache::appendJson(const Entry &entry, std::size_t pos, std::size_t length, std::string &json)
+{
+    if (entry.bodyFile) {
+        return entry.bodyFile->read(pos, length, json);
+    }
+    json.append(entry.json, pos, length);
+    return true;
+}
+
+std::string FeedCache::makeCursor(const Entry &entry)
+{
+    char cursor[40];
+    std::snprintf(cursor, sizeof(cursor), "%016llx.%llu",
+                  (unsigned long long)entry.generation, (unsigned long long)entry.version);
+    return cursor;
+}
+
+bool FeedCache::parseCursor(const std::string &cursor, std::uint64_t &generation, std::uint64_t &version)
+{
+    const std::string::size_type dot = cursor.find('.');
+    if (dot == std::string::npos || dot == 0 || dot + 1 == cursor.size()) {
+        return false;
+    }
+
+    char *end = nullptr;
+    generation = std::strtoull(cursor.c_str(), &end, 16);
+    if (end != cursor.c_str() + dot) {
+        return false;
+    }
+    version = std::strtoull(cursor.c_str() + dot + 1, &end, 10);
+    return end == cursor.c_str() + cursor.size();
+}
+
+bool FeedCache::writeDelta(const Entry &entry, const std::string &cursor, std::string &json)
+{
+    std::uint64_t generation = 0;
+    std::uint64_t version = 0;
+    if (!parseCursor(cursor, generation, version) || generation != entry.generation ||
+            version > entry.version || entry.version - version > entry.added.size()) {
+        return false;
+    }
+
+    std::unordered_set<std::uint64_t> added;
+    for (std::size_t i = entry.added.size() - (entry.version - version); i < entry.added.size(); i++) {
+        added.insert(entry.added[i].begin(), entry.added[i].end());
+    }
+
+    // still in the feed, in feed order
+    std::vector<RssItemIndex::Span> spans;
+    for (auto it = added.begin(); it != added.end(); it++) {
+        auto span = entry.items.spans.find(*it);
+        if (span != entry.items.spans.end() && span->second.end > span->second.begin) {
+            spans.push_back(span->second);
+        }
+    }
+    std::sort(spans.begin(), spans.end(), [](const RssItemIndex::Span &a, const RssItemIndex::Span &b) {
+        return a.begin < b.begin;
+    });
+
+    // a spilled entry is read back in ranges, only the added items and what's around the array
+    const std::size_t size = entry.bodyFile ? entry.bodyFile->getSize() : entry.json.size();
+    json.clear();
+    bool ok = appendJson(entry, 0, entry.items.itemsBegin, json);
+    for (auto it = spans.begin(); ok && it != spans.end(); it++) {
+        if (it != spans.begin()) {
+            json += ',';
+        }
+        ok = appendJson(entry, it->begin, it->end - it->begin, json);
+    }
+    if (!ok || !appendJson(entry, entry.items.itemsEnd, size - entry.items.itemsEnd, json)) {
+        return false;
+    }
+
+    mDeltas++;
+    return true;
+}
+
+void FeedCache::addMiss(std::size_t reusedItems, std::size_t convertedItems)
+{
+    mMisses++;
+    mReusedItems += reusedItems;
+    mConvertedItems += convertedItems;
+}
+
+void FeedCache::setLimits(std::size_t maxEntries, std::size_t maxBytes)
+{
+    LockGuard g(mMutex);
+
+    mMaxEntries = maxEntries;
+    mMaxBytes = maxBytes;
+    evict();
+}
+
+void FeedCache::evict()
+{
+    while (mLru.size() > mMaxEntries || (mMaxBytes > 0 && mBytes > mMaxBytes)) {
+        mBytes -= getSize(mLru.back().first, *mLru.back().second);
+        mEntries.erase(mLru.back().first);
+        mLru.pop_back();
+    }
+}
+
+std::size_t FeedCache::getSize(const std::string &key, const Entry &entry)
+{
+    // a hash map node holds the value and a next pointer, plus a bucket pointer;
+    // a spilled json takes no memory but its file's page cache
+    std::size_t size = sizeof(Entry) + key.size() + entry.json.size() + entry.etag.size() +
+            entry.items.spans.size() * (sizeof(RssItemIndex::Spans::value_type) + 2 * sizeof(void *));
+    for (auto it = entry.added.begin(); it != entry.added.end(); it++) {
+        size += it->size() * sizeof(std::uint64_t);
+    }
+    return size;
+}
+
+FeedCache::Stats FeedCache::getStats() const
+{
+    Stats stats;
+    {
+        LockGuard g(mMutex);
+        stats.entries = mEntries.size();
+        stats.bytes = mBytes;
+    }
+    stats.hits = mHits;
+    stats.misses = mMisses;
+    stats.notModified = mNotModified;
+    stats.reusedItems = mReusedItems;
+    stats.convertedItems = mConvertedItems;
+    stats.deltas = mDeltas;
+    return stats;
+}
+
+std::string FeedCache::makeKey(const std::string &url, const RssConvertOptions &options)
+{
+    // a url can't hold spaces, so they separate it from the options
+    return url + ' ' + std::to_string(options.fields) + ' ' + std::to_string(options.limit) +
+            ' ' + std::to_string(options.since);
+}
+
+std::string FeedCache::makeETag(const std::string &body)
+{
+    char etag[24];
+    std::snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long)murmurHash64(body.data(), body.size()));
+    return etag;
+}
+
+bool FeedCache::matchETag(const std::string &ifNoneMatch, const std::string &etag)
+{
+    std::vector<std::string> tags;
+    boost::split(tags, ifNoneMatch, boost::is_any_of(","));
+
+    for (auto it = tags.begin(); it != tags.end(); it++) {
+        std::string tag = boost::trim_copy(*it);
+        // If-None-Match compares weakly
+        if (tag.compare(0, 2, "W/") == 0) {
+            tag.erase(0, 2);
+        }
+        if (tag == "*" || tag == etag) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+#include "rssconverter.h"
+#include "spillfile.h"
+
+/// Most recent conversion of each feed, keyed by url and conversion
+/// options. An upstream body hashing the same as the cached one is not
+/// converted again, a changed one only has its new and changed items
+/// converted, and a client already holding the entry's ETag gets 304
+/// without a body. Least recently used feeds are evicted first, once
+/// there are more than maxEntries or they take more than maxBytes.
+///
+/// A large conversion can be spilled to a file once, when it is made;
+/// every hit then sends that file with sendfile instead of copying the json.
+///
+/// Conversions adding items bump the feed's version, a client passing the
+/// cursor of an earlier one gets only the items added since, as long as the
+/// versions in between are still remembered. Items are told apart by their
+/// content hash, so an edited item counts as added and is delivered again.
+class FeedCache
+{
+public:
+    /// maxEntries 0 disables the cache, maxBytes 0 only limits the entries
+    FeedCache(std::size_t maxEntries, std::size_t maxBytes);
+
+    struct Entry {
+        std::uint64_t sourceHash; // of the upstream body json was converted from
+        std::string etag;         // strong, quoted
+        std::string json;         // empty once spilled to bodyFile
+        SpillFilePtr bodyFile;    // json on disk, null unless spilled
+        RssItemIndex items;       // of json
+
+        std::uint64_t generation; // tells apart versions of a feed cached anew
+        std::uint64_t version;
+        /// hashes of the items added by each of the last versions, oldest first
+        std::deque<std::vector<std::uint64_t>> added;
+    };
+    typedef std::shared_ptr<const Entry> EntryPtr;
+
+    /// last conversion of key, null if there is none
+    EntryPtr find(const std::string &key);
+    /// sets entry's version from the one cached for key, remembering the
+    /// items added since, then caches entry in its place
+    void put(const std::string &key, const std::shared_ptr<Entry> &entry);
+
+    /// moves entry's json to a new file in dir, false if it can't be written
+    /// and the json stays in memory; only before entry is shared
+    static bool spill(Entry &entry, const std::string &dir);
+    /// entry's json, read back from the file if it was spilled
+    static bool readJson(const Entry &entry, std::string &json);
+
+    /// "<generation>.<version>" of entry, the cursor clients pass to get the items added later
+    static std::string makeCursor(const Entry &entry);
+    /// entry's json with only the items added after cursor, false if cursor
+    /// isn't one of entry's remembered versions or a spilled entry can't be read
+    bool writeDelta(const Entry &entry, const std::string &cursor, std::string &json);
+
+    /// evicts down to lowered limits at once
+    void setLimits(std::size_t maxEntries, std::size_t maxBytes);
+
+    /// a request was answered from a cached conversion
+    void addHit() { mHits++; }
+    /// a request needed a conversion, which reused that many items of the last one
+    void addMiss(std::size_t reusedItems, std::size_t convertedItems);
+    void addNotModified() { mNotModified++; }
+
+    struct Stats {
+        std::size_t entries;
+        std::size_t bytes;
+        std::uint64_t hits;
+        std::uint64_t misses;
+        std::uint64_t notModified;
+        std::uint64_t reusedItems;
+        std::uint64_t convertedItems;
+        std::uint64_t deltas;
+    };
+    Stats getStats() const;
+
+    static std::string makeKey(const std::string &url, const RssConvertOptions &options);
+
+    /// quoted hex hash of body
+    static std::string makeETag(const std::string &body);
+    /// whether an If-None-Match value ("*" or a list of possibly weak tags) lists etag
+    static bool matchETag(const std::string &ifNoneMatch, const std::string &etag);
+
+private:
+    typedef std::list<std::pair<std::string, EntryPtr>> LruList;
+
+    void evict();
+    /// memory taken by the key and its entry, roughly
+    static std::size_t getSize(const std::string &key, const Entry &entry);
+    /// under mMutex, previous is null for a key not cached
+    void setVersion(Entry &entry, const Entry *previous);
+
+    /// appends length bytes of entry's json from pos to json
+    static bool appendJson(const Entry &entry, std::size_t pos, std::size_t length, std::string &json);
+    static bool parseCursor(const std::string &cursor, std::uint64_t &generation, std::uint64_t &version);
+
+    std::size_t mMaxEntries;
+    std::size_t mMaxBytes;
+    std::size_t mBytes; // of all entries
+    // most recently used first
+    LruList mLru;
+    std::map<std::string, LruList::iterator> mEntries;
+    mutable boost::mutex mMutex;
+    typedef boost::lock_guard<boost::mutex> LockGuard;
+
+    std::atomic<std::uint64_t> mNextGeneration;
+
+    std::atomic<std::uint64_t> mHits;
+    std::atomic<std::uint64_t> mMisses;
+    std::atomic<std::uint64_t> mNotModified;
+    std::atomic<std::uint64_t> mReusedItems;
+    std::atomic<std::uint64_t> mConvertedItems;
+    std::atomic<std::uint64_t> mDeltas;
+};
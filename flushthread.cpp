@@ -0,0 +1,39 @@
+#include "flushthread.h"
+
+FlushThread::FlushThread(unsigned interval, Flush flush)
+    : mInterval(interval),
+      mFlush(flush),
+      mStopping(false)
+{
+    mThread = boost::thread([this]() {
+        run();
+    });
+}
+
+FlushThread::~FlushThread()
+{
+    {
+        boost::lock_guard<boost::mutex> g(mMutex);
+        mStopping = true;
+    }
+    mWake.notify_all();
+    mThread.join();
+}
+
+void FlushThread::run()
+{
+    boost::unique_lock<boost::mutex> lock(mMutex);
+    for (;;) {
+        // read before flushing, what was handed over before the stop gets written
+        const bool stopping = mStopping;
+
+        lock.unlock();
+        mFlush();
+        lock.lock();
+
+        if (stopping) {
+            break;
+        }
+        mWake.timed_wait(lock, boost::posix_time::milliseconds(mInterval));
+    }
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <functional>
+
+#include <boost/thread.hpp>
+
+/// Background thread of the log writers: calls flush every interval ms,
+/// and once more when stopped, so nothing handed to the writer is lost.
+class FlushThread
+{
+public:
+    typedef std::function<void()> Flush;
+
+    /// interval in ms, flush runs on the new thread only
+    FlushThread(unsigned interval, Flush flush);
+    /// the last flush, then joins the thread
+    ~FlushThread();
+
+private:
+    FlushThread(const FlushThread &) = delete;
+    FlushThread &operator=(const FlushThread &) = delete;
+
+    void run();
+
+    const unsigned mInterval;
+    Flush mFlush;
+
+    bool mStopping;
+    boost::mutex mMutex;
+    boost::condition_variable mWake;
+    boost::thread mThread;
+};
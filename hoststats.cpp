@@ -0,0 +1,195 @@
+#include "hoststats.h"
+
+#include <algorithm>
+
+#define LATENCY_WINDOW 128
+#define MIN_LATENCY_SAMPLES 16
+// percentiles lag the window by that many samples at most
+#define RESORT_INTERVAL 8
+// hosts are whatever clients ask for, so their number is capped
+#define MAX_TRACKED_HOSTS 4096
+// fewer results in the window say too little to open a circuit
+#define MIN_BREAKER_REQUESTS 10
+
+HostStats::HostStats(unsigned failureThreshold, unsigned cooldown)
+    : mFailureThreshold(failureThreshold),
+      mCooldown(std::chrono::milliseconds(cooldown)),
+      mOpenCount(0),
+      mOpened(0)
+{ }
+
+void HostStats::setBreaker(unsigned failureThreshold, unsigned cooldown)
+{
+    LockGuard g(mMutex);
+
+    mFailureThreshold = failureThreshold;
+    mCooldown = std::chrono::milliseconds(cooldown);
+
+    if (failureThreshold == 0) {
+        for (auto it = mHosts.begin(); it != mHosts.end(); it++) {
+            it->second.state = Closed;
+            it->second.probing = false;
+        }
+        mOpenCount = 0;
+    }
+}
+
+void HostStats::addLatency(const std::string &host, unsigned ms)
+{
+    LockGuard g(mMutex);
+
+    Host &h = getHost(host);
+    if (h.window.size() < LATENCY_WINDOW) {
+        h.window.push_back(ms);
+    } else {
+        h.window[h.next] = ms;
+    }
+    h.next = (h.next + 1) % LATENCY_WINDOW;
+
+    if (++h.unsorted >= RESORT_INTERVAL || h.sorted.size() < MIN_LATENCY_SAMPLES) {
+        h.sorted = h.window;
+        std::sort(h.sorted.begin(), h.sorted.end());
+        h.unsorted = 0;
+    }
+}
+
+unsigned HostStats::getLatency(const std::string &host, double share) const
+{
+    LockGuard g(mMutex);
+
+    auto it = mHosts.find(host);
+    if (it == mHosts.end() || it->second.sorted.size() < MIN_LATENCY_SAMPLES) {
+        return 0;
+    }
+
+    const std::vector<unsigned> &sorted = it->second.sorted;
+    const std::size_t index = static_cast<std::size_t>(share * sorted.size());
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+bool HostStats::allowRequest(const std::string &host)
+{
+    if (mFailureThreshold == 0) {
+        return true;
+    }
+
+    LockGuard g(mMutex);
+
+    auto it = mHosts.find(host);
+    if (it == mHosts.end()) {
+        return true;
+    }
+
+    Host &h = it->second;
+    switch (h.state) {
+    case Closed:
+        return true;
+    case Open:
+        if (Clock::now() < h.openUntil) {
+            return false;
+        }
+        h.state = HalfOpen;
+        h.probing = true;
+        return true;
+    case HalfOpen:
+        // a probe cancelled without a result must not wedge the circuit
+        if (h.probing && Clock::now() < h.openUntil + mCooldown) {
+            return false;
+        }
+        h.probing = true;
+        h.openUntil = Clock::now();
+        return true;
+    }
+    return true;
+}
+
+void HostStats::addResult(const std::string &host, bool failed)
+{
+    if (mFailureThreshold == 0) {
+        return;
+    }
+
+    LockGuard g(mMutex);
+
+    const Clock::time_point now = Clock::now();
+    Host &h = getHost(host);
+
+    if (h.state == HalfOpen) {
+        // the probe decides, results of requests let through before opening don't
+        if (!h.probing) {
+            return;
+        }
+        h.probing = false;
+        if (failed) {
+            open(h, now);
+        } else {
+            h.state = Closed;
+            mOpenCount--;
+            for (unsigned i = 0; i < FailureBuckets; i++) {
+                h.requests[i] = h.failures[i] = 0;
+            }
+        }
+        return;
+    }
+    if (h.state == Open) {
+        return;
+    }
+
+    const std::int64_t second = std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch()).count();
+    const unsigned bucket = second % FailureBuckets;
+    if (h.bucketTime[bucket] != second) {
+        h.bucketTime[bucket] = second;
+        h.requests[bucket] = h.failures[bucket] = 0;
+    }
+    h.requests[bucket]++;
+    if (failed) {
+        h.failures[bucket]++;
+    } else {
+        return;
+    }
+
+    unsigned requests = 0;
+    unsigned failures = 0;
+    for (unsigned i = 0; i < FailureBuckets; i++) {
+        if (second - h.bucketTime[i] < FailureBuckets) {
+            requests += h.requests[i];
+            failures += h.failures[i];
+        }
+    }
+    if (requests >= MIN_BREAKER_REQUESTS && failures * 100 >= requests * mFailureThreshold) {
+        mOpenCount++;
+        open(h, now);
+    }
+}
+
+std::size_t HostStats::getOpenCount() const
+{
+    LockGuard g(mMutex);
+    return mOpenCount;
+}
+
+void HostStats::open(Host &h, Clock::time_point now)
+{
+    h.state = Open;
+    h.openUntil = now + mCooldown;
+    h.probing = false;
+    mOpened++;
+}
+
+HostStats::Host &HostStats::getHost(const std::string &host)
+{
+    auto it = mHosts.find(host);
+    if (it != mHosts.end()) {
+        return it->second;
+    }
+
+    if (mHosts.size() >= MAX_TRACKED_HOSTS) {
+        // no recency kept, any host makes room
+        it = mHosts.begin();
+        if (it->second.state != Closed) {
+            mOpenCount--;
+        }
+        mHosts.erase(it);
+    }
+    return mHosts[host];
+}
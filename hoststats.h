@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+/// Recent upstream latencies and failures per host, for decisions that
+/// depend on how a particular origin usually behaves rather than on a
+/// global setting. A host failing too often gets its circuit opened:
+/// requests to it are refused until a cooldown passes and a single probe
+/// succeeds.
+class HostStats
+{
+public:
+    /// failureThreshold is the failure percentage opening a circuit, 0
+    /// never opens one; cooldown in ms
+    HostStats(unsigned failureThreshold, unsigned cooldown);
+
+    /// time to first byte of a fetch from host, or how long one that got
+    /// none took to fail or time out, ms
+    void addLatency(const std::string &host, unsigned ms);
+    /// latency not exceeded by share (0..1) of recent fetches from host,
+    /// 0 while too few were seen to tell
+    unsigned getLatency(const std::string &host, double share) const;
+
+    /// false while host's circuit is open or its probe is in flight
+    bool allowRequest(const std::string &host);
+    void addResult(const std::string &host, bool failed);
+
+    std::size_t getOpenCount() const;
+    std::uint64_t getOpenedCount() const { return mOpened; }
+
+    /// new threshold and cooldown apply from the next result on, a
+    /// threshold of 0 closes every circuit
+    void setBreaker(unsigned failureThreshold, unsigned cooldown);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    enum CircuitState {
+        Closed,
+        Open,
+        HalfOpen
+    };
+
+    enum {
+        FailureBuckets = 10
+    };
+
+    struct Host {
+        Host()
+            : next(0),
+              unsorted(0),
+              state(Closed),
+              probing(false)
+        {
+            for (unsigned i = 0; i < FailureBuckets; i++) {
+                requests[i] = failures[i] = 0;
+                bucketTime[i] = 0;
+            }
+        }
+
+        std::vector<unsigned> window; // ring of recent samples
+        std::size_t next;
+        std::vector<unsigned> sorted; // window snapshot percentiles are read from
+        unsigned unsorted;            // samples added since the snapshot
+
+        // results per second of the last FailureBuckets seconds
+        unsigned requests[FailureBuckets];
+        unsigned failures[FailureBuckets];
+        std::int64_t bucketTime[FailureBuckets];
+
+        CircuitState state;
+        Clock::time_point openUntil;
+        bool probing; // the half-open circuit let its probe through
+    };
+
+    Host &getHost(const std::string &host);
+    void open(Host &h, Clock::time_point now);
+
+    std::atomic<unsigned> mFailureThreshold;
+    Clock::duration mCooldown;
+
+    std::map<std::string, Host> mHosts;
+    std::size_t mOpenCount;
+    std::atomic<std::uint64_t> mOpened;
+
+    mutable boost::mutex mMutex;
+    typedef boost::lock_guard<boost::mutex> LockGuard;
+};
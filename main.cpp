@@ -1,106 +1,394 @@
 #include <iostream>
+#include <sstream>
 
 #include <boost/date_time.hpp>
 
-#include <pugixml.hpp>
-#include "rapidjson/stringbuffer.h"
-#include "rapidjson/writer.h"
-
 #include "serverconfig.h"
+#include "configwatcher.h"
 #include "server.h"
 
 #include "client.h"
+#include "aggregator.h"
+#include "computepool.h"
+#include "feedcache.h"
+#include "murmurhash.h"
+#include "streamhub.h"
+#include "upstream.h"
 
 #include "uri.h"
 
-#include "rfc882/rfc882.h"
+#include "rssconverter.h"
+
+#define MAX_AGGREGATE_FEEDS 256
+
+template <typename T>
+bool parseNumber(const std::string &str, T &value)
+{
+    std::stringstream ss(str);
+    ss >> value;
+    return !ss.fail() && ss.eof();
+}
 
-std::string convertRssToJson(const std::string &rssString, bool &ok)
+/// "fields=title,link&limit=10&since=<epoch>&url=<feed url>"
+/// Plain feed url takes the rest of the query verbatim, so it may carry its own
+/// query string; percent-encoded url ends at the next '&' like any other value.
+/// since may be a cursor from X-Feed-Cursor instead of an epoch, told apart by its dot.
+bool parseFeedQuery(const std::string &query, std::string &url, RssConvertOptions &options, std::string &cursor)
 {
-    pugi::xml_document doc;
-    pugi::xml_parse_result result = doc.load_buffer(rssString.c_str(), rssString.size());
+    std::string::size_type urlBegin = query.compare(0, 4, "url=") == 0 ? 0 : query.find("&url=");
+    if (urlBegin == std::string::npos) {
+        return false;
+    }
+    if (urlBegin > 0) {
+        urlBegin++;
+    }
 
-    if (result) {
-        pugi::xml_node rss = doc.child("rss");
-        const std::string version = rss.attribute("version").as_string();
-        if (version != "2.0") {
-            ok = false;
-            return "";
+    std::string rest;
+    const std::string::size_type valueBegin = urlBegin + 4;
+    const std::string::size_type schemeEnd = query.find("://", valueBegin);
+    const std::string::size_type valueEnd = query.find('&', valueBegin);
+    if (schemeEnd != std::string::npos && schemeEnd < valueEnd) {
+        url = query.substr(valueBegin);
+    } else {
+        url = query.substr(valueBegin, valueEnd == std::string::npos ? std::string::npos : valueEnd - valueBegin);
+        if (valueEnd != std::string::npos) {
+            rest = query.substr(valueEnd + 1);
         }
-        pugi::xml_node channel = rss.child("channel");
-        pugi::xml_node title = channel.child("title");
-        pugi::xml_node desc = channel.child("description");
+    }
 
-        rapidjson::StringBuffer s;
-        rapidjson::Writer<rapidjson::StringBuffer> w(s);
+    const Uri::QueryItems items = Uri::parseQuery(query.substr(0, urlBegin) + rest);
+    for (auto it = items.begin(); it != items.end(); it++) {
+        bool ok = true;
+        if (it->first == "fields") {
+            ok = options.parseFields(Uri::decode(it->second));
+        } else if (it->first == "limit") {
+            ok = parseNumber(it->second, options.limit);
+        } else if (it->first == "since" && it->second.find('.') != std::string::npos) {
+            cursor = it->second;
+        } else if (it->first == "since") {
+            ok = parseNumber(it->second, options.since);
+        }
 
-        w.StartObject();
-        w.String("channel");
-        w.StartObject();
-        w.String("title");
-        if (title) {
-            w.String(title.text().as_string());
-        } else {
-            w.Null();
-        }
-        w.String("description");
-        if (desc) {
-            w.String(desc.text().as_string());
-        } else {
-            w.Null();
-        }
-        w.String("items");
-        w.StartArray();
-        for (pugi::xml_node item = channel.child("item"); item; item = item.next_sibling("item")) {
-            pugi::xml_node itemTitle = item.child("title");
-            pugi::xml_node itemLink = item.child("link");
-            pugi::xml_node itemDesc = item.child("description");
-            pugi::xml_node itemPubDate = item.child("pubDate");
-
-            w.StartObject();
-            w.String("title");
-            if (itemTitle) {
-                w.String(itemTitle.text().as_string());
-            } else {
-                w.Null();
-            }
-            w.String("link");
-            if (itemLink) {
-                w.String(itemLink.text().as_string());
+        if (!ok) {
+            return false;
+        }
+    }
+
+    return !url.empty();
+}
+
+/// moves a large body to disk if configured, runs on the compute pool
+void spillBody(const ServerConfig &conf, const Server::ResponsePtr &res)
+{
+    if (!conf.getSpillDir().empty() && res->body.size() >= conf.getSpillThreshold() &&
+            !res->spillBody(conf.getSpillDir())) {
+        std::cerr << "cannot spill response body to " << conf.getSpillDir() << std::endl;
+    }
+}
+
+/// conversion runs on the compute pool, the response is written from an io thread again;
+/// conf is the snapshot the request started with, held until it's answered. An upstream
+/// body converted before is taken from feedCache, a client holding the current ETag gets
+/// 304 either way. A known cursor gets only the items added since, any other the whole feed
+void handleFeedRequest(boost::asio::io_service &ioService, Upstream &upstream, ComputePool &computePool,
+                       FeedCache &feedCache, const ServerConfigPtr &conf, const std::string &urlString,
+                       const RssConvertOptions &options, const std::string &cursor, const Server::RequestPtr &req,
+                       Server::ResponsePtr &res, Server::ResponseCallback resCallback)
+{
+    // clock reads and the header only when asked for
+    typedef std::chrono::steady_clock Clock;
+    const bool timing = conf->getServerTiming();
+    const Clock::time_point fetchStart = timing ? Clock::now() : Clock::time_point();
+    const std::string ifNoneMatch = req->getHeader("If-None-Match");
+    const TracePtr &trace = req->trace;
+
+    upstream.fetch(urlString, conf->getRequestTimeout(), [&ioService, &computePool, &feedCache, conf, resCallback, res,
+                                                         urlString, options, cursor, ifNoneMatch, trace,
+                                                         timing, fetchStart](const Client::ResponsePtr &resCli) {
+        if (timing) {
+            res->addServerTiming("upstream", Clock::now() - fetchStart);
+        }
+
+        if (resCli->httpCode != Server::Response::HttpCode_OK) {
+            res->httpCode = resCli->httpCode;
+            resCallback(res);
+            return;
+        }
+
+        computePool.post([&computePool, &feedCache, conf, resCli, res, urlString, options, cursor, ifNoneMatch,
+                          trace, timing]() {
+            const std::string key = FeedCache::makeKey(urlString, options);
+            const std::uint64_t sourceHash = murmurHash64(resCli->body.data(), resCli->body.size());
+
+            const bool cached = conf->getFeedCacheSize() > 0;
+            FeedCache::EntryPtr entry = feedCache.find(key);
+            if (entry && entry->sourceHash == sourceHash) {
+                res->cache = "hit";
+                feedCache.addHit();
             } else {
-                w.Null();
+                res->cache = "miss";
+                auto newEntry = std::make_shared<FeedCache::Entry>();
+
+                const Clock::time_point convertStart = timing ? Clock::now() : Clock::time_point();
+                bool ok = false;
+                std::string json;
+                // items of the last conversion are reused whatever upstream body it came from,
+                // a spilled one is read back for that
+                std::string spilledJson;
+                if (cached && entry && (!entry->bodyFile || FeedCache::readJson(*entry, spilledJson))) {
+                    json = convertRssToJson(resCli->body, options, computePool, ok, trace,
+                                            entry->bodyFile ? spilledJson : entry->json, entry->items,
+                                            newEntry->items);
+                } else if (cached) {
+                    json = convertRssToJson(resCli->body, options, computePool, ok, trace,
+                                            std::string(), RssItemIndex(), newEntry->items);
+                } else {
+                    json = convertRssToJson(resCli->body, options, computePool, ok, trace);
+                }
+                if (timing) {
+                    res->addServerTiming("convert", Clock::now() - convertStart);
+                }
+                if (!ok) {
+                    res->httpCode = 415;
+                    res->headers["Content-Type"] = "application/json; charset=utf-8";
+                    res->body.swap(json);
+                    return;
+                }
+
+                newEntry->sourceHash = sourceHash;
+                newEntry->etag = FeedCache::makeETag(json);
+                newEntry->json.swap(json);
+                // once per conversion, hits share the file
+                if (!conf->getSpillDir().empty() && newEntry->json.size() >= conf->getSpillThreshold() &&
+                        !FeedCache::spill(*newEntry, conf->getSpillDir())) {
+                    std::cerr << "cannot spill response body to " << conf->getSpillDir() << std::endl;
+                }
+                feedCache.addMiss(newEntry->items.reused, newEntry->items.converted);
+                feedCache.put(key, newEntry);
+                entry = newEntry;
             }
-            w.String("description");
-            if (itemDesc) {
-                w.String(itemDesc.text().as_string());
-            } else {
-                w.Null();
+            if (timing) {
+                res->addServerTiming("cache", res->cache);
             }
-            w.String("pubDate");
-            if (itemPubDate) {
-                const std::string pubDate = itemPubDate.text().as_string();
-                std::time_t utc = RFC882::toUTC(pubDate, ok);
-                if (ok) {
-                    w.Int64(utc);
-                } else {
-                    return "";
+
+            if (cached) {
+                res->headers["X-Feed-Cursor"] = FeedCache::makeCursor(*entry);
+                if (!cursor.empty() && feedCache.writeDelta(*entry, cursor, res->body)) {
+                    res->headers["Content-Type"] = "application/json; charset=utf-8";
+                    return;
                 }
+            }
+
+            res->headers["ETag"] = entry->etag;
+            if (!ifNoneMatch.empty() && FeedCache::matchETag(ifNoneMatch, entry->etag)) {
+                res->httpCode = Server::Response::HttpCode_NotModified;
+                feedCache.addNotModified();
+                return;
+            }
+
+            res->headers["Content-Type"] = "application/json; charset=utf-8";
+            // sendfile takes an offset of its own, so connections share the file
+            if (entry->bodyFile) {
+                res->bodyFile = entry->bodyFile;
             } else {
-                w.Null();
+                res->body = entry->json;
             }
-            w.EndObject();
-        }
-        w.EndArray();
-        w.EndObject();
+        }, ioService, [resCallback, res]() {
+            resCallback(res);
+        });
+    }, trace);
+}
+
+void handleMetricsRequest(const Server &server, const Upstream &upstream, const ComputePool &computePool,
+                          const FeedCache &feedCache, const AccessLog *accessLog,
+                          Server::ResponsePtr &res, Server::ResponseCallback resCallback)
+{
+    const Upstream::Metrics metrics = upstream.getMetrics();
+    const ComputePool::Metrics compute = computePool.getMetrics();
+    const FeedCache::Stats cache = feedCache.getStats();
+
+    rapidjson::StringBuffer s;
+    rapidjson::Writer<rapidjson::StringBuffer> w(s);
+
+    w.StartObject();
+    w.String("connections");
+    w.Uint(server.getConnectionCount());
+    w.String("connectionsShed");
+    w.Uint64(server.getShedConnectionCount());
+    w.String("upstream");
+    w.StartObject();
+    w.String("activeFetches");
+    w.Uint(metrics.activeFetches);
+    w.String("queueDepth");
+    w.Uint64(metrics.queueDepth);
+    w.String("bufferedBytes");
+    w.Uint64(metrics.bufferedBytes);
+    w.String("admitted");
+    w.Uint64(metrics.admitted);
+    w.String("queued");
+    w.Uint64(metrics.queued);
+    w.String("shed");
+    w.Uint64(metrics.shed);
+    w.String("shedResponses");
+    w.Uint64(metrics.shedResponses);
+    w.String("hedges");
+    w.Uint64(metrics.hedges);
+    w.String("hedgeWins");
+    w.Uint64(metrics.hedgeWins);
+    w.String("hedgesOverBudget");
+    w.Uint64(metrics.hedgesOverBudget);
+    w.String("openCircuits");
+    w.Uint64(metrics.openCircuits);
+    w.String("circuitsOpened");
+    w.Uint64(metrics.circuitsOpened);
+    w.String("circuitRejected");
+    w.Uint64(metrics.circuitRejected);
+    w.String("tlsHandshakes");
+    w.Uint64(metrics.client.handshakes);
+    w.String("tlsResumedHandshakes");
+    w.Uint64(metrics.client.resumedHandshakes);
+    w.String("reusedConnections");
+    w.Uint64(metrics.client.reusedConnections);
+    w.String("redirects");
+    w.Uint64(metrics.client.redirects);
+    w.String("cachedRedirects");
+    w.Uint64(metrics.client.cachedRedirects);
+    w.String("redirectLoops");
+    w.Uint64(metrics.client.redirectLoops);
+    w.EndObject();
+    w.String("compute");
+    w.StartObject();
+    w.String("threads");
+    w.Uint(compute.threads);
+    w.String("queueDepth");
+    w.Uint64(compute.queueDepth);
+    w.String("tasks");
+    w.Uint64(compute.tasks);
+    w.String("steals");
+    w.Uint64(compute.steals);
+    w.String("queueWaitUs");
+    w.Double(compute.queueWaitUs);
+    w.EndObject();
+    w.String("feedCache");
+    w.StartObject();
+    w.String("entries");
+    w.Uint64(cache.entries);
+    w.String("bytes");
+    w.Uint64(cache.bytes);
+    w.String("hits");
+    w.Uint64(cache.hits);
+    w.String("misses");
+    w.Uint64(cache.misses);
+    w.String("notModified");
+    w.Uint64(cache.notModified);
+    w.String("reusedItems");
+    w.Uint64(cache.reusedItems);
+    w.String("convertedItems");
+    w.Uint64(cache.convertedItems);
+    w.String("deltas");
+    w.Uint64(cache.deltas);
+    w.EndObject();
+    if (accessLog) {
+        const AccessLog::Stats log = accessLog->getStats();
+        w.String("accessLog");
+        w.StartObject();
+        w.String("written");
+        w.Uint64(log.written);
+        w.String("dropped");
+        w.Uint64(log.dropped);
+        w.String("sampledOut");
+        w.Uint64(log.sampledOut);
         w.EndObject();
+    }
+    w.EndObject();
 
-        ok = true;
-        return s.GetString();
-    } else {
-        ok = false;
+    res->body = s.GetString();
+    res->headers["Content-Type"] = "application/json; charset=utf-8";
+    resCallback(res);
+}
+
+/// GET /aggregate?url=<encoded url>&url=...&limit=N&since=<epoch>
+/// or POST /aggregate?limit=N&since=<epoch> with newline separated urls in body
+void handleAggregateRequest(boost::asio::io_service &ioService, Upstream &upstream, ComputePool &computePool,
+                            const ServerConfigPtr &conf, const Server::RequestPtr &req,
+                            Server::ResponsePtr &res, Server::ResponseCallback resCallback)
+{
+    std::vector<std::string> urls;
+    Aggregator::Options options;
+    options.timeout = conf->getRequestTimeout();
+
+    const std::string::size_type queryBegin = req->url.find('?');
+    if (queryBegin != std::string::npos) {
+        const Uri::QueryItems query = Uri::parseQuery(req->url.substr(queryBegin + 1));
+        for (auto it = query.begin(); it != query.end(); it++) {
+            bool ok = true;
+            if (it->first == "url") {
+                urls.push_back(it->second);
+            } else if (it->first == "limit") {
+                ok = parseNumber(it->second, options.limit);
+            } else if (it->first == "since") {
+                ok = parseNumber(it->second, options.since);
+            }
+
+            if (!ok) {
+                res->httpCode = Server::Response::HttpCode_BadRequest;
+                resCallback(res);
+                return;
+            }
+        }
+    }
+
+    if (req->type == "POST") {
+        std::stringstream ss(req->body);
+        std::string line;
+        while (std::getline(ss, line)) {
+            const std::string::size_type begin = line.find_first_not_of(" \t\r");
+            if (begin == std::string::npos) {
+                continue;
+            }
+            const std::string::size_type end = line.find_last_not_of(" \t\r");
+            urls.push_back(line.substr(begin, end - begin + 1));
+        }
+    }
+
+    if (urls.empty() || urls.size() > MAX_AGGREGATE_FEEDS) {
+        res->httpCode = Server::Response::HttpCode_BadRequest;
+        resCallback(res);
+        return;
     }
-    return "";
+
+    auto aggregator = std::make_shared<Aggregator>(ioService, upstream, computePool);
+    aggregator->fetch(urls, options, [&ioService, &computePool, conf, resCallback, res](const std::string &json) {
+        res->body = json;
+        res->headers["Content-Type"] = "application/json; charset=utf-8";
+        if (conf->getSpillDir().empty() || res->body.size() < conf->getSpillThreshold()) {
+            resCallback(res);
+            return;
+        }
+        // off the io thread, which the merged feed is handed to
+        computePool.post([conf, res]() {
+            spillBody(*conf, res);
+        }, ioService, [resCallback, res]() {
+            resCallback(res);
+        });
+    });
+}
+
+Upstream::Limits makeUpstreamLimits(const ServerConfig &conf)
+{
+    Upstream::Limits limits;
+    limits.maxFetches = conf.getMaxUpstreamFetches();
+    limits.maxFetchesPerHost = conf.getMaxUpstreamFetchesPerHost();
+    limits.maxBufferedBytes = conf.getMaxBufferedBytes();
+    limits.queueTimeout = conf.getQueueTimeout();
+    limits.hedgeBudget = conf.getHedgeBudget();
+    limits.breakerThreshold = conf.getBreakerThreshold();
+    limits.breakerCooldown = conf.getBreakerCooldown();
+    limits.maxTimeout = conf.getMaxUpstreamTimeout();
+    limits.minTimeout = conf.getMinUpstreamTimeout();
+    return limits;
 }
+
 /*
 class ConsoleWriter {
 public:
@@ -133,17 +421,74 @@ int main(int argc, char *argv[])
 
     boost::asio::io_service ioService;
 
-    Server server(conf, ioService);
+    // handlers read settings from the store per request, so they follow reloads
+    auto configStore = std::make_shared<ConfigStore>(conf);
+
+    // these outlive the server, which writes to them
+    std::unique_ptr<AccessLog> accessLog;
+    if (!conf->getAccessLog().empty()) {
+        accessLog.reset(new AccessLog(conf->getAccessLog(), conf->getAccessLogSampling()));
+        if (!accessLog->isOpen()) {
+            std::cerr << "cannot open access log " << conf->getAccessLog() << std::endl;
+            return 1;
+        }
+    }
+
+    std::unique_ptr<Tracer> tracer;
+    if (!conf->getTraceFile().empty()) {
+        tracer.reset(new Tracer(conf->getTraceFile(), conf->getTraceSampling(), conf->getTraceFileSize()));
+        if (!tracer->isOpen()) {
+            std::cerr << "cannot open trace file " << conf->getTraceFile() << std::endl;
+            return 1;
+        }
+    }
+
+    Server server(configStore, ioService);
+    server.setAccessLog(accessLog.get());
+    server.setTracer(tracer.get());
 
 //    ConsoleWriter writer;
 
-    unsigned timeout = conf->getRequestTimeout();
-    server.setHandlerFunc([&ioService, /*&writer,*/ timeout](const Server::RequestPtr &req, Server::ResponsePtr &res,
+    // a single worker thread runs upstream clients without strands
+    auto clientContext = std::make_shared<Client::Context>(ioService, conf->getThreadCount() == 1);
+    if (!conf->getCaFile().empty() && !clientContext->loadCaFile(conf->getCaFile())) {
+        std::cerr << "cannot load CA file " << conf->getCaFile() << std::endl;
+        return 1;
+    }
+    Upstream upstream(ioService, makeUpstreamLimits(*conf), clientContext);
+
+    StreamHub streamHub(ioService, upstream, configStore);
+
+    ComputePool computePool(conf->getComputeThreads());
+
+    FeedCache feedCache(conf->getFeedCacheSize(), conf->getFeedCacheBytes());
+
+    ConfigWatcher configWatcher(ioService, configStore, [&server, &upstream, &feedCache, &accessLog, &tracer](const ServerConfig &conf) {
+        server.setThreadCount(conf.getThreadCount());
+        upstream.setLimits(makeUpstreamLimits(conf));
+        feedCache.setLimits(conf.getFeedCacheSize(), conf.getFeedCacheBytes());
+        if (accessLog) {
+            accessLog->setSampling(conf.getAccessLogSampling());
+        }
+        if (tracer) {
+            tracer->setSampling(conf.getTraceSampling());
+        }
+    });
+    configWatcher.start();
+
+    server.setHandlerFunc([&ioService, &server, &upstream, &streamHub, &computePool, &feedCache, &accessLog, /*&writer,*/ configStore](
+                          const Server::RequestPtr &req, Server::ResponsePtr &res,
                           Server::ResponseCallback resCallback)
     {
         //std::cout << req->type << " " << req->url << " " << req->version << std::endl;
 
-        if (req->type != "GET") {
+        const ServerConfigPtr conf = configStore->get();
+
+        const std::string aggregatePath = "/aggregate";
+        const bool isAggregate = req->url.compare(0, aggregatePath.size(), aggregatePath) == 0 &&
+                (req->url.size() == aggregatePath.size() || req->url[aggregatePath.size()] == '?');
+
+        if (req->type != "GET" && !(isAggregate && req->type == "POST")) {
             res->httpCode = Server::Response::HttpCode_NotImplemented;
             resCallback(res);
             return;
@@ -155,32 +500,44 @@ int main(int argc, char *argv[])
             return;
         }
 
-        const std::string reqPrefix = "/?url=";
+        if (isAggregate) {
+            handleAggregateRequest(ioService, upstream, computePool, conf, req, res, resCallback);
+            return;
+        }
+
+        if (req->url == "/metrics") {
+            handleMetricsRequest(server, upstream, computePool, feedCache, accessLog.get(), res, resCallback);
+            return;
+        }
+
+        const std::string streamPrefix = "/stream?url=";
+        if (req->url.compare(0, streamPrefix.size(), streamPrefix) == 0) {
+            res->headers["Content-Type"] = "text/event-stream; charset=utf-8";
+            res->headers["Cache-Control"] = "no-cache";
+
+            Server::StreamPtr stream = server.openStream(req, res, conf->getStreamQueueSize());
+            streamHub.subscribe(req->url.substr(streamPrefix.size()), stream);
+            return;
+        }
+
+        const std::string reqPrefix = "/?";
         if (req->url.substr(0, reqPrefix.size()) != reqPrefix) {
             res->httpCode = Server::Response::HttpCode_NotImplemented;
             resCallback(res);
             return;
         }
 
-        std::string urlString = req->url.substr(reqPrefix.size());
-
-        auto client = std::make_shared<Client>(ioService);
-
-        client->sendRequest("GET", urlString, timeout, [resCallback, res, &writer](const Client::ResponsePtr &resCli) {
-            if (resCli->httpCode != Server::Response::HttpCode_OK) {
-                res->httpCode = resCli->httpCode;
-            } else {
-                bool ok = false;
-//                writer.write(resCli->body);
-                res->body = convertRssToJson(resCli->body, ok);
-                res->headers["Content-Type"] = "application/json; charset=utf-8";
-                if (!ok) {
-                    res->httpCode = 415;
-                }
-//                writer.write(json);
-            }
+        std::string urlString;
+        RssConvertOptions options;
+        std::string cursor;
+        if (!parseFeedQuery(req->url.substr(reqPrefix.size()), urlString, options, cursor)) {
+            res->httpCode = Server::Response::HttpCode_BadRequest;
             resCallback(res);
-        });
+            return;
+        }
+
+        handleFeedRequest(ioService, upstream, computePool, feedCache, conf, urlString, options, cursor, req,
+                          res, resCallback);
     });
 
     server.join();
@@ -0,0 +1,41 @@
+#include "murmurhash.h"
+
+#include <cstring>
+
+std::uint64_t murmurHash64(const char *data, std::size_t size, std::uint64_t seed)
+{
+    const std::uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+
+    std::uint64_t h = seed ^ (size * m);
+
+    const char *end = data + (size & ~std::size_t(7));
+    for (; data != end; data += 8) {
+        std::uint64_t k;
+        std::memcpy(&k, data, 8);
+
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+
+        h ^= k;
+        h *= m;
+    }
+
+    switch (size & 7) {
+    case 7: h ^= std::uint64_t((unsigned char)data[6]) << 48; // fall through
+    case 6: h ^= std::uint64_t((unsigned char)data[5]) << 40; // fall through
+    case 5: h ^= std::uint64_t((unsigned char)data[4]) << 32; // fall through
+    case 4: h ^= std::uint64_t((unsigned char)data[3]) << 24; // fall through
+    case 3: h ^= std::uint64_t((unsigned char)data[2]) << 16; // fall through
+    case 2: h ^= std::uint64_t((unsigned char)data[1]) << 8;  // fall through
+    case 1: h ^= std::uint64_t((unsigned char)data[0]);
+            h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+
+    return h;
+}
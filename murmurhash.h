@@ -0,0 +1,8 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/// 64-bit MurmurHash64A of data, fast but not for anything adversarial;
+/// seed chains hashes of several pieces
+std::uint64_t murmurHash64(const char *data, std::size_t size, std::uint64_t seed = 0);
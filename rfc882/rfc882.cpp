@@ -2,7 +2,7 @@
 
 std::time_t RFC882::toUTC(const std::string &rfc882, bool &ok)
 {
-    tm time;
+    tm time = tm();
 
     char *r = strptime(rfc882.c_str(), "%a, %e %h %Y %H:%M:%S %z", &time);
     if (r == NULL) {
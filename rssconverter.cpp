@@ -0,0 +1,544 @@
+#include "rssconverter.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+#include "computepool.h"
+#include "murmurhash.h"
+#include "rfc882/rfc882.h"
+#include "tracer.h"
+
+// smaller feeds convert faster than ranges are handed out
+#define PARALLEL_CONVERT_MIN_SIZE (256 * 1024)
+#define MIN_RANGE_ITEMS 64
+// ranges per converting thread, so threads finishing early take more
+#define RANGES_PER_THREAD 4
+
+namespace {
+
+// nanoseconds this thread spent converting dates, counted only while set
+thread_local std::uint64_t *tDateNs = nullptr;
+
+/// counts date conversion of the current thread into ns while alive
+struct DateTiming {
+    explicit DateTiming(std::uint64_t *ns)
+        : outer(tDateNs)
+    {
+        tDateNs = ns;
+    }
+
+    ~DateTiming()
+    {
+        tDateNs = outer;
+    }
+
+    std::uint64_t *outer;
+};
+
+/// earlier conversion of a feed items are copied from and the index of the
+/// one in progress
+struct ItemReuse {
+    ItemReuse(const std::string &previousJson, const RssItemIndex &previous, RssItemIndex &index)
+        : previousJson(previousJson),
+          previous(previous),
+          index(index)
+    { }
+
+    const std::string &previousJson;
+    const RssItemIndex &previous;
+    RssItemIndex &index;
+};
+
+/// items [begin, end) of a feed converted on their own
+struct ItemRange {
+    ItemRange()
+        : begin(0),
+          end(0),
+          reused(0),
+          failed(false),
+          dateNs(0)
+    { }
+
+    std::size_t begin;
+    std::size_t end;
+    rapidjson::StringBuffer json;       // items back to back
+    std::vector<std::size_t> ends;      // end of each item in json, filtered out ones are empty
+    std::vector<std::uint64_t> hashes;  // of each item, if reusing
+    std::size_t reused;                 // items copied from the previous conversion
+    bool failed;                        // an item's pubDate is malformed, the rest is not converted
+    std::uint64_t dateNs;               // spent on dates, if traced
+};
+
+/// hash of everything item's json can be made of with options
+std::uint64_t hashRssItem(const pugi::xml_node &item, const RssConvertOptions &options)
+{
+    // in the order of RssConvertOptions::Field bits
+    static const char *const fields[] = { "title", "link", "description", "pubDate" };
+
+    unsigned read = options.fields;
+    if (options.since > 0) {
+        read |= RssConvertOptions::Field_PubDate;
+    }
+
+    std::uint64_t hash = 0;
+    for (std::uint64_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        if (!(read & (1 << i))) {
+            continue;
+        }
+        const pugi::xml_node node = item.child(fields[i]);
+        // a missing field hashes apart from an empty one
+        const char *text = node ? node.text().as_string() : "";
+        hash = murmurHash64(text, std::strlen(text), hash ^ (i << 1 | (node ? 1 : 0)));
+    }
+    return hash;
+}
+
+/// appends item's json to s unless options filter it out, copied from the
+/// previous conversion if reuse has it; hash is set if reuse is given.
+/// false if item's pubDate is malformed
+bool appendRssItem(rapidjson::StringBuffer &s, RssJsonWriter &w, const pugi::xml_node &item,
+                   const RssConvertOptions &options, const ItemReuse *reuse, std::uint64_t &hash, bool &reused)
+{
+    reused = false;
+    if (reuse) {
+        hash = hashRssItem(item, options);
+        auto it = reuse->previous.spans.find(hash);
+        if (it != reuse->previous.spans.end()) {
+            const char *json = reuse->previousJson.data();
+            const std::size_t size = it->second.end - it->second.begin;
+            std::copy(json + it->second.begin, json + it->second.end, s.Push(size));
+            reused = true;
+            return true;
+        }
+    }
+
+    // every item is a root value of its own to the writer
+    w.Reset(s);
+    bool written = false;
+    return writeRssItem(w, item, options, written);
+}
+
+/// Ranges are claimed by whoever comes first, the caller included, so the
+/// caller never waits for a range no thread has started: a pool busy with
+/// other work just leaves the caller converting alone.
+struct ParallelConversion {
+    ParallelConversion(const std::vector<pugi::xml_node> &items, const RssConvertOptions &options,
+                       const ItemReuse *reuse, bool traced)
+        : items(items),
+          options(options),
+          reuse(reuse),
+          traced(traced),
+          next(0),
+          finished(0)
+    { }
+
+    /// converts claimed ranges until there are none left
+    void run();
+    void wait();
+
+    const std::vector<pugi::xml_node> &items;
+    const RssConvertOptions options;
+    const ItemReuse *reuse;
+    const bool traced;
+    std::vector<std::unique_ptr<ItemRange>> ranges;
+
+    std::atomic<std::size_t> next;
+    std::size_t finished;
+    boost::mutex mutex;
+    boost::condition_variable done;
+};
+
+void convertRange(const std::vector<pugi::xml_node> &items, const RssConvertOptions &options,
+                  const ItemReuse *reuse, bool traced, ItemRange &range)
+{
+    DateTiming timing(traced ? &range.dateNs : nullptr);
+
+    RssJsonWriter w(range.json);
+    for (std::size_t i = range.begin; i < range.end; i++) {
+        std::uint64_t hash = 0;
+        bool reused = false;
+        if (!appendRssItem(range.json, w, items[i], options, reuse, hash, reused)) {
+            range.failed = true;
+            return;
+        }
+        range.ends.push_back(range.json.GetSize());
+        if (reuse) {
+            range.hashes.push_back(hash);
+            range.reused += reused ? 1 : 0;
+        }
+    }
+}
+
+void ParallelConversion::run()
+{
+    for (;;) {
+        const std::size_t index = next++;
+        if (index >= ranges.size()) {
+            return;
+        }
+
+        convertRange(items, options, reuse, traced, *ranges[index]);
+
+        boost::lock_guard<boost::mutex> g(mutex);
+        if (++finished == ranges.size()) {
+            done.notify_all();
+        }
+    }
+}
+
+void ParallelConversion::wait()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (finished < ranges.size()) {
+        done.wait(lock);
+    }
+}
+
+/// appends items, comma separated, to s holding an open json array;
+/// false if one of them fails
+bool writeRssItems(rapidjson::StringBuffer &s, const std::vector<pugi::xml_node> &items,
+                   const RssConvertOptions &options, ItemReuse *reuse, ComputePool &pool, std::size_t rangeCount)
+{
+    auto conversion = std::make_shared<ParallelConversion>(items, options, reuse, tDateNs != nullptr);
+    for (std::size_t i = 0; i < rangeCount; i++) {
+        std::unique_ptr<ItemRange> range(new ItemRange);
+        range->begin = items.size() * i / rangeCount;
+        range->end = items.size() * (i + 1) / rangeCount;
+        conversion->ranges.push_back(std::move(range));
+    }
+
+    // a helper starting after all ranges are claimed only finds none left
+    for (unsigned i = 0; i < pool.getThreadCount(); i++) {
+        pool.post([conversion]() {
+            conversion->run();
+        });
+    }
+    conversion->run();
+    conversion->wait();
+
+    // in item order, straight to the buffer: the writer only knows of the array
+    bool first = true;
+    for (auto it = conversion->ranges.begin(); it != conversion->ranges.end(); it++) {
+        const ItemRange &range = **it;
+        if (tDateNs) {
+            *tDateNs += range.dateNs;
+        }
+        const char *json = range.json.GetString();
+        std::size_t begin = 0;
+        for (std::size_t i = 0; i < range.ends.size(); i++) {
+            const std::size_t end = range.ends[i];
+            const std::size_t size = end - begin;
+            if (size > 0 && !first) {
+                s.Put(',');
+            }
+            if (reuse) {
+                const RssItemIndex::Span span = { s.GetSize(), s.GetSize() + size };
+                reuse->index.spans[range.hashes[i]] = span;
+            }
+            if (size > 0) {
+                first = false;
+                std::copy(json + begin, json + end, s.Push(size));
+            }
+            begin = end;
+        }
+        if (reuse) {
+            reuse->index.reused += range.reused;
+            reuse->index.converted += range.ends.size() - range.reused;
+        }
+
+        if (range.failed) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// serial counterpart of writeRssItems copying reused items
+bool writeRssItemsReusing(rapidjson::StringBuffer &s, const pugi::xml_node &channel,
+                          const RssConvertOptions &options, ItemReuse &reuse)
+{
+    RssJsonWriter w(s);
+    std::size_t count = 0;
+    for (pugi::xml_node item = channel.child("item"); item; item = item.next_sibling("item")) {
+        if (options.limit > 0 && count >= options.limit) {
+            break;
+        }
+
+        if (count > 0) {
+            s.Put(',');
+        }
+        const std::size_t begin = s.GetSize();
+        std::uint64_t hash = 0;
+        bool reused = false;
+        if (!appendRssItem(s, w, item, options, &reuse, hash, reused)) {
+            return false;
+        }
+        const RssItemIndex::Span span = { begin, s.GetSize() };
+        reuse.index.spans[hash] = span;
+        reuse.index.reused += reused ? 1 : 0;
+        reuse.index.converted += reused ? 0 : 1;
+
+        if (span.end > span.begin) {
+            count++;
+        } else if (count > 0) {
+            // filtered out, and so is its comma
+            s.Pop(1);
+        }
+    }
+    return true;
+}
+
+/// json of parsed feed doc, rssSize bytes long as xml
+std::string writeFeed(const pugi::xml_document &doc, std::size_t rssSize, const RssConvertOptions &options,
+                      ComputePool *pool, ItemReuse *reuse, bool &ok)
+{
+    pugi::xml_node channel = findRssChannel(doc);
+    if (!channel) {
+        ok = false;
+        return "";
+    }
+
+    std::vector<pugi::xml_node> items;
+    if (pool && rssSize >= PARALLEL_CONVERT_MIN_SIZE) {
+        for (pugi::xml_node item = channel.child("item"); item; item = item.next_sibling("item")) {
+            items.push_back(item);
+        }
+    }
+    const std::size_t threads = pool ? pool->getThreadCount() + 1 : 1;
+    const std::size_t rangeCount = std::min<std::size_t>(threads * RANGES_PER_THREAD, items.size() / MIN_RANGE_ITEMS);
+    // a limit below the item count means the serial walk stops early anyway
+    const bool parallel = rangeCount >= 2 && (options.limit == 0 || options.limit >= items.size());
+
+    rapidjson::StringBuffer s;
+    RssJsonWriter w(s);
+
+    w.StartObject();
+    w.String("channel");
+    w.StartObject();
+    writeRssText(w, "title", channel.child("title"));
+    writeRssText(w, "description", channel.child("description"));
+    w.String("items");
+    w.StartArray();
+    if (reuse) {
+        reuse->index.itemsBegin = s.GetSize();
+    }
+    if (parallel) {
+        ok = writeRssItems(s, items, options, reuse, *pool, rangeCount);
+        if (!ok) {
+            return "";
+        }
+    } else if (reuse) {
+        ok = writeRssItemsReusing(s, channel, options, *reuse);
+        if (!ok) {
+            return "";
+        }
+    } else {
+        std::size_t count = 0;
+        for (pugi::xml_node item = channel.child("item"); item; item = item.next_sibling("item")) {
+            if (options.limit > 0 && count >= options.limit) {
+                break;
+            }
+
+            bool written = false;
+            ok = writeRssItem(w, item, options, written);
+            if (!ok) {
+                return "";
+            }
+            if (written) {
+                count++;
+            }
+        }
+    }
+    if (reuse) {
+        reuse->index.itemsEnd = s.GetSize();
+    }
+    w.EndArray();
+    w.EndObject();
+    w.EndObject();
+
+    ok = true;
+    return s.GetString();
+}
+
+std::string convert(const std::string &rssString, const RssConvertOptions &options, ComputePool *pool,
+                    ItemReuse *reuse, bool &ok, Trace *trace)
+{
+    const Trace::Clock::time_point start = trace ? Trace::Clock::now() : Trace::Clock::time_point();
+
+    pugi::xml_document doc;
+    pugi::xml_parse_result result = doc.load_buffer(rssString.c_str(), rssString.size());
+    if (!result) {
+        ok = false;
+        return "";
+    }
+
+    if (!trace) {
+        return writeFeed(doc, rssString.size(), options, pool, reuse, ok);
+    }
+
+    const Trace::Clock::time_point parsed = Trace::Clock::now();
+    trace->add("parse", start, parsed, "bytes", rssString.size());
+
+    std::uint64_t dateNs = 0;
+    std::string json;
+    {
+        DateTiming timing(&dateNs);
+        json = writeFeed(doc, rssString.size(), options, pool, reuse, ok);
+    }
+    trace->add("convert", parsed, Trace::Clock::now(), "dateUs", dateNs / 1000);
+    return json;
+}
+
+} // namespace
+
+pugi::xml_node findRssChannel(const pugi::xml_document &doc)
+{
+    pugi::xml_node rss = doc.child("rss");
+    const std::string version = rss.attribute("version").as_string();
+    if (version != "2.0") {
+        return pugi::xml_node();
+    }
+    return rss.child("channel");
+}
+
+void writeRssText(RssJsonWriter &w, const char *key, const pugi::xml_node &node)
+{
+    w.String(key);
+    if (node) {
+        w.String(node.text().as_string());
+    } else {
+        w.Null();
+    }
+}
+
+bool parseRssPubDate(const pugi::xml_node &item, std::time_t &utc, bool &hasDate)
+{
+    pugi::xml_node itemPubDate = item.child("pubDate");
+    hasDate = itemPubDate;
+    if (!hasDate) {
+        return true;
+    }
+
+    bool ok = false;
+    const std::string pubDate = itemPubDate.text().as_string();
+    if (!tDateNs) {
+        utc = RFC882::toUTC(pubDate, ok);
+        return ok;
+    }
+
+    const Trace::Clock::time_point begin = Trace::Clock::now();
+    utc = RFC882::toUTC(pubDate, ok);
+    *tDateNs += std::chrono::duration_cast<std::chrono::nanoseconds>(Trace::Clock::now() - begin).count();
+    return ok;
+}
+
+bool RssConvertOptions::parseFields(const std::string &list)
+{
+    unsigned result = 0;
+
+    std::string::size_type begin = 0;
+    while (begin <= list.size()) {
+        std::string::size_type end = list.find(',', begin);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+
+        const std::string field = list.substr(begin, end - begin);
+        if (field == "title") {
+            result |= Field_Title;
+        } else if (field == "link") {
+            result |= Field_Link;
+        } else if (field == "description") {
+            result |= Field_Description;
+        } else if (field == "pubDate") {
+            result |= Field_PubDate;
+        } else if (!field.empty()) {
+            return false;
+        }
+
+        begin = end + 1;
+    }
+
+    // items of no fields would all be {}
+    if (result == 0) {
+        return false;
+    }
+
+    fields = result;
+    return true;
+}
+
+bool writeRssItem(RssJsonWriter &w, const pugi::xml_node &item)
+{
+    bool written = false;
+    return writeRssItem(w, item, RssConvertOptions(), written);
+}
+
+bool writeRssItem(RssJsonWriter &w, const pugi::xml_node &item, const RssConvertOptions &options, bool &written)
+{
+    written = false;
+
+    std::time_t utc = 0;
+    bool hasDate = false;
+    if ((options.fields & RssConvertOptions::Field_PubDate) || options.since > 0) {
+        if (!parseRssPubDate(item, utc, hasDate)) {
+            return false;
+        }
+        if (options.since > 0 && (!hasDate || utc < options.since)) {
+            return true;
+        }
+    }
+
+    w.StartObject();
+    if (options.fields & RssConvertOptions::Field_Title) {
+        writeRssText(w, "title", item.child("title"));
+    }
+    if (options.fields & RssConvertOptions::Field_Link) {
+        writeRssText(w, "link", item.child("link"));
+    }
+    if (options.fields & RssConvertOptions::Field_Description) {
+        writeRssText(w, "description", item.child("description"));
+    }
+    if (options.fields & RssConvertOptions::Field_PubDate) {
+        w.String("pubDate");
+        if (hasDate) {
+            w.Int64(utc);
+        } else {
+            w.Null();
+        }
+    }
+    w.EndObject();
+
+    written = true;
+    return true;
+}
+
+std::string convertRssToJson(const std::string &rssString, bool &ok)
+{
+    return convertRssToJson(rssString, RssConvertOptions(), ok);
+}
+
+std::string convertRssToJson(const std::string &rssString, const RssConvertOptions &options, bool &ok)
+{
+    return convert(rssString, options, nullptr, nullptr, ok, nullptr);
+}
+
+std::string convertRssToJson(const std::string &rssString, const RssConvertOptions &options,
+                             ComputePool &pool, bool &ok, const std::shared_ptr<Trace> &trace)
+{
+    return convert(rssString, options, &pool, nullptr, ok, trace.get());
+}
+
+std::string convertRssToJson(const std::string &rssString, const RssConvertOptions &options,
+                             ComputePool &pool, bool &ok, const std::shared_ptr<Trace> &trace,
+                             const std::string &previousJson, const RssItemIndex &previousItems,
+                             RssItemIndex &index)
+{
+    ItemReuse reuse(previousJson, previousItems, index);
+    return convert(rssString, options, &pool, &reuse, ok, trace.get());
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include <pugixml.hpp>
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
+
+typedef rapidjson::Writer<rapidjson::StringBuffer> RssJsonWriter;
+
+struct RssConvertOptions {
+    RssConvertOptions()
+        : fields(Field_All),
+          limit(0),
+          since(0)
+    { }
+
+    enum Field : unsigned {
+        Field_Title       = 1 << 0,
+        Field_Link        = 1 << 1,
+        Field_Description = 1 << 2,
+        Field_PubDate     = 1 << 3,
+        Field_All         = Field_Title | Field_Link | Field_Description | Field_PubDate,
+    };
+
+    /// parses comma separated list of item fields, e.g. "title,link,pubDate";
+    /// false for an unknown field or a list naming none, which requests answer with 400
+    bool parseFields(const std::string &list);
+
+    unsigned fields;   // item fields to emit, the rest is never copied nor escaped
+    std::size_t limit; // conversion stops after that many items, 0 means unlimited
+    std::time_t since; // items published before are skipped
+};
+
+/// Where each item's json is in a converted feed, by a hash of the item
+/// content the json is made of, so a later conversion of the same feed with
+/// the same options copies unchanged items instead of converting them again
+struct RssItemIndex {
+    RssItemIndex()
+        : itemsBegin(0),
+          itemsEnd(0),
+          reused(0),
+          converted(0)
+    { }
+
+    struct Span {
+        std::size_t begin;
+        std::size_t end; // same as begin for an item filtered out by options.since
+    };
+
+    typedef std::unordered_map<std::uint64_t, Span> Spans;
+
+    Spans spans;
+    std::size_t itemsBegin; // of the items array content, past its '['
+    std::size_t itemsEnd;   // at the array's ']'
+    std::size_t reused;     // items copied from the previous conversion
+    std::size_t converted;  // items converted anew
+};
+
+class ComputePool;
+class Trace;
+
+std::string convertRssToJson(const std::string &rssString, bool &ok);
+std::string convertRssToJson(const std::string &rssString, const RssConvertOptions &options, bool &ok);
+
+/// same as above, items of a large feed are converted in ranges by the
+/// calling thread and pool threads together; the output is identical.
+/// trace, if given, gets "parse" and "convert" spans, the latter with the
+/// time spent on dates summed over the converting threads
+std::string convertRssToJson(const std::string &rssString, const RssConvertOptions &options,
+                             ComputePool &pool, bool &ok,
+                             const std::shared_ptr<Trace> &trace = std::shared_ptr<Trace>());
+
+/// same as above, items found in previousItems are copied from previousJson,
+/// an earlier conversion of the same feed with the same options; index is
+/// filled with the items of the new conversion
+std::string convertRssToJson(const std::string &rssString, const RssConvertOptions &options,
+                             ComputePool &pool, bool &ok, const std::shared_ptr<Trace> &trace,
+                             const std::string &previousJson, const RssItemIndex &previousItems,
+                             RssItemIndex &index);
+
+/// returns <channel> node of rss 2.0 document or null node for any other document
+pugi::xml_node findRssChannel(const pugi::xml_document &doc);
+
+/// writes "key": "node text" pair, value is null if node is missing
+void writeRssText(RssJsonWriter &w, const char *key, const pugi::xml_node &node);
+
+/// writes <item> as json object, returns false if item's pubDate is malformed
+bool writeRssItem(RssJsonWriter &w, const pugi::xml_node &item);
+
+/// same as above with field projection, written is false for items filtered out by options.since
+bool writeRssItem(RssJsonWriter &w, const pugi::xml_node &item, const RssConvertOptions &options, bool &written);
+
+/// parses item's <pubDate>, hasDate is false if item has no date at all
+bool parseRssPubDate(const pugi::xml_node &item, std::time_t &utc, bool &hasDate);
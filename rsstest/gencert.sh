@@ -0,0 +1,27 @@
+#!/bin/sh
+# Generates a self-signed test CA and a localhost certificate signed by it:
+#
+#   ./gencert.sh certs
+#   go run server.go 8443 certs/server.pem certs/server.key
+#
+# and "caFile": "rsstest/certs/ca.pem" in rssproxy config.
+
+set -e
+
+DIR=${1:-certs}
+mkdir -p "$DIR"
+cd "$DIR"
+
+openssl req -x509 -newkey rsa:2048 -nodes -days 365 \
+    -subj "/CN=rssproxy test CA" \
+    -keyout ca.key -out ca.pem
+
+openssl req -newkey rsa:2048 -nodes \
+    -subj "/CN=localhost" \
+    -keyout server.key -out server.csr
+
+printf "subjectAltName=DNS:localhost,IP:127.0.0.1\n" > server.ext
+openssl x509 -req -in server.csr -CA ca.pem -CAkey ca.key -CAcreateserial \
+    -days 365 -extfile server.ext -out server.pem
+
+rm -f server.csr server.ext ca.srl
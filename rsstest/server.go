@@ -120,7 +120,14 @@ func main() {
 		Handler: router,
 	}
 
-	err := server.ListenAndServe()
+	// server.go <port> [cert.pem key.pem] serves https with the given
+	// certificate, see gencert.sh for a self-signed test CA
+	var err error
+	if len(args) >= 3 {
+		err = server.ListenAndServeTLS(args[1], args[2])
+	} else {
+		err = server.ListenAndServe()
+	}
 	if err != nil {
 		log.Fatal(err)
 	}
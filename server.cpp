@@ -1,13 +1,395 @@
 #include "server.h"
 #include "serverconfig.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+
+#include <boost/asio/steady_timer.hpp>
+
+#include <strings.h>
+#include <sys/sendfile.h>
+
+#define MAX_REQUEST_BODY_SIZE (1024 * 1024)
+// one sendfile call moves at most that much, so a fast client doesn't hog the io thread
+#define SENDFILE_CHUNK_SIZE (1024 * 1024)
+
+namespace {
+
+/// thrown out of io_service::run() to end one worker thread
+struct RetireWorker { };
+
+} // namespace
+
+/// Single timer per connection enforces both the phase deadline (e.g. whole
+/// request header must arrive within headerTimeout) and the idle deadline.
+/// I/O progress only moves mDeadline forward without touching the timer,
+/// the timer re-arms itself to the new deadline when it fires.
+///
+/// Socket operations are started and completed on the connection's strand,
+/// so the timer closing the socket never runs alongside one of them.
+struct Server::Connection : public std::enable_shared_from_this<Server::Connection>
+{
+    typedef std::chrono::steady_clock Clock;
+
+    Connection(Server &server, boost::asio::io_service &ioService, unsigned idleTimeout)
+        : socket(new boost::asio::ip::tcp::socket(ioService)),
+          strand(ioService),
+          mServer(server),
+          mTimer(ioService),
+          mIdleTimeout(std::chrono::milliseconds(idleTimeout)),
+          mPhaseDeadline(Clock::time_point::max()),
+          mDeadline(Clock::time_point::max()),
+          mIdle(false),
+          mWaiting(false),
+          mClosed(false),
+          mCounted(false),
+          mPeerAcquired(false),
+          mLogged(false),
+          mSent(0)
+    { }
+
+    ~Connection()
+    {
+        if (mCounted) {
+            mServer.mConnectionCount--;
+        }
+        if (mPeerAcquired) {
+            mServer.releasePeer(mPeer);
+        }
+    }
+
+    bool admit()
+    {
+        const unsigned limit = mServer.mConfig->get()->getMaxConnections();
+        mCounted = true;
+        return ++mServer.mConnectionCount <= limit || limit == 0;
+    }
+
+    bool acquirePeer()
+    {
+        mPeer = peerEndpoint.address();
+        mPeerAcquired = mServer.acquirePeer(mPeer);
+        return mPeerAcquired;
+    }
+
+    /// decides whether the connection's request goes to the access log
+    void startLog()
+    {
+        AccessLog *log = mServer.mAccessLog.load(std::memory_order_acquire);
+        mLogged = log && log->sample();
+        if (mLogged) {
+            mStartTime = std::chrono::system_clock::now();
+            mAccepted = Clock::now();
+            mRead = mAccepted;
+        }
+    }
+
+    /// the request is read, ends its "read" span
+    void traceRequest(const Request &req)
+    {
+        if (req.trace) {
+            mTrace = req.trace;
+            mTrace->setName(req.type + " " + req.url);
+            traceStep("read", mTrace->getStart());
+        }
+    }
+
+    void traceStep(const char *name)
+    {
+        traceStep(name, mTraceMark);
+    }
+
+    void logRequest(const Request &req)
+    {
+        if (mLogged) {
+            mMethod = req.type;
+            mUrl = req.url;
+            mRead = Clock::now();
+        }
+    }
+
+    void logHandled()
+    {
+        if (mLogged) {
+            mHandled = Clock::now();
+        }
+    }
+
+    /// bytes of the response written so far
+    void addSent(std::size_t bytes) { mSent += bytes; }
+
+    /// the response is written or given up on
+    void finishResponse(const Response &res)
+    {
+        if (mTrace) {
+            traceStep("write");
+            mTrace.reset();
+        }
+        logResponse(res);
+    }
+
+    void logResponse(const Response &res)
+    {
+        AccessLog *log = mServer.mAccessLog.load(std::memory_order_acquire);
+        AccessLog::Entry *entry = mLogged && log ? log->acquire() : nullptr;
+        if (!entry) {
+            return;
+        }
+        mLogged = false;
+
+        const Clock::time_point now = Clock::now();
+        entry->time = mStartTime;
+        entry->peer = mPeer;
+        entry->method.swap(mMethod);
+        entry->url.swap(mUrl);
+        entry->httpCode = res.httpCode;
+        entry->bytes = mSent;
+        entry->cache = res.cache;
+        entry->readUs = toUs(mRead - mAccepted);
+        entry->handleUs = toUs(mHandled - mRead);
+        entry->writeUs = toUs(now - mHandled);
+        log->publish();
+    }
+
+    /// starts new phase, timeout 0 means the phase itself has no deadline
+    void startPhase(unsigned timeout, bool idle)
+    {
+        LockGuard g(mMutex);
+
+        const Clock::time_point now = Clock::now();
+        mPhaseDeadline = timeout > 0 ? now + std::chrono::milliseconds(timeout) : Clock::time_point::max();
+        mIdle = idle && mIdleTimeout.count() > 0;
+        updateDeadline(now);
+
+        if (!mWaiting || mDeadline < mTimer.expires_at()) {
+            // deadline moved backwards, timer has to be re-armed right now
+            wait();
+        }
+    }
+
+    /// no deadlines at all, e.g. for long-lived event streams
+    void disarm()
+    {
+        LockGuard g(mMutex);
+        mPhaseDeadline = Clock::time_point::max();
+        mIdle = false;
+        mDeadline = Clock::time_point::max();
+    }
+
+    /// called on every bit of I/O progress
+    void touch()
+    {
+        if (mIdle.load(std::memory_order_relaxed)) {
+            LockGuard g(mMutex);
+            updateDeadline(Clock::now());
+        }
+    }
+
+    /// only on the strand
+    void close()
+    {
+        mClosed = true;
+        boost::system::error_code ec;
+        socket->shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+        socket->close(ec);
+    }
+
+    /// only on the strand, syscalls on the raw fd check it first, as the
+    /// descriptor may already be reused by another socket
+    bool isClosed() const { return mClosed; }
+
+    const SocketPtr socket;
+    // filled in by accept, saves asking the socket for it
+    boost::asio::ip::tcp::endpoint peerEndpoint;
+    boost::asio::io_service::strand strand;
+
+private:
+    void traceStep(const char *name, Clock::time_point begin)
+    {
+        if (mTrace) {
+            mTraceMark = Clock::now();
+            mTrace->add(name, begin, mTraceMark);
+        }
+    }
+
+    static std::uint32_t toUs(Clock::duration duration)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    }
+
+    void updateDeadline(Clock::time_point now)
+    {
+        mDeadline = mPhaseDeadline;
+        if (mIdle && now + mIdleTimeout < mDeadline) {
+            mDeadline = now + mIdleTimeout;
+        }
+    }
+
+    void wait()
+    {
+        if (mDeadline == Clock::time_point::max()) {
+            return;
+        }
+
+        std::weak_ptr<Connection> weakPtr = shared_from_this();
+        mWaiting = true;
+        mTimer.expires_at(mDeadline);
+        mTimer.async_wait(strand.wrap([weakPtr](const boost::system::error_code &err) {
+            ConnectionPtr thisPtr = weakPtr.lock();
+            if (err || !thisPtr) {
+                return;
+            }
+
+            LockGuard g(thisPtr->mMutex);
+            thisPtr->mWaiting = false;
+            if (Clock::now() >= thisPtr->mDeadline) {
+                thisPtr->close();
+            } else {
+                thisPtr->wait();
+            }
+        }));
+    }
+
+    Server &mServer;
+    boost::asio::steady_timer mTimer;
+    const Clock::duration mIdleTimeout;
+    Clock::time_point mPhaseDeadline;
+    Clock::time_point mDeadline;
+    // read without the lock by touch()
+    std::atomic<bool> mIdle;
+    bool mWaiting;
+    bool mClosed; // only touched on the strand
+
+    bool mCounted;
+    boost::asio::ip::address mPeer;
+    bool mPeerAcquired;
+
+    // access log data, only filled in for sampled requests
+    bool mLogged;
+    std::chrono::system_clock::time_point mStartTime;
+    Clock::time_point mAccepted;
+    Clock::time_point mRead;
+    Clock::time_point mHandled;
+    std::string mMethod;
+    std::string mUrl;
+    std::uint64_t mSent;
+
+    TracePtr mTrace;
+    Clock::time_point mTraceMark; // end of the last span
+
+    boost::mutex mMutex;
+};
+
+namespace {
+
+/// async_read_until match condition looking for the end of http header,
+/// reports every chunk of received data to the connection's idle deadline
+class HeaderEndMatcher
+{
+public:
+    explicit HeaderEndMatcher(Server::Connection *connection)
+        : mConnection(connection)
+    { }
+
+    template <typename Iterator>
+    std::pair<Iterator, bool> operator()(Iterator begin, Iterator end) const
+    {
+        mConnection->touch();
+
+        const char delim[] = "\r\n\r\n";
+        Iterator it = std::search(begin, end, delim, delim + 4);
+        if (it != end) {
+            std::advance(it, 4);
+            return std::make_pair(it, true);
+        }
+
+        // the delimiter may be split between this chunk and the next one
+        std::size_t size = std::distance(begin, end);
+        it = begin;
+        std::advance(it, size > 3 ? size - 3 : 0);
+        return std::make_pair(it, false);
+    }
+
+private:
+    Server::Connection *mConnection;
+};
+
+/// transfer_all completion condition reporting progress to the connection's idle deadline
+class TouchingTransferAll
+{
+public:
+    explicit TouchingTransferAll(Server::Connection *connection)
+        : mConnection(connection)
+    { }
+
+    std::size_t operator()(const boost::system::error_code &err, std::size_t) const
+    {
+        if (err) {
+            return 0;
+        }
+        mConnection->touch();
+        return 65536;
+    }
+
+private:
+    Server::Connection *mConnection;
+};
+
+} // namespace
+
+namespace boost {
+namespace asio {
+template <> struct is_match_condition<HeaderEndMatcher> : public boost::true_type { };
+} // namespace asio
+} // namespace boost
+
+
+bool Server::Response::spillBody(const std::string &dir)
+{
+    bodyFile = SpillFile::create(dir, body);
+    if (!bodyFile) {
+        return false;
+    }
+    std::string().swap(body);
+    return true;
+}
+
+void Server::Response::addServerTiming(const char *name, std::chrono::steady_clock::duration duration)
+{
+    const double ms = std::chrono::duration_cast<std::chrono::microseconds>(duration).count() / 1000.0;
+    char metric[64];
+    std::snprintf(metric, sizeof(metric), "%s;dur=%.1f", name, ms);
+
+    std::string &header = headers["Server-Timing"];
+    if (!header.empty()) {
+        header += ", ";
+    }
+    header += metric;
+}
+
+void Server::Response::addServerTiming(const char *name, const char *description)
+{
+    std::string &header = headers["Server-Timing"];
+    if (!header.empty()) {
+        header += ", ";
+    }
+    header.append(name).append(";desc=").append(description);
+}
+
 std::string Server::Response::getHttpCodeText() const
 {
     switch (httpCode) {
     case HttpCode_OK: return "OK";
+    case HttpCode_NotModified: return "Not Modified";
+    case HttpCode_BadRequest: return "Bad Request";
+    case HttpCode_RequestEntityTooLarge: return "Request Entity Too Large";
     case HttpCode_UnsupportedMediaType: return "Unsupported Media Type";
+    case HttpCode_RequestHeaderFieldsTooLarge: return "Request Header Fields Too Large";
     case HttpCode_RequestedHostUnavailable: return "Requested host unavailable";
     case HttpCode_NotImplemented: return "Not Implemented";
+    case HttpCode_ServiceUnavailable: return "Service Unavailable";
     case HttpCode_HTTPVersionNotSupported: return "HTTP Version Not Supported";
     }
 
@@ -27,6 +409,12 @@ std::ostream &operator <<(std::ostream &o, const Server::Response &res)
 
     if (res.httpCode == Server::Response::HttpCode_OK) {
         o << "Access-Control-Allow-Origin: " << "*" << "\r\n";
+        // event streams go out as head only and have no length
+        if (res.bodyFile) {
+            o << "Content-Length: " << res.bodyFile->getSize() << "\r\n";
+        } else if (!res.body.empty()) {
+            o << "Content-Length: " << res.body.size() << "\r\n";
+        }
         o << "\r\n" << res.body;
     } else {
         o << "\r\n";
@@ -35,8 +423,9 @@ std::ostream &operator <<(std::ostream &o, const Server::Response &res)
     return o;
 }
 
-Server::Request::Request(const Server::SocketPtr &socket)
-    : mSocket(socket)
+Server::Request::Request(const ConnectionPtr &connection, std::size_t maxHeaderSize)
+    : buf(maxHeaderSize),
+      mConnection(connection)
 { }
 
 void Server::Request::parse()
@@ -55,42 +444,134 @@ void Server::Request::parse()
     std::getline(ss, type, ' ');
     std::getline(ss, url, ' ');
     std::getline(ss, version, ' ');
+
+    while (std::getline(bufStream, line)) {
+        if (!line.empty()) {
+            line.replace(line.size() - 1, 1, "");
+        }
+        if (line.empty()) {
+            break;
+        }
+
+        auto delim = line.find_first_of(':');
+        if (delim == std::string::npos) {
+            continue;
+        }
+
+        auto valueBegin = line.find_first_not_of(' ', delim + 1);
+        headers[line.substr(0, delim)] = valueBegin == std::string::npos ? "" : line.substr(valueBegin);
+    }
+}
+
+std::size_t Server::Request::getContentLength() const
+{
+    auto it = headers.find("Content-Length");
+    if (it == headers.end()) {
+        return 0;
+    }
+
+    std::stringstream ss(it->second);
+    std::size_t length = 0;
+    ss >> length;
+    return length;
+}
+
+std::string Server::Request::getHeader(const std::string &name) const
+{
+    for (auto it = headers.begin(); it != headers.end(); it++) {
+        if (it->first.size() == name.size() && strncasecmp(it->first.c_str(), name.c_str(), name.size()) == 0) {
+            return it->second;
+        }
+    }
+    return std::string();
 }
 
-Server::Server(std::shared_ptr<ServerConfig> config, boost::asio::io_service &ioService)
+Server::Server(std::shared_ptr<ConfigStore> config, boost::asio::io_service &ioService)
     : mConfig(config),
-      mIOService(ioService)
+      mThreadCount(0),
+      mIOService(ioService),
+      mConnectionCount(0),
+      mShedConnections(0),
+      mAccessLog(nullptr),
+      mTracer(nullptr)
 {
-    config->print();
+    const ServerConfigPtr conf = config->get();
+    conf->print();
 
-    boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(), config->getPort());
+    boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(), conf->getPort());
 
     mAcceptor.reset(new boost::asio::ip::tcp::acceptor(mIOService));
     mAcceptor->open(endpoint.protocol());
+    // accepted sockets inherit it, so it isn't set once per connection
+    mAcceptor->set_option(boost::asio::ip::tcp::no_delay(true));
     mAcceptor->bind(endpoint);
     mAcceptor->listen();
 
     accept();
 
-    mThreadGroup.reset(new boost::thread_group);
-    for (int i = 0; i < config->getThreadCount(); i++) {
-        mThreadGroup->create_thread([this]() {
-            mIOService.run();
+    setThreadCount(conf->getThreadCount());
+}
+
+void Server::setThreadCount(unsigned count)
+{
+    boost::lock_guard<boost::mutex> g(mThreadMutex);
+
+    for (; mThreadCount < count; mThreadCount++) {
+        mThreads.emplace_back(new boost::thread([this]() {
+            runWorker();
+        }));
+    }
+
+    // whichever threads pick these up leave, the rest keep serving
+    for (; mThreadCount > count; mThreadCount--) {
+        mIOService.post([]() {
+            throw RetireWorker();
         });
     }
 }
 
+void Server::runWorker()
+{
+    try {
+        mIOService.run();
+    } catch (const RetireWorker &) {
+        // nobody is going to join a retired thread, unless join() took it already
+        boost::lock_guard<boost::mutex> g(mThreadMutex);
+        for (auto it = mThreads.begin(); it != mThreads.end(); it++) {
+            if ((*it)->get_id() == boost::this_thread::get_id()) {
+                (*it)->detach();
+                mThreads.erase(it);
+                break;
+            }
+        }
+    }
+}
+
 void Server::accept()
 {
-    std::shared_ptr<boost::asio::ip::tcp::socket> socket(new boost::asio::ip::tcp::socket(mIOService));
-    mAcceptor->async_accept(*socket, [this, socket](const boost::system::error_code &err) {
+    ConnectionPtr connection = std::make_shared<Connection>(*this, mIOService, mConfig->get()->getIdleTimeout());
+    mAcceptor->async_accept(*connection->socket, connection->peerEndpoint, [this, connection](const boost::system::error_code &err) {
         accept();
 
-        if (!err) {
-            socket->set_option(boost::asio::ip::tcp::no_delay(true));
-
-            readDataFromSocket(socket);
+        if (err) {
+            return;
         }
+
+        connection->strand.dispatch([this, connection]() {
+            if (!connection->admit()) {
+                shed(connection);
+                return;
+            }
+
+            if (!connection->acquirePeer()) {
+                // too many connections from this address
+                connection->close();
+                return;
+            }
+
+            connection->startLog();
+            readDataFromSocket(connection);
+        });
     });
 }
 
@@ -100,29 +581,69 @@ void Server::setHandlerFunc(HandlerFunc handler)
     mHandler = handler;
 }
 
-void Server::readDataFromSocket(const SocketPtr &socket)
-{/*
-    // set request exp timeout
-    std::shared_ptr<boost::asio::deadline_timer> timer(new boost::asio::deadline_timer(mIOService));
-    timer->expires_from_now(boost::posix_time::milliseconds(mConfig->getRequestTimeout()));
-    timer->async_wait([socket](const boost::system::error_code &err) {
-        if (!err) {
-            Response res;
-            res.httpCode = Response::HttpCode_RequestedHostUnavailable;
-            std::ostream o(&res.buf);
-            o << res;
-            boost::asio::write(*socket, res.buf);
-            boost::system::error_code ec;
-            socket->lowest_layer().shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
-            socket->lowest_layer().close();
-        }
-    });*/
+void Server::shed(const ConnectionPtr &connection)
+{
+    mShedConnections++;
+
+    static const std::string response = []() {
+        Response res;
+        res.httpCode = Response::HttpCode_ServiceUnavailable;
+        res.headers["Retry-After"] = "1";
+        std::ostringstream o;
+        o << res;
+        return o.str();
+    }();
+
+    // best effort, the connection goes away right after the write
+    connection->startPhase(0, true);
+    boost::asio::async_write(*connection->socket, boost::asio::buffer(response),
+                             connection->strand.wrap([connection](const boost::system::error_code &, std::size_t) {}));
+}
+
+bool Server::acquirePeer(const boost::asio::ip::address &address)
+{
+    const unsigned limit = mConfig->get()->getMaxConnectionsPerIp();
+
+    LockGuard g(mPeersMutex);
+    unsigned &count = mPeers[address];
+    if (limit > 0 && count >= limit) {
+        if (count == 0) {
+            mPeers.erase(address);
+        }
+        return false;
+    }
+    count++;
+    return true;
+}
+
+void Server::releasePeer(const boost::asio::ip::address &address)
+{
+    LockGuard g(mPeersMutex);
+    auto it = mPeers.find(address);
+    if (it != mPeers.end() && --it->second == 0) {
+        mPeers.erase(it);
+    }
+}
+
+void Server::readDataFromSocket(const ConnectionPtr &connection)
+{
+    // whole header has to arrive within header timeout, a stalled client is dropped even earlier
+    connection->startPhase(mConfig->get()->getHeaderTimeout(), true);
 
     // read header data
-    RequestPtr req(new Request(socket));
-    boost::asio::async_read_until(*socket, req->buf, "\r\n\r\n",
-    [socket, req, /*timer,*/ this](const boost::system::error_code &err, size_t) {
-//        timer->cancel();
+    RequestPtr req(new Request(connection, mConfig->get()->getMaxHeaderSize()));
+    Tracer *tracer = mTracer.load(std::memory_order_acquire);
+    if (tracer) {
+        req->trace = tracer->start();
+    }
+    boost::asio::async_read_until(*connection->socket, req->buf, HeaderEndMatcher(connection.get()), connection->strand.wrap(
+    [connection, req, this](const boost::system::error_code &err, size_t) {
+        if (err == boost::asio::error::not_found) {
+            ResponsePtr res(new Response);
+            res->httpCode = Response::HttpCode_RequestHeaderFieldsTooLarge;
+            writeResponse(connection, res);
+            return;
+        }
 
         if (err) {
             return;
@@ -130,25 +651,288 @@ void Server::readDataFromSocket(const SocketPtr &socket)
 
         req->parse();
 
+        if (req->getContentLength() > 0) {
+            readBody(connection, req);
+        } else {
+            handleRequest(connection, req);
+        }
+    }));
+}
+
+void Server::readBody(const ConnectionPtr &connection, const RequestPtr &req)
+{
+    const std::size_t length = req->getContentLength();
+    if (length > MAX_REQUEST_BODY_SIZE) {
         ResponsePtr res(new Response);
+        res->httpCode = Response::HttpCode_RequestEntityTooLarge;
+        writeResponse(connection, res);
+        return;
+    }
+
+    // part of the body may have been read along with the header
+    const std::size_t buffered = std::min(req->buf.size(), length);
+    req->body.resize(length);
+    boost::asio::buffer_copy(boost::asio::buffer(&req->body[0], buffered), req->buf.data());
+    req->buf.consume(req->buf.size());
+
+    boost::asio::async_read(*connection->socket, boost::asio::buffer(&req->body[buffered], length - buffered),
+                            TouchingTransferAll(connection.get()), connection->strand.wrap(
+    [connection, req, this](const boost::system::error_code &err, size_t) {
+        if (err) {
+            return;
+        }
+
+        handleRequest(connection, req);
+    }));
+}
+
+void Server::handleRequest(const ConnectionPtr &connection, const RequestPtr &req)
+{
+    // handlers answer within their own upstream timeouts
+    connection->disarm();
+    connection->traceRequest(*req);
+    connection->logRequest(*req);
+
+    ResponsePtr res(new Response);
+
+    LockGuard g(mHandlerMutex);
+    if (mHandler) {
+        mHandler(req, res, [connection](const ResponsePtr &res) {
+            writeResponse(connection, res);
+        });
+    }
+}
+
+void Server::writeResponse(const ConnectionPtr &connection, const ResponsePtr &res)
+{
+    // handlers answer from whatever thread they finish on
+    connection->strand.dispatch([connection, res]() {
+        doWriteResponse(connection, res);
+    });
+}
+
+void Server::doWriteResponse(const ConnectionPtr &connection, const ResponsePtr &res)
+{
+    if (res->httpCode == 0) {
+        res->httpCode = (uint)Server::Response::HttpCode_OK;
+    }
+
+    connection->logHandled();
+    connection->traceStep("handle");
+
+    std::ostream o(&res->buf);
+    o << *res;
+
+    // a client reading the response too slowly is dropped on idle timeout
+    connection->startPhase(0, true);
+
+    boost::asio::async_write(*connection->socket, res->buf, TouchingTransferAll(connection.get()), connection->strand.wrap(
+                             [connection, res](const boost::system::error_code &err, std::size_t bytes) {
+        connection->addSent(bytes);
+        if (!err && res->bodyFile && res->httpCode == Response::HttpCode_OK) {
+            sendBodyFile(connection, res, 0);
+        } else {
+            connection->finishResponse(*res);
+        }
+    }));
+}
+
+void Server::sendBodyFile(const ConnectionPtr &connection, const ResponsePtr &res, std::size_t offset)
+{
+    boost::asio::ip::tcp::socket &socket = *connection->socket;
+    const std::size_t size = res->bodyFile->getSize();
 
-        LockGuard g(mHandlerMutex);
-        if (mHandler) {
-            mHandler(req, res, [socket](const ResponsePtr &res) {
-                if (res->httpCode == 0) {
-                    res->httpCode = (uint)Server::Response::HttpCode_OK;
-                }
+    // the head went out with async_write, which left the socket non-blocking
+    for (;;) {
+        if (connection->isClosed()) {
+            // timed out while waiting for the socket
+            connection->finishResponse(*res);
+            return;
+        }
 
-                std::ostream o(&res->buf);
-                o << *res;
+        off_t pos = offset;
+        const ssize_t n = ::sendfile(socket.native_handle(), res->bodyFile->getFd(), &pos,
+                                     std::min<std::size_t>(size - offset, SENDFILE_CHUNK_SIZE));
+        if (n > 0) {
+            offset += n;
+            connection->touch();
+            connection->addSent(n);
+            if (offset >= size) {
+                connection->finishResponse(*res);
+                return;
+            }
+            break;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            // the peer is gone or the file got shorter, the connection closes
+            // with the last reference to it
+            connection->finishResponse(*res);
+            return;
+        }
+        break;
+    }
 
-                boost::asio::async_write(*socket, res->buf, [socket, res](const boost::system::error_code &, std::size_t) {});
-            });
+    // also after a full chunk, so other handlers get the thread in between
+    socket.async_wait(boost::asio::ip::tcp::socket::wait_write, connection->strand.wrap(
+                      [connection, res, offset](const boost::system::error_code &err) {
+        if (err) {
+            connection->finishResponse(*res);
+        } else {
+            sendBodyFile(connection, res, offset);
+        }
+    }));
+}
+
+Server::StreamPtr Server::openStream(const RequestPtr &req, const ResponsePtr &head, std::size_t maxQueueSize)
+{
+    req->mConnection->disarm();
+
+    StreamPtr stream(new Stream(req->mConnection, maxQueueSize));
+
+    if (head->httpCode == 0) {
+        head->httpCode = (uint)Server::Response::HttpCode_OK;
+    }
+
+    std::ostringstream o;
+    o << *head;
+    stream->send(o.str());
+    stream->watchPeer();
+
+    return stream;
+}
+
+Server::Stream::Stream(const ConnectionPtr &connection, std::size_t maxQueueSize)
+    : mConnection(connection),
+      mSocket(connection->socket),
+      // the connection's own, its timer may still close the socket
+      mStrand(connection->strand),
+      mMaxQueueSize(maxQueueSize),
+      mWriting(false),
+      mClosed(false)
+{ }
+
+void Server::Stream::send(const std::string &data)
+{
+    send(std::make_shared<const std::string>(data));
+}
+
+void Server::Stream::send(const DataPtr &data)
+{
+    auto thisPtr = shared_from_this();
+    mStrand.dispatch([thisPtr, data]() {
+        if (thisPtr->mClosed) {
+            return;
+        }
+
+        if (thisPtr->mQueue.size() >= thisPtr->mMaxQueueSize) {
+            // slow consumer
+            thisPtr->doClose();
+            return;
+        }
+
+        thisPtr->mQueue.push_back(data);
+        if (!thisPtr->mWriting) {
+            thisPtr->writeNext();
         }
     });
 }
 
+void Server::Stream::close()
+{
+    auto thisPtr = shared_from_this();
+    mStrand.dispatch([thisPtr]() {
+        thisPtr->doClose();
+    });
+}
+
+void Server::Stream::setCloseHandler(CloseHandler handler)
+{
+    auto thisPtr = shared_from_this();
+    mStrand.dispatch([thisPtr, handler]() {
+        if (thisPtr->mClosed) {
+            handler();
+        } else {
+            thisPtr->mCloseHandler = handler;
+        }
+    });
+}
+
+void Server::Stream::watchPeer()
+{
+    // clients never send anything over an event stream, so any read completion
+    // means either garbage or a closed connection
+    auto thisPtr = shared_from_this();
+    mStrand.dispatch([thisPtr]() {
+        thisPtr->mSocket->async_read_some(boost::asio::buffer(thisPtr->mReadBuf), thisPtr->mStrand.wrap(
+        [thisPtr](const boost::system::error_code &err, std::size_t) {
+            if (err) {
+                thisPtr->doClose();
+            } else if (!thisPtr->mClosed) {
+                thisPtr->watchPeer();
+            }
+        }));
+    });
+}
+
+void Server::Stream::writeNext()
+{
+    if (mQueue.empty()) {
+        mWriting = false;
+        return;
+    }
+    mWriting = true;
+
+    // data is kept alive by the handler even if the queue gets cleared on close
+    auto thisPtr = shared_from_this();
+    DataPtr data = mQueue.front();
+    boost::asio::async_write(*mSocket, boost::asio::buffer(*data), mStrand.wrap(
+    [thisPtr, data](const boost::system::error_code &err, std::size_t) {
+        if (thisPtr->mClosed) {
+            return;
+        }
+
+        if (err) {
+            thisPtr->doClose();
+            return;
+        }
+
+        thisPtr->mQueue.pop_front();
+        thisPtr->writeNext();
+    }));
+}
+
+void Server::Stream::doClose()
+{
+    if (mClosed) {
+        return;
+    }
+    mClosed = true;
+    mQueue.clear();
+
+    mConnection->close();
+
+    if (mCloseHandler) {
+        CloseHandler handler;
+        handler.swap(mCloseHandler);
+        handler();
+    }
+}
+
 void Server::join()
 {
-    mThreadGroup->join_all();
+    for (;;) {
+        std::unique_ptr<boost::thread> thread;
+        {
+            boost::lock_guard<boost::mutex> g(mThreadMutex);
+            if (mThreads.empty()) {
+                return;
+            }
+            thread = std::move(mThreads.back());
+            mThreads.pop_back();
+        }
+        thread->join();
+    }
 }
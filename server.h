@@ -1,23 +1,47 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
 #include <memory>
 #include <functional>
+#include <string>
+#include <vector>
 
 #include <boost/asio.hpp>
 #include <boost/thread.hpp>
 
-class ServerConfig;
+#include "accesslog.h"
+#include "spillfile.h"
+#include "tracer.h"
+
+class ConfigStore;
 
 class Server
 {
 public:
-    Server(std::shared_ptr<ServerConfig> config, boost::asio::io_service &ioService);
+    /// settings are read from the store's current config as they are needed,
+    /// so a reloaded config applies to the next connection or request
+    Server(std::shared_ptr<ConfigStore> config, boost::asio::io_service &ioService);
 
     void join();
     void accept();
 
+    /// grows or shrinks the pool of threads running the io_service; a
+    /// retiring thread finishes the handler it is in first
+    void setThreadCount(unsigned count);
+    unsigned getThreadCount() const { return mThreadCount; }
+
+    unsigned getConnectionCount() const { return mConnectionCount; }
+    std::uint64_t getShedConnectionCount() const { return mShedConnections; }
+
     typedef std::shared_ptr<boost::asio::ip::tcp::socket> SocketPtr;
 
+    /// accepted client socket along with its deadline timer
+    struct Connection;
+    typedef std::shared_ptr<Connection> ConnectionPtr;
+
     struct Request {
         friend class Server;
 
@@ -25,53 +49,157 @@ public:
         std::string url;
         std::string version;
 
+        std::map<std::string, std::string> headers;
+        std::string body;
+
+        /// null unless the request is sampled for tracing
+        TracePtr trace;
+
+        Request(const ConnectionPtr &connection, std::size_t maxHeaderSize);
+
+        /// parses request line and headers from buf
         void parse();
+        std::size_t getContentLength() const;
+        /// value of header name matched case-insensitively, empty if missing
+        std::string getHeader(const std::string &name) const;
 
         mutable boost::asio::streambuf buf;
 
     private:
-        Request(const SocketPtr &ptr);
-        const SocketPtr mSocket;
+        const ConnectionPtr mConnection;
     };
     typedef std::shared_ptr<Request> RequestPtr;
 
     struct Response {
         Response()
-            : httpCode(0)
+            : httpCode(0),
+              cache(nullptr)
         { }
 
         enum HttpCode : uint {
             HttpCode_OK  = 200,
+            HttpCode_NotModified = 304,
+            HttpCode_BadRequest = 400,
+            HttpCode_RequestEntityTooLarge = 413,
             HttpCode_UnsupportedMediaType = 415,
+            HttpCode_RequestHeaderFieldsTooLarge = 431,
             HttpCode_RequestedHostUnavailable = 434,
             HttpCode_NotImplemented = 501,
+            HttpCode_ServiceUnavailable = 503,
             HttpCode_HTTPVersionNotSupported = 505,
         };
 
         uint httpCode;
         std::string body;
+        /// sent instead of body when set, see spillBody()
+        SpillFilePtr bodyFile;
+        /// static string the access log shows as cache state, e.g. "hit"
+        const char *cache;
 
         std::map<std::string, std::string> headers;
 
         std::string getHttpCodeText() const;
 
+        /// appends a metric to the Server-Timing header, e.g. "upstream;dur=12.5"
+        void addServerTiming(const char *name, std::chrono::steady_clock::duration duration);
+        /// same with a description instead of a duration, e.g. "cache;desc=hit"
+        void addServerTiming(const char *name, const char *description);
+
+        /// moves body to a file in dir, which goes out with sendfile; body
+        /// stays in memory if the file can't be written. Blocks on disk,
+        /// so it's not for io threads
+        bool spillBody(const std::string &dir);
+
         boost::asio::streambuf buf;        
     };
     typedef std::shared_ptr<Response> ResponsePtr;
 
+    /// Long-lived connection pushing data to the client (server-sent events).
+    /// Writes are queued and serialized on the connection's strand, a client that
+    /// doesn't drain its queue in time gets disconnected.
+    class Stream : public std::enable_shared_from_this<Stream>
+    {
+        friend class Server;
+
+    public:
+        typedef std::shared_ptr<const std::string> DataPtr;
+
+        void send(const std::string &data);
+        void send(const DataPtr &data);
+        void close();
+
+        typedef std::function<void()> CloseHandler;
+        /// handler is called once the stream is closed by either side
+        void setCloseHandler(CloseHandler handler);
+
+    private:
+        Stream(const ConnectionPtr &connection, std::size_t maxQueueSize);
+
+        void watchPeer();
+        void writeNext();
+        void doClose();
+
+        const ConnectionPtr mConnection;
+        const SocketPtr mSocket;
+        boost::asio::io_service::strand mStrand;
+        std::deque<DataPtr> mQueue;
+        const std::size_t mMaxQueueSize;
+        bool mWriting;
+        bool mClosed;
+        CloseHandler mCloseHandler;
+        char mReadBuf[512];
+    };
+    typedef std::shared_ptr<Stream> StreamPtr;
+
+    /// sends response head (code and headers) to the client and keeps
+    /// the connection open for pushing data
+    StreamPtr openStream(const RequestPtr &req, const ResponsePtr &head, std::size_t maxQueueSize);
+
     typedef std::function<void(const ResponsePtr &res)> ResponseCallback;
     typedef std::function<void(const RequestPtr &req, ResponsePtr &res, ResponseCallback callback)> HandlerFunc;
     void setHandlerFunc(HandlerFunc handler);
 
-private:
-    void readDataFromSocket(const SocketPtr &socket);
+    /// sampled requests are logged there once answered, log has to outlive the server
+    void setAccessLog(AccessLog *log) { mAccessLog = log; }
+    /// requests are traced from the first byte read, tracer has to outlive the server
+    void setTracer(Tracer *tracer) { mTracer = tracer; }
 
-    std::shared_ptr<ServerConfig> mConfig;
-    std::unique_ptr<boost::thread_group> mThreadGroup;
+private:
+    void readDataFromSocket(const ConnectionPtr &connection);
+    void readBody(const ConnectionPtr &connection, const RequestPtr &req);
+    void handleRequest(const ConnectionPtr &connection, const RequestPtr &req);
+    static void writeResponse(const ConnectionPtr &connection, const ResponsePtr &res);
+    static void doWriteResponse(const ConnectionPtr &connection, const ResponsePtr &res);
+    /// sends res->bodyFile from offset on, waiting for the socket whenever it's full;
+    /// runs on the connection's strand and stops once the connection is closed
+    static void sendBodyFile(const ConnectionPtr &connection, const ResponsePtr &res, std::size_t offset);
+
+    bool acquirePeer(const boost::asio::ip::address &address);
+    void releasePeer(const boost::asio::ip::address &address);
+
+    void shed(const ConnectionPtr &connection);
+
+    void runWorker();
+
+    std::shared_ptr<ConfigStore> mConfig;
+    // unlike a thread_group this can grow while join() waits on it
+    std::vector<std::unique_ptr<boost::thread>> mThreads;
+    std::atomic<unsigned> mThreadCount;
+    boost::mutex mThreadMutex;
     std::shared_ptr<boost::asio::ip::tcp::acceptor> mAcceptor;
 
     boost::asio::io_service &mIOService;
 
+    std::atomic<unsigned> mConnectionCount;
+    std::atomic<std::uint64_t> mShedConnections;
+
+    // count of open connections per client address
+    std::map<boost::asio::ip::address, unsigned> mPeers;
+    boost::mutex mPeersMutex;
+
+    std::atomic<AccessLog *> mAccessLog;
+    std::atomic<Tracer *> mTracer;
+
     HandlerFunc mHandler;
     boost::mutex mHandlerMutex;
     typedef boost::lock_guard<boost::mutex> LockGuard;
@@ -5,16 +5,90 @@
 
 #include "rapidjson/document.h"
 
-ServerConfig::ServerConfig(int argc, char *argv[])
+namespace {
+
+// ids start at 1, a thread's cache with store 0 holds nothing yet
+std::atomic<std::uint64_t> nextStoreId(1);
+
+bool loadOptionalUint(const rapidjson::Document &d, const char *name, unsigned &value)
+{
+    if (!d.HasMember(name)) {
+        return true;
+    }
+    if (!d[name].IsUint()) {
+        std::cerr << "json field '" << name << "' must be uint" << std::endl;
+        return false;
+    }
+    value = d[name].GetUint();
+    return true;
+}
+
+bool loadOptionalString(const rapidjson::Document &d, const char *name, std::string &value)
+{
+    if (!d.HasMember(name)) {
+        return true;
+    }
+    if (!d[name].IsString()) {
+        std::cerr << "json field '" << name << "' must be string" << std::endl;
+        return false;
+    }
+    value = d[name].GetString();
+    return true;
+}
+
+bool loadOptionalBool(const rapidjson::Document &d, const char *name, bool &value)
+{
+    if (!d.HasMember(name)) {
+        return true;
+    }
+    if (!d[name].IsBool()) {
+        std::cerr << "json field '" << name << "' must be bool" << std::endl;
+        return false;
+    }
+    value = d[name].GetBool();
+    return true;
+}
+
+} // namespace
+
+ServerConfig::ServerConfig()
     : mPort(8080),
       mThreadCount(1),
       mRequestTimeout(1000),
+      mStreamInterval(30000),
+      mStreamQueueSize(64),
+      mHeaderTimeout(10000),
+      mIdleTimeout(5000),
+      mMaxHeaderSize(8192),
+      mMaxConnectionsPerIp(256),
+      mMaxConnections(10000),
+      mMaxUpstreamFetches(512),
+      mMaxUpstreamFetchesPerHost(32),
+      mMaxBufferedBytes(256 * 1024 * 1024),
+      mQueueTimeout(500),
+      mHedgeBudget(0),
+      mBreakerThreshold(50),
+      mBreakerCooldown(5000),
+      mMaxUpstreamTimeout(3000),
+      mMinUpstreamTimeout(0),
+      mComputeThreads(0),
+      mSpillThreshold(1024 * 1024),
+      mFeedCacheSize(1024),
+      mFeedCacheBytes(64 * 1024 * 1024),
+      mAccessLogSampling(1),
+      mTraceSampling(1000),
+      mTraceFileSize(64 * 1024 * 1024),
+      mServerTiming(false),
       mShowHelp(false),
       mOk(true)
+{ }
+
+ServerConfig::ServerConfig(int argc, char *argv[])
+    : ServerConfig()
 {
     using namespace boost::program_options;
 
-    mDesc = new options_description("Allowed options");
+    mDesc = std::make_shared<options_description>("Allowed options");
     mDesc->add_options()
             ("help", "produce help message")
             ("port", value<int>(), "server port")
@@ -22,7 +96,8 @@ ServerConfig::ServerConfig(int argc, char *argv[])
             ("timeout", value<int>(), "remote host timeout")
             ("config", value<std::string>(), "config file path");
 
-    variables_map vars;
+    mCmdLine = std::make_shared<variables_map>();
+    variables_map &vars = *mCmdLine;
 
     try {
         store(parse_command_line(argc, argv, *mDesc), vars);
@@ -46,11 +121,96 @@ ServerConfig::ServerConfig(int argc, char *argv[])
     }
 
     applyCmdLineOptions(vars);
+    mOk = validate();
 }
 
 ServerConfig::~ServerConfig()
+{ }
+
+std::shared_ptr<ServerConfig> ServerConfig::reload() const
 {
-    delete mDesc;
+    // starts from defaults, so fields dropped from the file get them back
+    std::shared_ptr<ServerConfig> config(new ServerConfig());
+    config->mDesc = mDesc;
+    config->mCmdLine = mCmdLine;
+    config->mConfigFilePath = mConfigFilePath;
+
+    if (!config->loadConfigFile(mConfigFilePath)) {
+        return nullptr;
+    }
+    config->applyCmdLineOptions(*mCmdLine);
+    if (!config->validate()) {
+        return nullptr;
+    }
+    return config;
+}
+
+bool ServerConfig::validate() const
+{
+    if (mPort == 0 || mPort > 65535) {
+        std::cerr << "port must be within 1..65535" << std::endl;
+        return false;
+    }
+    if (mThreadCount == 0) {
+        std::cerr << "threads must be positive" << std::endl;
+        return false;
+    }
+    if (mAccessLogSampling == 0) {
+        std::cerr << "accessLogSampling must be positive, 1 logs every request" << std::endl;
+        return false;
+    }
+    if (mTraceSampling == 0) {
+        std::cerr << "traceSampling must be positive, 1 traces every request" << std::endl;
+        return false;
+    }
+    if (mBreakerThreshold > 100) {
+        std::cerr << "breakerThreshold is a percentage, 0..100" << std::endl;
+        return false;
+    }
+    if (mMaxHeaderSize == 0) {
+        std::cerr << "maxHeaderSize must be positive" << std::endl;
+        return false;
+    }
+    if (mStreamQueueSize == 0) {
+        std::cerr << "streamQueueSize must be positive" << std::endl;
+        return false;
+    }
+    if (mMaxUpstreamTimeout > 0 && mMinUpstreamTimeout > mMaxUpstreamTimeout) {
+        std::cerr << "minUpstreamTimeout must not exceed maxUpstreamTimeout" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+ConfigStore::ConfigStore(const ServerConfigPtr &config)
+    : mId(nextStoreId++),
+      mCurrent(config),
+      mGeneration(0)
+{ }
+
+ServerConfigPtr ConfigStore::get() const
+{
+    struct Cached {
+        std::uint64_t store;
+        std::uint64_t generation;
+        ServerConfigPtr config;
+    };
+    static thread_local Cached cached = Cached();
+
+    if (cached.store != mId || cached.generation != mGeneration.load(std::memory_order_acquire)) {
+        LockGuard g(mMutex);
+        cached.store = mId;
+        cached.generation = mGeneration.load(std::memory_order_relaxed);
+        cached.config = mCurrent;
+    }
+    return cached.config;
+}
+
+void ConfigStore::set(const ServerConfigPtr &config)
+{
+    LockGuard g(mMutex);
+    mCurrent = config;
+    mGeneration.fetch_add(1, std::memory_order_release);
 }
 
 void ServerConfig::showHelp() const
@@ -63,7 +223,35 @@ void ServerConfig::print() const
 {
     std::cout << "port:\t\t" << mPort << std::endl
               << "threads:\t" << mThreadCount << std::endl
-              << "timeout:\t" << mRequestTimeout << std::endl;
+              << "timeout:\t" << mRequestTimeout << std::endl
+              << "streamInterval:\t" << mStreamInterval << std::endl
+              << "streamQueueSize:\t" << mStreamQueueSize << std::endl
+              << "headerTimeout:\t" << mHeaderTimeout << std::endl
+              << "idleTimeout:\t" << mIdleTimeout << std::endl
+              << "maxHeaderSize:\t" << mMaxHeaderSize << std::endl
+              << "maxConnectionsPerIp:\t" << mMaxConnectionsPerIp << std::endl
+              << "maxConnections:\t" << mMaxConnections << std::endl
+              << "maxUpstreamFetches:\t" << mMaxUpstreamFetches << std::endl
+              << "maxUpstreamFetchesPerHost:\t" << mMaxUpstreamFetchesPerHost << std::endl
+              << "maxBufferedBytes:\t" << mMaxBufferedBytes << std::endl
+              << "queueTimeout:\t" << mQueueTimeout << std::endl
+              << "hedgeBudget:\t" << mHedgeBudget << std::endl
+              << "breakerThreshold:\t" << mBreakerThreshold << std::endl
+              << "breakerCooldown:\t" << mBreakerCooldown << std::endl
+              << "maxUpstreamTimeout:\t" << mMaxUpstreamTimeout << std::endl
+              << "minUpstreamTimeout:\t" << mMinUpstreamTimeout << std::endl
+              << "computeThreads:\t" << mComputeThreads << std::endl
+              << "spillThreshold:\t" << mSpillThreshold << std::endl
+              << "feedCacheSize:\t" << mFeedCacheSize << std::endl
+              << "feedCacheBytes:\t" << mFeedCacheBytes << std::endl
+              << "spillDir:\t" << (mSpillDir.empty() ? "(off)" : mSpillDir) << std::endl
+              << "accessLog:\t" << (mAccessLog.empty() ? "(off)" : mAccessLog) << std::endl
+              << "accessLogSampling:\t" << mAccessLogSampling << std::endl
+              << "traceFile:\t" << (mTraceFile.empty() ? "(off)" : mTraceFile) << std::endl
+              << "traceSampling:\t" << mTraceSampling << std::endl
+              << "traceFileSize:\t" << mTraceFileSize << std::endl
+              << "serverTiming:\t" << (mServerTiming ? "on" : "off") << std::endl
+              << "caFile:\t" << (mCaFile.empty() ? "(system)" : mCaFile) << std::endl;
 }
 
 bool ServerConfig::loadConfigFile(const std::string &path)
@@ -116,6 +304,37 @@ bool ServerConfig::loadConfigFile(const std::string &path)
         }
         mRequestTimeout = d["timeout"].GetUint();
 
+        if (!loadOptionalUint(d, "streamInterval", mStreamInterval) ||
+            !loadOptionalUint(d, "streamQueueSize", mStreamQueueSize) ||
+            !loadOptionalUint(d, "headerTimeout", mHeaderTimeout) ||
+            !loadOptionalUint(d, "idleTimeout", mIdleTimeout) ||
+            !loadOptionalUint(d, "maxHeaderSize", mMaxHeaderSize) ||
+            !loadOptionalUint(d, "maxConnectionsPerIp", mMaxConnectionsPerIp) ||
+            !loadOptionalUint(d, "maxConnections", mMaxConnections) ||
+            !loadOptionalUint(d, "maxUpstreamFetches", mMaxUpstreamFetches) ||
+            !loadOptionalUint(d, "maxUpstreamFetchesPerHost", mMaxUpstreamFetchesPerHost) ||
+            !loadOptionalUint(d, "maxBufferedBytes", mMaxBufferedBytes) ||
+            !loadOptionalUint(d, "queueTimeout", mQueueTimeout) ||
+            !loadOptionalUint(d, "hedgeBudget", mHedgeBudget) ||
+            !loadOptionalUint(d, "breakerThreshold", mBreakerThreshold) ||
+            !loadOptionalUint(d, "breakerCooldown", mBreakerCooldown) ||
+            !loadOptionalUint(d, "maxUpstreamTimeout", mMaxUpstreamTimeout) ||
+            !loadOptionalUint(d, "minUpstreamTimeout", mMinUpstreamTimeout) ||
+            !loadOptionalUint(d, "computeThreads", mComputeThreads) ||
+            !loadOptionalUint(d, "spillThreshold", mSpillThreshold) ||
+            !loadOptionalUint(d, "feedCacheSize", mFeedCacheSize) ||
+            !loadOptionalUint(d, "feedCacheBytes", mFeedCacheBytes) ||
+            !loadOptionalString(d, "spillDir", mSpillDir) ||
+            !loadOptionalString(d, "accessLog", mAccessLog) ||
+            !loadOptionalUint(d, "accessLogSampling", mAccessLogSampling) ||
+            !loadOptionalString(d, "traceFile", mTraceFile) ||
+            !loadOptionalUint(d, "traceSampling", mTraceSampling) ||
+            !loadOptionalUint(d, "traceFileSize", mTraceFileSize) ||
+            !loadOptionalBool(d, "serverTiming", mServerTiming) ||
+            !loadOptionalString(d, "caFile", mCaFile)) {
+            return false;
+        }
+
         return true;
     }
     return false;
@@ -1,7 +1,12 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+#include <memory>
 #include <string>
 
+#include <boost/thread.hpp>
+
 namespace boost {
     namespace program_options {
         class options_description;
@@ -15,9 +20,52 @@ public:
     ServerConfig(int argc, char *argv[]);
     ~ServerConfig();
 
+    /// config file read again into a new config, command line options
+    /// still take precedence; null if the file is not valid
+    std::shared_ptr<ServerConfig> reload() const;
+
     unsigned getPort() const { return mPort; }
     unsigned getThreadCount() const { return mThreadCount; }
     unsigned getRequestTimeout() const { return mRequestTimeout; }
+    unsigned getStreamInterval() const { return mStreamInterval; }
+    unsigned getStreamQueueSize() const { return mStreamQueueSize; }
+    unsigned getHeaderTimeout() const { return mHeaderTimeout; }
+    unsigned getIdleTimeout() const { return mIdleTimeout; }
+    unsigned getMaxHeaderSize() const { return mMaxHeaderSize; }
+    unsigned getMaxConnectionsPerIp() const { return mMaxConnectionsPerIp; }
+    unsigned getMaxConnections() const { return mMaxConnections; }
+    unsigned getMaxUpstreamFetches() const { return mMaxUpstreamFetches; }
+    unsigned getMaxUpstreamFetchesPerHost() const { return mMaxUpstreamFetchesPerHost; }
+    unsigned getMaxBufferedBytes() const { return mMaxBufferedBytes; }
+    unsigned getQueueTimeout() const { return mQueueTimeout; }
+    unsigned getHedgeBudget() const { return mHedgeBudget; }
+    unsigned getBreakerThreshold() const { return mBreakerThreshold; }
+    unsigned getBreakerCooldown() const { return mBreakerCooldown; }
+    /// ceiling of the per-host first byte timeout, 4x the host's p99; 0 turns
+    /// adaptive timeouts off
+    unsigned getMaxUpstreamTimeout() const { return mMaxUpstreamTimeout; }
+    /// floor of the per-host first byte timeout. With the default 0 it never
+    /// goes below the request timeout, so adaptive timeouts only lengthen it
+    /// for slow hosts; set this to let fast hosts fail sooner
+    unsigned getMinUpstreamTimeout() const { return mMinUpstreamTimeout; }
+    unsigned getComputeThreads() const { return mComputeThreads; }
+    unsigned getSpillThreshold() const { return mSpillThreshold; }
+    /// feeds whose last conversion is kept, 0 disables the cache
+    unsigned getFeedCacheSize() const { return mFeedCacheSize; }
+    /// memory the cached conversions may take, 0 for no limit but feedCacheSize
+    unsigned getFeedCacheBytes() const { return mFeedCacheBytes; }
+    /// empty if converted bodies are always kept in memory
+    const std::string &getSpillDir() const { return mSpillDir; }
+    /// empty if there is no access log, "-" for stdout
+    const std::string &getAccessLog() const { return mAccessLog; }
+    unsigned getAccessLogSampling() const { return mAccessLogSampling; }
+    /// empty if requests aren't traced
+    const std::string &getTraceFile() const { return mTraceFile; }
+    unsigned getTraceSampling() const { return mTraceSampling; }
+    unsigned getTraceFileSize() const { return mTraceFileSize; }
+    /// feed responses carry a Server-Timing header
+    bool getServerTiming() const { return mServerTiming; }
+    const std::string &getCaFile() const { return mCaFile; }
     bool getShowHelp() const { return mShowHelp; }
     const std::string &getConfigFilePath() const { return mConfigFilePath; }
 
@@ -28,16 +76,76 @@ public:
 
 
 private:
+    /// defaults only
+    ServerConfig();
+
     bool loadConfigFile(const std::string &path);
     void applyCmdLineOptions(const boost::program_options::variables_map &vars);
+    bool validate() const;
 
     unsigned mPort;
     unsigned mThreadCount;
     unsigned mRequestTimeout;
+    unsigned mStreamInterval;
+    unsigned mStreamQueueSize;
+    unsigned mHeaderTimeout;
+    unsigned mIdleTimeout;
+    unsigned mMaxHeaderSize;
+    unsigned mMaxConnectionsPerIp;
+    unsigned mMaxConnections;
+    unsigned mMaxUpstreamFetches;
+    unsigned mMaxUpstreamFetchesPerHost;
+    unsigned mMaxBufferedBytes;
+    unsigned mQueueTimeout;
+    unsigned mHedgeBudget;
+    unsigned mBreakerThreshold;
+    unsigned mBreakerCooldown;
+    unsigned mMaxUpstreamTimeout;
+    unsigned mMinUpstreamTimeout;
+    unsigned mComputeThreads;
+    unsigned mSpillThreshold;
+    unsigned mFeedCacheSize;
+    unsigned mFeedCacheBytes;
+    std::string mSpillDir;
+    std::string mAccessLog;
+    unsigned mAccessLogSampling;
+    std::string mTraceFile;
+    unsigned mTraceSampling;
+    unsigned mTraceFileSize;
+    bool mServerTiming;
+    std::string mCaFile;
     std::string mConfigFilePath;
 
     bool mShowHelp;
     bool mOk;
 
-    boost::program_options::options_description *mDesc;
+    std::shared_ptr<boost::program_options::options_description> mDesc;
+    std::shared_ptr<boost::program_options::variables_map> mCmdLine;
+};
+typedef std::shared_ptr<ServerConfig> ServerConfigPtr;
+
+/// The current config, replaced as a whole on reload. A reader holds on to
+/// the snapshot it got for as long as it needs consistent settings, e.g.
+/// until its request is answered; a replaced snapshot is freed once the
+/// last reader lets go of it.
+///
+/// Each thread caches the snapshot it got last and only takes the lock
+/// when the generation says it was replaced, so a get() in between reloads
+/// is an atomic load and a reference count increment. A thread's cache
+/// keeps a replaced snapshot until that thread's next get().
+class ConfigStore
+{
+public:
+    explicit ConfigStore(const ServerConfigPtr &config);
+
+    ServerConfigPtr get() const;
+    void set(const ServerConfigPtr &config);
+
+private:
+    const std::uint64_t mId; // tells stores apart in the per-thread caches
+    ServerConfigPtr mCurrent;
+    std::atomic<std::uint64_t> mGeneration; // bumped by every set()
+    mutable boost::mutex mMutex;
+    typedef boost::lock_guard<boost::mutex> LockGuard;
 };
+typedef std::shared_ptr<ConfigStore> ConfigStorePtr;
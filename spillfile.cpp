@@ -0,0 +1,88 @@
+#include "spillfile.h"
+
+#include <cerrno>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+namespace {
+
+/// unnamed file in dir, falls back to create and unlink where O_TMPFILE isn't supported
+int openTempFile(const std::string &dir)
+{
+#ifdef O_TMPFILE
+    const int tmpFd = ::open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (tmpFd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)) {
+        return tmpFd;
+    }
+#endif
+
+    std::string path = dir + "/rssproxy_XXXXXX";
+    std::vector<char> name(path.begin(), path.end());
+    name.push_back('\0');
+    const int fd = mkostemp(name.data(), O_CLOEXEC);
+    if (fd >= 0) {
+        unlink(name.data());
+    }
+    return fd;
+}
+
+} // namespace
+
+SpillFile::SpillFile(int fd, std::size_t size)
+    : mFd(fd),
+      mSize(size)
+{ }
+
+SpillFile::~SpillFile()
+{
+    ::close(mFd);
+}
+
+SpillFilePtr SpillFile::create(const std::string &dir, const std::string &data)
+{
+    const int fd = openTempFile(dir);
+    if (fd < 0) {
+        return nullptr;
+    }
+    // owns fd from here on
+    SpillFilePtr file(new SpillFile(fd, data.size()));
+
+    std::size_t written = 0;
+    while (written < data.size()) {
+        const ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return nullptr;
+        }
+        written += n;
+    }
+    return file;
+}
+
+bool SpillFile::read(std::size_t offset, std::size_t size, std::string &data) const
+{
+    if (offset > mSize || size > mSize - offset) {
+        return false;
+    }
+
+    const std::size_t begin = data.size();
+    data.resize(begin + size);
+    std::size_t done = 0;
+    while (done < size) {
+        const ssize_t n = ::pread(mFd, &data[begin + done], size - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            data.resize(begin);
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
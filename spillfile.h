@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+/// Response body moved out of memory into an unlinked file, so it goes to
+/// the socket with sendfile. The file is gone once the last reference is.
+class SpillFile
+{
+public:
+    ~SpillFile();
+
+    /// writes data to a new file in dir, null if it can't be created or written
+    static std::shared_ptr<SpillFile> create(const std::string &dir, const std::string &data);
+
+    /// appends size bytes from offset to data, false on a failed or short read;
+    /// doesn't move the file offset, so it may run alongside sendfile
+    bool read(std::size_t offset, std::size_t size, std::string &data) const;
+
+    int getFd() const { return mFd; }
+    std::size_t getSize() const { return mSize; }
+
+private:
+    SpillFile(int fd, std::size_t size);
+    SpillFile(const SpillFile &) = delete;
+    SpillFile &operator=(const SpillFile &) = delete;
+
+    const int mFd;
+    const std::size_t mSize;
+};
+typedef std::shared_ptr<SpillFile> SpillFilePtr;
@@ -0,0 +1,204 @@
+#include "streamhub.h"
+
+#include <algorithm>
+#include <sstream>
+
+#include "rssconverter.h"
+
+namespace {
+
+std::size_t itemHash(const pugi::xml_node &item)
+{
+    std::hash<std::string> hash;
+
+    pugi::xml_node guid = item.child("guid");
+    if (guid) {
+        return hash(guid.text().as_string());
+    }
+
+    pugi::xml_node link = item.child("link");
+    if (link) {
+        return hash(link.text().as_string());
+    }
+
+    return hash(std::string(item.child("title").text().as_string()) + item.child("description").text().as_string());
+}
+
+Server::Stream::DataPtr makeEvent(const char *type, std::size_t id, const char *data)
+{
+    std::ostringstream o;
+    o << "event: " << type << "\n";
+    if (id != 0) {
+        o << "id: " << std::hex << id << "\n";
+    }
+    o << "data: " << data << "\n\n";
+    return std::make_shared<const std::string>(o.str());
+}
+
+} // namespace
+
+StreamHub::StreamHub(boost::asio::io_service &service, Upstream &upstream, const ConfigStorePtr &config)
+    : mIOService(service),
+      mUpstream(upstream),
+      mConfig(config)
+{ }
+
+void StreamHub::subscribe(const std::string &url, const Server::StreamPtr &stream)
+{
+    ChannelPtr channel;
+    {
+        LockGuard g(mMutex);
+        ChannelPtr &ptr = mChannels[url];
+        if (!ptr) {
+            ptr = std::make_shared<Channel>(mIOService, url);
+        }
+        channel = ptr;
+    }
+
+    channel->strand.dispatch([this, channel, stream]() {
+        addSubscriber(channel, stream);
+    });
+}
+
+void StreamHub::addSubscriber(const ChannelPtr &channel, const Server::StreamPtr &stream)
+{
+    if (channel->closed) {
+        // channel has just been dropped by its last poll, start a new one
+        subscribe(channel->url, stream);
+        return;
+    }
+
+    const Server::Stream *streamId = stream.get();
+    stream->setCloseHandler([this, channel, streamId]() {
+        channel->strand.dispatch([this, channel, streamId]() {
+            removeSubscriber(channel, streamId);
+        });
+    });
+
+    channel->subscribers.push_back(stream);
+
+    // current items go out as a single write so they don't overflow the send queue
+    if (!channel->snapshot.empty()) {
+        std::string events;
+        for (auto it = channel->snapshot.begin(); it != channel->snapshot.end(); it++) {
+            events += **it;
+        }
+        stream->send(events);
+    }
+
+    if (!channel->polling) {
+        channel->polling = true;
+        poll(channel);
+    }
+}
+
+void StreamHub::removeSubscriber(const ChannelPtr &channel, const Server::Stream *stream)
+{
+    auto &subscribers = channel->subscribers;
+    for (auto it = subscribers.begin(); it != subscribers.end(); it++) {
+        if (it->get() == stream) {
+            subscribers.erase(it);
+            break;
+        }
+    }
+}
+
+void StreamHub::poll(const ChannelPtr &channel)
+{
+    mUpstream.fetch(channel->url, mConfig->get()->getRequestTimeout(), channel->strand.wrap(
+    [this, channel](const Client::ResponsePtr &res) {
+        onFetched(channel, res);
+    }));
+}
+
+void StreamHub::onFetched(const ChannelPtr &channel, const Client::ResponsePtr &res)
+{
+    if (channel->subscribers.empty()) {
+        LockGuard g(mMutex);
+        auto it = mChannels.find(channel->url);
+        if (it != mChannels.end() && it->second == channel) {
+            mChannels.erase(it);
+        }
+        channel->closed = true;
+        return;
+    }
+
+    if (res->httpCode == 200) {
+        update(channel, res->body);
+    } else {
+        std::ostringstream o;
+        o << "{\"httpCode\":" << res->httpCode << "}";
+        broadcast(channel, makeEvent("error", 0, o.str().c_str()));
+    }
+
+    channel->timer.expires_from_now(boost::posix_time::milliseconds(mConfig->get()->getStreamInterval()));
+    channel->timer.async_wait(channel->strand.wrap([this, channel](const boost::system::error_code &err) {
+        if (!err) {
+            poll(channel);
+        }
+    }));
+}
+
+void StreamHub::update(const ChannelPtr &channel, const std::string &rss)
+{
+    pugi::xml_document doc;
+    pugi::xml_node rssChannel;
+    if (doc.load_buffer(rss.c_str(), rss.size())) {
+        rssChannel = findRssChannel(doc);
+    }
+
+    if (!rssChannel) {
+        broadcast(channel, makeEvent("error", 0, "{\"httpCode\":415}"));
+        return;
+    }
+
+    std::set<std::size_t> seen;
+    std::vector<Server::Stream::DataPtr> snapshot;
+    std::vector<Server::Stream::DataPtr> fresh;
+    std::size_t freshSize = 0;
+
+    for (pugi::xml_node item = rssChannel.child("item"); item; item = item.next_sibling("item")) {
+        const std::size_t hash = itemHash(item);
+        if (!seen.insert(hash).second) {
+            continue;
+        }
+
+        rapidjson::StringBuffer s;
+        RssJsonWriter w(s);
+        if (!writeRssItem(w, item)) {
+            continue;
+        }
+
+        Server::Stream::DataPtr event = makeEvent("item", hash, s.GetString());
+        snapshot.push_back(event);
+        if (channel->seen.count(hash) == 0) {
+            fresh.push_back(event);
+            freshSize += event->size();
+        }
+    }
+
+    // feeds list newest items first, events go out oldest first, all in a single
+    // write, a first poll finds every item new and would overflow the send queue
+    if (!fresh.empty()) {
+        std::string events;
+        events.reserve(freshSize);
+        for (auto it = fresh.rbegin(); it != fresh.rend(); it++) {
+            events += **it;
+        }
+        broadcast(channel, std::make_shared<const std::string>(std::move(events)));
+    }
+
+    std::reverse(snapshot.begin(), snapshot.end());
+    channel->snapshot.swap(snapshot);
+    channel->seen.swap(seen);
+}
+
+void StreamHub::broadcast(const ChannelPtr &channel, const Server::Stream::DataPtr &event)
+{
+    // a stream closing on send may remove its subscriber right away, strands
+    // of the channel and the stream can share an implementation
+    const std::vector<Server::StreamPtr> subscribers = channel->subscribers;
+    for (auto it = subscribers.begin(); it != subscribers.end(); it++) {
+        (*it)->send(event);
+    }
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+
+#include "client.h"
+#include "server.h"
+#include "serverconfig.h"
+#include "upstream.h"
+
+/// Keeps one upstream poller per feed url and pushes new items to every
+/// subscribed event stream as server-sent events. Each poll takes the
+/// interval and timeout of the current config.
+class StreamHub
+{
+public:
+    StreamHub(boost::asio::io_service &service, Upstream &upstream, const ConfigStorePtr &config);
+
+    void subscribe(const std::string &url, const Server::StreamPtr &stream);
+
+private:
+    struct Channel {
+        Channel(boost::asio::io_service &service, const std::string &url)
+            : url(url),
+              strand(service),
+              timer(service),
+              polling(false),
+              closed(false)
+        { }
+
+        const std::string url;
+        boost::asio::io_service::strand strand;
+        boost::asio::deadline_timer timer;
+        bool polling;
+        bool closed;
+
+        std::vector<Server::StreamPtr> subscribers;
+
+        // hashes of items seen on the last poll
+        std::set<std::size_t> seen;
+        // events for all current items, oldest first, replayed to new subscribers
+        std::vector<Server::Stream::DataPtr> snapshot;
+    };
+    typedef std::shared_ptr<Channel> ChannelPtr;
+
+    void addSubscriber(const ChannelPtr &channel, const Server::StreamPtr &stream);
+    void removeSubscriber(const ChannelPtr &channel, const Server::Stream *stream);
+
+    void poll(const ChannelPtr &channel);
+    void onFetched(const ChannelPtr &channel, const Client::ResponsePtr &res);
+    void update(const ChannelPtr &channel, const std::string &rss);
+    void broadcast(const ChannelPtr &channel, const Server::Stream::DataPtr &event);
+
+    boost::asio::io_service &mIOService;
+    Upstream &mUpstream;
+    const ConfigStorePtr mConfig;
+
+    std::map<std::string, ChannelPtr> mChannels;
+    boost::mutex mMutex;
+    typedef boost::lock_guard<boost::mutex> LockGuard;
+};
@@ -0,0 +1,286 @@
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+
+#include "client.h"
+#include "computepool.h"
+#include "feedcache.h"
+#include "murmurhash.h"
+#include "rssconverter.h"
+
+/// Checks of the parts that are easy to get subtly wrong: chunk size
+/// parsing and chunks split across reads, item reuse between conversions
+/// and feed cursors across cache versions, spilled entries included. Exits
+/// non-zero on a failure, run by ctest or directly:
+///
+///   bin/rssproxy_tests
+
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+
+namespace {
+
+unsigned gFailures = 0;
+
+void check(bool ok, const char *what, const char *file, int line)
+{
+    if (!ok) {
+        std::cerr << file << ":" << line << ": check failed: " << what << std::endl;
+        gFailures++;
+    }
+}
+
+bool parsesTo(const std::string &line, std::size_t expected)
+{
+    std::size_t size = 0;
+    return Client::parseChunkSize(line, size) && size == expected;
+}
+
+bool rejects(const std::string &line)
+{
+    std::size_t size = 0;
+    return !Client::parseChunkSize(line, size);
+}
+
+void testChunkSize()
+{
+    CHECK(parsesTo("0\r", 0));
+    CHECK(parsesTo("1a\r", 26));
+    CHECK(parsesTo("1A\r", 26));
+    CHECK(parsesTo("1a;name=value\r", 26));
+    CHECK(parsesTo("1a \t;name\r", 26));
+    CHECK(parsesTo("1a \r", 26));
+    CHECK(parsesTo("1000000\r", 16 * 1024 * 1024));
+
+    CHECK(rejects(""));
+    CHECK(rejects("\r"));
+    CHECK(rejects("1a"));        // no CR, the line wasn't complete
+    CHECK(rejects(" 1a\r"));
+    CHECK(rejects("+1a\r"));
+    CHECK(rejects("-1\r"));
+    CHECK(rejects("zz\r"));
+    CHECK(rejects("1az\r"));
+    CHECK(rejects("1a 2\r"));
+    CHECK(rejects("1000001\r")); // over the largest chunk taken
+    CHECK(rejects("ffffffffffffffff\r"));
+    CHECK(rejects("10000000000000000\r"));
+}
+
+/// writes reply to the first connection in pieces, pausing in between so
+/// each one arrives in a read of its own
+void serveInPieces(boost::asio::io_service &service, boost::asio::ip::tcp::acceptor &acceptor,
+                   const std::vector<std::string> &reply)
+{
+    boost::asio::ip::tcp::socket socket(service);
+    acceptor.accept(socket);
+    socket.set_option(boost::asio::ip::tcp::no_delay(true));
+
+    boost::asio::streambuf request;
+    boost::asio::read_until(socket, request, "\r\n\r\n");
+
+    for (auto it = reply.begin(); it != reply.end(); it++) {
+        boost::asio::write(socket, boost::asio::buffer(*it));
+        boost::this_thread::sleep(boost::posix_time::milliseconds(20));
+    }
+
+    boost::system::error_code ec;
+    socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+}
+
+Client::ResponsePtr fetchPieces(const std::vector<std::string> &reply)
+{
+    boost::asio::io_service originService;
+    boost::asio::ip::tcp::acceptor acceptor(originService, boost::asio::ip::tcp::endpoint(
+                                                boost::asio::ip::address_v4::loopback(), 0));
+    boost::thread origin([&originService, &acceptor, &reply]() {
+        serveInPieces(originService, acceptor, reply);
+    });
+
+    std::ostringstream url;
+    url << "http://127.0.0.1:" << acceptor.local_endpoint().port() << "/feed.xml";
+
+    boost::asio::io_service service;
+    const auto context = std::make_shared<Client::Context>(service, true);
+    auto client = std::make_shared<Client>(service, context);
+    Client::ResponsePtr response;
+    client->sendRequest("GET", url.str(), 2000, [&response](const Client::ResponsePtr &res) {
+        response = res;
+    });
+    // until the client is done with the exchange and has dropped its handlers
+    while (client.use_count() > 1) {
+        service.run_one();
+    }
+
+    origin.join();
+    return response;
+}
+
+void testChunkedBody()
+{
+    const std::string head = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n";
+
+    // CRLFs split after their CR, ending both a size line and a chunk
+    Client::ResponsePtr res = fetchPieces({head, "5\r", "\nhello\r", "\n6\r\n world\r\n0\r", "\n\r\n"});
+    CHECK(res && res->httpCode == 200);
+    CHECK(res && res->body == "hello world");
+
+    // a size line split inside the number
+    res = fetchPieces({head, "1", "0\r\n0123456789abcdef\r\n0\r\n\r\n"});
+    CHECK(res && res->httpCode == 200);
+    CHECK(res && res->body == "0123456789abcdef");
+
+    res = fetchPieces({head, "ffffffffffffffffffff\r\n"});
+    CHECK(res && res->httpCode == 434);
+
+    res = fetchPieces({head, "zz\r\n"});
+    CHECK(res && res->httpCode == 434);
+
+    // the chunk isn't followed by CRLF
+    res = fetchPieces({head, "5\r\nhelloXX0\r\n\r\n"});
+    CHECK(res && res->httpCode == 434);
+}
+
+std::string makeFeed(const std::vector<std::string> &items)
+{
+    std::string feed = "<?xml version=\"1.0\"?><rss version=\"2.0\"><channel><title>T</title>";
+    for (auto it = items.begin(); it != items.end(); it++) {
+        feed += "<item><title>" + *it + "</title><link>http://x/" + *it + "</link></item>";
+    }
+    return feed + "</channel></rss>";
+}
+
+/// conversion of items reusing what it can of previous, as the feed handler does
+std::shared_ptr<FeedCache::Entry> convert(ComputePool &pool, const std::vector<std::string> &items,
+                                          const FeedCache::EntryPtr &previous)
+{
+    const std::string rss = makeFeed(items);
+    const FeedCache::Entry empty = FeedCache::Entry();
+    const FeedCache::Entry &last = previous ? *previous : empty;
+
+    auto entry = std::make_shared<FeedCache::Entry>();
+    bool ok = false;
+    entry->json = convertRssToJson(rss, RssConvertOptions(), pool, ok, std::shared_ptr<Trace>(),
+                                   last.json, last.items, entry->items);
+    CHECK(ok);
+    entry->sourceHash = murmurHash64(rss.data(), rss.size());
+    entry->etag = FeedCache::makeETag(entry->json);
+    return entry;
+}
+
+void testItemReuse()
+{
+    ComputePool pool(1);
+
+    auto first = convert(pool, {"a", "b", "c"}, FeedCache::EntryPtr());
+    CHECK(first->items.reused == 0);
+    CHECK(first->items.converted == 3);
+
+    auto second = convert(pool, {"n", "a", "b", "c"}, first);
+    CHECK(second->items.reused == 3);
+    CHECK(second->items.converted == 1);
+
+    // an edited item is a miss, the others are still taken over
+    auto third = convert(pool, {"n", "a", "B", "c"}, second);
+    CHECK(third->items.reused == 3);
+    CHECK(third->items.converted == 1);
+
+    // reused items come out the same as converted ones
+    bool ok = false;
+    CHECK(third->json == convertRssToJson(makeFeed({"n", "a", "B", "c"}), RssConvertOptions(), ok));
+}
+
+/// titles of the items in json, in order
+std::string titles(const std::string &json)
+{
+    std::string titles;
+    const std::string key = "\"title\":\"";
+    std::string::size_type pos = json.find("\"items\"");
+    while ((pos = json.find(key, pos)) != std::string::npos) {
+        pos += key.size();
+        titles += json.substr(pos, json.find('"', pos) - pos) + " ";
+    }
+    return titles;
+}
+
+void testCursors()
+{
+    ComputePool pool(1);
+    FeedCache cache(16, 0);
+    const std::string key = "feed";
+    std::string json;
+
+    auto v1 = convert(pool, {"a", "b"}, cache.find(key));
+    cache.put(key, v1);
+    CHECK(v1->version == 1);
+    const std::string cursor1 = FeedCache::makeCursor(*v1);
+
+    auto v2 = convert(pool, {"c", "a", "b"}, cache.find(key));
+    cache.put(key, v2);
+    CHECK(v2->generation == v1->generation);
+    CHECK(v2->version == 2);
+    CHECK(cache.writeDelta(*v2, cursor1, json) && titles(json) == "c ");
+
+    // removing items makes no new version
+    auto removed = convert(pool, {"c", "a"}, cache.find(key));
+    cache.put(key, removed);
+    CHECK(removed->version == 2);
+
+    auto v3 = convert(pool, {"d", "c", "a"}, cache.find(key));
+    cache.put(key, v3);
+    CHECK(v3->version == 3);
+    CHECK(cache.writeDelta(*v3, cursor1, json) && titles(json) == "d c ");
+    CHECK(cache.writeDelta(*v3, FeedCache::makeCursor(*v2), json) && titles(json) == "d ");
+    CHECK(cache.writeDelta(*v3, FeedCache::makeCursor(*v3), json) && titles(json) == "");
+
+    // two conversions started from the same entry: the later one is a
+    // version after the earlier one, not a replacement of it
+    const FeedCache::EntryPtr base = cache.find(key);
+    auto early = convert(pool, {"e", "d", "c", "a"}, base);
+    auto late = convert(pool, {"f", "e", "d", "c", "a"}, base);
+    cache.put(key, early);
+    cache.put(key, late);
+    CHECK(early->version == 4);
+    CHECK(late->version == 5);
+    CHECK(cache.writeDelta(*late, FeedCache::makeCursor(*early), json) && titles(json) == "f ");
+    CHECK(cache.writeDelta(*late, cursor1, json) && titles(json) == "f e d c ");
+
+    CHECK(!cache.writeDelta(*late, "0.1", json));
+    CHECK(!cache.writeDelta(*late, "garbage", json));
+
+    // a spilled entry gives the same deltas, read back from its file
+    auto spilled = std::make_shared<FeedCache::Entry>(*late);
+    CHECK(FeedCache::spill(*spilled, "/tmp") && spilled->json.empty());
+    CHECK(FeedCache::readJson(*spilled, json) && json == late->json);
+    CHECK(cache.writeDelta(*spilled, cursor1, json) && titles(json) == "f e d c ");
+    std::string inMemory;
+    CHECK(cache.writeDelta(*late, FeedCache::makeCursor(*early), inMemory) &&
+          cache.writeDelta(*spilled, FeedCache::makeCursor(*early), json) && json == inMemory);
+
+    // a feed cached anew starts another generation, old cursors are refused
+    FeedCache other(16, 0);
+    auto fresh = convert(pool, {"a", "b"}, FeedCache::EntryPtr());
+    other.put(key, fresh);
+    CHECK(fresh->generation != v1->generation);
+    CHECK(!other.writeDelta(*fresh, cursor1, json));
+}
+
+} // namespace
+
+int main()
+{
+    testChunkSize();
+    testChunkedBody();
+    testItemReuse();
+    testCursors();
+
+    if (gFailures > 0) {
+        std::cerr << gFailures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "all checks passed" << std::endl;
+    return 0;
+}
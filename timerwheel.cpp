@@ -0,0 +1,189 @@
+#include "timerwheel.h"
+
+#include <algorithm>
+
+TimerWheel::Timer::~Timer()
+{
+    if (mWheel) {
+        mWheel->cancel(*this);
+    }
+}
+
+TimerWheel::TimerWheel(boost::asio::io_service &service, unsigned resolution)
+    : mTimer(service),
+      mResolution(std::chrono::milliseconds(std::max(resolution, 1u))),
+      mStart(Clock::now()),
+      mNow(0),
+      mCount(0),
+      mTicking(false)
+{
+    std::fill(&mSlots[0][0], &mSlots[0][0] + Levels * Slots, nullptr);
+}
+
+TimerWheel::~TimerWheel()
+{
+    LockGuard g(mMutex);
+    for (unsigned level = 0; level < Levels; level++) {
+        for (unsigned slot = 0; slot < Slots; slot++) {
+            while (Timer *timer = mSlots[level][slot]) {
+                unlink(*timer);
+                timer->mWheel = nullptr;
+            }
+        }
+    }
+    mTimer.cancel();
+}
+
+void TimerWheel::schedule(Timer &timer, unsigned timeout, std::function<void()> func)
+{
+    // declared before the guard, so a replaced callback is released after unlocking
+    std::function<void()> replaced;
+    LockGuard g(mMutex);
+
+    if (timer.mPrev) {
+        unlink(timer);
+    }
+    replaced.swap(timer.mCallback);
+
+    const Clock::duration elapsed = Clock::now() - mStart;
+    if (mCount == 0 && !mTicking) {
+        // nothing is pending, so the wheel can skip the idle period at once
+        mNow = elapsed / mResolution;
+    }
+
+    // counted from the real time rather than from the last processed tick
+    // and rounded up to the next tick, a deadline never fires early
+    const Clock::duration deadline = elapsed + std::chrono::milliseconds(timeout);
+    const std::uint64_t expiry = (deadline + mResolution - Clock::duration(1)) / mResolution;
+    const std::uint64_t maxTicks = (std::uint64_t(1) << (LevelBits * Levels)) - 1;
+
+    timer.mWheel = this;
+    timer.mExpiry = std::min(std::max(expiry, mNow + 1), mNow + maxTicks);
+    timer.mCallback = std::move(func);
+    link(timer);
+
+    if (!mTicking) {
+        mTicking = true;
+        arm();
+    }
+}
+
+void TimerWheel::cancel(Timer &timer)
+{
+    std::function<void()> callback;
+    {
+        LockGuard g(mMutex);
+        if (timer.mPrev) {
+            unlink(timer);
+        }
+        callback.swap(timer.mCallback);
+    }
+    // released outside the lock, it may hold the last reference to the timer's owner
+}
+
+std::size_t TimerWheel::getCount() const
+{
+    LockGuard g(mMutex);
+    return mCount;
+}
+
+std::uint64_t TimerWheel::currentTick() const
+{
+    return (Clock::now() - mStart) / mResolution;
+}
+
+void TimerWheel::link(Timer &timer)
+{
+    // level is picked by distance, slot by the expiry bits of that level,
+    // so an entry is cascaded down exactly when its slot comes up
+    const std::uint64_t delta = timer.mExpiry - mNow;
+    unsigned level = 0;
+    while (level + 1 < Levels && delta >= (std::uint64_t(1) << (LevelBits * (level + 1)))) {
+        level++;
+    }
+
+    Timer *&head = mSlots[level][(timer.mExpiry >> (LevelBits * level)) & (Slots - 1)];
+    timer.mNext = head;
+    timer.mPrev = &head;
+    if (head) {
+        head->mPrev = &timer.mNext;
+    }
+    head = &timer;
+    mCount++;
+}
+
+void TimerWheel::unlink(Timer &timer)
+{
+    *timer.mPrev = timer.mNext;
+    if (timer.mNext) {
+        timer.mNext->mPrev = timer.mPrev;
+    }
+    timer.mNext = nullptr;
+    timer.mPrev = nullptr;
+    mCount--;
+}
+
+void TimerWheel::cascade(unsigned level)
+{
+    Timer *timer = mSlots[level][(mNow >> (LevelBits * level)) & (Slots - 1)];
+    while (timer) {
+        Timer *next = timer->mNext;
+        unlink(*timer);
+        link(*timer);
+        timer = next;
+    }
+}
+
+void TimerWheel::advance(std::vector<std::function<void()>> &expired)
+{
+    mNow++;
+
+    for (unsigned level = 1; level < Levels; level++) {
+        if ((mNow & ((std::uint64_t(1) << (LevelBits * level)) - 1)) != 0) {
+            break;
+        }
+        cascade(level);
+    }
+
+    while (Timer *timer = mSlots[0][mNow & (Slots - 1)]) {
+        unlink(*timer);
+        expired.push_back(std::function<void()>());
+        expired.back().swap(timer->mCallback);
+    }
+}
+
+void TimerWheel::arm()
+{
+    mTimer.expires_at(mStart + mResolution * (mNow + 1));
+    mTimer.async_wait([this](const boost::system::error_code &err) {
+        onTick(err);
+    });
+}
+
+void TimerWheel::onTick(const boost::system::error_code &err)
+{
+    if (err == boost::asio::error::operation_aborted) {
+        return;
+    }
+
+    std::vector<std::function<void()>> expired;
+    {
+        LockGuard g(mMutex);
+
+        // catches up on ticks missed while the service was busy
+        const std::uint64_t now = currentTick();
+        while (mNow < now && mCount > 0) {
+            advance(expired);
+        }
+
+        if (mCount > 0) {
+            arm();
+        } else {
+            mTicking = false;
+        }
+    }
+
+    for (auto it = expired.begin(); it != expired.end(); it++) {
+        (*it)();
+    }
+}
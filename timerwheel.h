@@ -0,0 +1,80 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/thread.hpp>
+
+/// Hierarchical timing wheel (Varghese & Lauck) for many coarse deadlines
+/// sharing one asio timer: scheduling and cancelling are O(1) list operations
+/// instead of a timer queue insertion per deadline. Deadlines fire on the
+/// service's threads with tick resolution, never early.
+class TimerWheel
+{
+public:
+    TimerWheel(boost::asio::io_service &service, unsigned resolution);
+    ~TimerWheel();
+
+    /// deadline entry embedded in its owner, cancelled when destroyed
+    class Timer {
+        friend class TimerWheel;
+
+    public:
+        Timer()
+            : mWheel(nullptr),
+              mNext(nullptr),
+              mPrev(nullptr),
+              mExpiry(0)
+        { }
+        ~Timer();
+
+    private:
+        Timer(const Timer &) = delete;
+        Timer &operator=(const Timer &) = delete;
+
+        TimerWheel *mWheel;
+        Timer *mNext;
+        Timer **mPrev; // link pointing to this entry, null if not scheduled
+        std::uint64_t mExpiry;
+        std::function<void()> mCallback;
+    };
+
+    /// (re)schedules timer to call func after timeout ms
+    void schedule(Timer &timer, unsigned timeout, std::function<void()> func);
+    /// func of cancelled timer is released without being called
+    void cancel(Timer &timer);
+
+    std::size_t getCount() const;
+
+private:
+    enum {
+        LevelBits = 6,
+        Slots = 1 << LevelBits,
+        Levels = 4,
+    };
+
+    typedef std::chrono::steady_clock Clock;
+
+    std::uint64_t currentTick() const;
+    void link(Timer &timer);
+    void unlink(Timer &timer);
+    void cascade(unsigned level);
+    void advance(std::vector<std::function<void()>> &expired);
+    void arm();
+    void onTick(const boost::system::error_code &err);
+
+    boost::asio::steady_timer mTimer;
+    const Clock::duration mResolution;
+    const Clock::time_point mStart;
+
+    Timer *mSlots[Levels][Slots];
+    std::uint64_t mNow; // ticks since mStart processed so far
+    std::size_t mCount;
+    bool mTicking;
+
+    mutable boost::mutex mMutex;
+    typedef boost::lock_guard<boost::mutex> LockGuard;
+};
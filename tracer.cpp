@@ -0,0 +1,227 @@
+#include "tracer.h"
+
+#include <cstdio>
+
+#include <unistd.h>
+
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
+
+// rotated files kept next to the current one
+#define TRACE_ROTATED_FILES 3
+// traces waiting for the writer, more are dropped
+#define TRACE_MAX_QUEUE 4096
+// ms between writes of finished traces, a trace shows up this late at most
+#define TRACE_FLUSH_INTERVAL 500
+
+Trace::Trace(Tracer &tracer, std::uint64_t id)
+    : mTracer(tracer),
+      mId(id),
+      mStart(Clock::now())
+{ }
+
+Trace::~Trace()
+{
+    mTracer.finish(*this);
+}
+
+void Trace::setName(const std::string &name)
+{
+    LockGuard g(mMutex);
+    mName = name;
+}
+
+void Trace::add(const char *name, Clock::time_point begin, Clock::time_point end,
+                const char *argName, std::uint64_t arg)
+{
+    Span span;
+    span.name = name;
+    span.begin = begin;
+    span.end = end;
+    span.argName = argName;
+    span.arg = arg;
+
+    LockGuard g(mMutex);
+    mSpans.push_back(span);
+}
+
+Tracer::Tracer(const std::string &path, unsigned sampling, std::size_t maxFileSize)
+    : mPath(path),
+      mMaxFileSize(maxFileSize),
+      mSampling(sampling),
+      mNextId(1),
+      mPid(getpid()),
+      mOpen(false),
+      mFileSize(0),
+      mFirstEvent(true)
+{
+    const auto wall = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::system_clock::now().time_since_epoch());
+    const auto steady = std::chrono::duration_cast<std::chrono::microseconds>(
+                Trace::Clock::now().time_since_epoch());
+    mWallOffsetUs = wall.count() - steady.count();
+
+    open();
+    mOpen = mFile.is_open();
+    if (!mOpen) {
+        return;
+    }
+
+    mWriter.reset(new FlushThread(TRACE_FLUSH_INTERVAL, [this]() {
+        flush();
+    }));
+}
+
+Tracer::~Tracer()
+{
+    if (!mWriter) {
+        return;
+    }
+    mWriter.reset();
+    mFile << "\n]\n";
+}
+
+TracePtr Tracer::start()
+{
+    const unsigned sampling = mSampling.load(std::memory_order_relaxed);
+    if (!isOpen() || sampling == 0) {
+        return nullptr;
+    }
+
+    // per thread, so deciding doesn't bounce a shared counter between cores
+    static thread_local std::uint64_t seen = 0;
+    if (seen++ % sampling != 0) {
+        return nullptr;
+    }
+    return TracePtr(new Trace(*this, mNextId++));
+}
+
+void Tracer::finish(Trace &trace)
+{
+    Finished finished;
+    finished.id = trace.mId;
+    finished.name.swap(trace.mName);
+    finished.spans.swap(trace.mSpans);
+
+    LockGuard g(mMutex);
+    if (mQueue.size() < TRACE_MAX_QUEUE) {
+        mQueue.push_back(std::move(finished));
+    }
+}
+
+void Tracer::flush()
+{
+    std::deque<Finished> batch;
+    {
+        LockGuard g(mMutex);
+        batch.swap(mQueue);
+    }
+    if (batch.empty()) {
+        return;
+    }
+
+    for (auto it = batch.begin(); it != batch.end(); it++) {
+        write(*it);
+    }
+    mFile.flush();
+}
+
+void Tracer::write(const Finished &trace)
+{
+    rapidjson::StringBuffer s;
+    rapidjson::Writer<rapidjson::StringBuffer> w(s);
+
+    // names the request's row
+    if (!trace.name.empty()) {
+        w.StartObject();
+        w.String("ph");
+        w.String("M");
+        w.String("name");
+        w.String("thread_name");
+        w.String("pid");
+        w.Int(mPid);
+        w.String("tid");
+        w.Uint64(trace.id);
+        w.String("args");
+        w.StartObject();
+        w.String("name");
+        w.String(trace.name.c_str(), trace.name.size());
+        w.EndObject();
+        w.EndObject();
+    }
+
+    for (auto it = trace.spans.begin(); it != trace.spans.end(); it++) {
+        if (s.GetSize() > 0) {
+            s.Put(',');
+            s.Put('\n');
+        }
+        // each event is a root value of its own to the writer
+        w.Reset(s);
+
+        const std::int64_t begin = toUs(it->begin);
+        w.StartObject();
+        w.String("name");
+        w.String(it->name);
+        w.String("cat");
+        w.String("request");
+        w.String("ph");
+        w.String("X");
+        w.String("ts");
+        w.Int64(begin);
+        w.String("dur");
+        w.Int64(toUs(it->end) - begin);
+        w.String("pid");
+        w.Int(mPid);
+        w.String("tid");
+        w.Uint64(trace.id);
+        if (it->argName) {
+            w.String("args");
+            w.StartObject();
+            w.String(it->argName);
+            w.Uint64(it->arg);
+            w.EndObject();
+        }
+        w.EndObject();
+    }
+
+    if (s.GetSize() == 0) {
+        return;
+    }
+
+    if (!mFirstEvent) {
+        mFile << ",\n";
+    }
+    mFirstEvent = false;
+    mFile.write(s.GetString(), s.GetSize());
+    mFileSize += s.GetSize() + 2;
+
+    if (mMaxFileSize > 0 && mFileSize >= mMaxFileSize) {
+        rotate();
+    }
+}
+
+void Tracer::open()
+{
+    mFile.open(mPath, std::ios::out | std::ios::trunc);
+    mFile << "[\n";
+    mFileSize = 2;
+    mFirstEvent = true;
+}
+
+void Tracer::rotate()
+{
+    mFile << "\n]\n";
+    mFile.close();
+
+    for (unsigned i = TRACE_ROTATED_FILES; i > 1; i--) {
+        std::rename((mPath + "." + std::to_string(i - 1)).c_str(), (mPath + "." + std::to_string(i)).c_str());
+    }
+    std::rename(mPath.c_str(), (mPath + ".1").c_str());
+
+    open();
+}
+
+std::int64_t Tracer::toUs(Trace::Clock::time_point time) const
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(time.time_since_epoch()).count() + mWallOffsetUs;
+}
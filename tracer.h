@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+#include "flushthread.h"
+
+class Tracer;
+
+/// Timed spans of one sampled request, shared by everything working on it;
+/// handed to the tracer for writing once the last reference is gone.
+/// Spans may be added from any thread.
+class Trace
+{
+    friend class Tracer;
+
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    ~Trace();
+
+    /// label of the request's row in the viewer, e.g. its request line
+    void setName(const std::string &name);
+
+    /// argName and arg, if given, show up in the span's details
+    void add(const char *name, Clock::time_point begin, Clock::time_point end,
+             const char *argName = nullptr, std::uint64_t arg = 0);
+
+    Clock::time_point getStart() const { return mStart; }
+
+private:
+    struct Span {
+        const char *name;
+        Clock::time_point begin;
+        Clock::time_point end;
+        const char *argName;
+        std::uint64_t arg;
+    };
+
+    Trace(Tracer &tracer, std::uint64_t id);
+    Trace(const Trace &) = delete;
+    Trace &operator=(const Trace &) = delete;
+
+    Tracer &mTracer;
+    const std::uint64_t mId;
+    const Clock::time_point mStart;
+
+    std::string mName;
+    std::vector<Span> mSpans;
+    boost::mutex mMutex;
+    typedef boost::lock_guard<boost::mutex> LockGuard;
+};
+typedef std::shared_ptr<Trace> TracePtr;
+
+/// Head-sampled request tracing in Chrome trace-event format, viewable in
+/// chrome://tracing or Perfetto: a request is one row (tid is its trace id)
+/// of complete ("X") events. A background thread writes finished traces;
+/// once the file outgrows maxFileSize it's rotated to path.1, path.2 and
+/// so on. Rotated files are closed JSON arrays, the current one is left
+/// open, which both viewers accept.
+class Tracer
+{
+    friend class Trace;
+
+public:
+    /// one of sampling requests is traced
+    Tracer(const std::string &path, unsigned sampling, std::size_t maxFileSize);
+    /// writes the traces still queued, then stops the writer thread
+    ~Tracer();
+
+    bool isOpen() const { return mOpen; }
+
+    void setSampling(unsigned sampling) { mSampling = sampling; }
+
+    /// new trace starting now, null unless the request is sampled
+    TracePtr start();
+
+private:
+    /// what the writer needs of a finished trace
+    struct Finished {
+        std::uint64_t id;
+        std::string name;
+        std::vector<Trace::Span> spans;
+    };
+
+    Tracer(const Tracer &) = delete;
+    Tracer &operator=(const Tracer &) = delete;
+
+    void finish(Trace &trace);
+
+    /// writes the traces finished since the last call
+    void flush();
+    void write(const Finished &trace);
+    void open();
+    void rotate();
+    /// microseconds on the wall clock, as the viewer shows them
+    std::int64_t toUs(Trace::Clock::time_point time) const;
+
+    const std::string mPath;
+    const std::size_t mMaxFileSize;
+    std::atomic<unsigned> mSampling;
+    std::atomic<std::uint64_t> mNextId;
+
+    // steady clock time points are put on the wall clock by this offset
+    std::int64_t mWallOffsetUs;
+    const int mPid;
+
+    bool mOpen; // the file could be created at start, rotation reopens it later
+    std::ofstream mFile;
+    std::size_t mFileSize;
+    bool mFirstEvent; // of the current file
+
+    std::deque<Finished> mQueue;
+    boost::mutex mMutex;
+    std::unique_ptr<FlushThread> mWriter;
+    typedef boost::lock_guard<boost::mutex> LockGuard;
+};
@@ -0,0 +1,420 @@
+#include "upstream.h"
+
+#include <algorithm>
+
+#include "uri.h"
+
+#define FETCH_DURATION_SMOOTHING 0.1
+// share of a host's fetches expected to respond before a hedge is sent
+#define HEDGE_PERCENTILE 0.95
+// ms, hedging faster origins would mostly duplicate load
+#define MIN_HEDGE_DELAY 10
+// hedges that may be sent back to back after a calm period
+#define MAX_HEDGE_BURST 10
+#define REQUESTED_HOST_UNAVAILABLE 434
+// per-host first byte timeouts leave that many times the host's p99 first byte latency
+#define TIMEOUT_LATENCY_FACTOR 4
+
+Upstream::Upstream(boost::asio::io_service &service, const Limits &limits, const Client::ContextPtr &clientContext)
+    : mIOService(service),
+      mLimits(limits),
+      mClientContext(clientContext),
+      mBufferBudget(std::make_shared<Client::BufferBudget>(limits.maxBufferedBytes)),
+      mActive(0),
+      mAvgFetchMs(0),
+      mHostStats(limits.breakerThreshold, limits.breakerCooldown),
+      mHedgeTokens(0),
+      mAdmitted(0),
+      mQueued(0),
+      mShed(0),
+      mHedges(0),
+      mHedgeWins(0),
+      mHedgesOverBudget(0),
+      mCircuitRejected(0)
+{ }
+
+void Upstream::fetch(const std::string &url, unsigned timeout, Client::HandlerFunc func, const TracePtr &trace)
+{
+    const std::string host = Uri(url).getHost();
+
+    // a host known to be down fails fast instead of holding a slot until the timeout
+    if (!mHostStats.allowRequest(host)) {
+        mCircuitRejected++;
+        reject(func);
+        return;
+    }
+
+    WaiterPtr waiter;
+    {
+        LockGuard g(mMutex);
+
+        if (hasSlot(host)) {
+            mActive++;
+            mActivePerHost[host]++;
+        } else {
+            waiter = std::make_shared<Waiter>(mIOService);
+            waiter->host = host;
+            waiter->url = url;
+            waiter->timeout = timeout;
+            waiter->func = func;
+            waiter->trace = trace;
+            if (trace) {
+                waiter->queued = Trace::Clock::now();
+            }
+
+            // everything queued ahead is served maxFetches at a time, so don't
+            // even queue what is not going to start within the budget anyway
+            const bool hopeless = mLimits.queueTimeout > 0 && mLimits.maxFetches > 0 &&
+                    mAvgFetchMs * (mQueue.size() + 1) / mLimits.maxFetches > mLimits.queueTimeout;
+
+            if (!hopeless) {
+                mQueue.push_back(waiter);
+                mQueued++;
+
+                if (mLimits.queueTimeout > 0) {
+                    waiter->timer.expires_from_now(boost::posix_time::milliseconds(mLimits.queueTimeout));
+                    waiter->timer.async_wait([this, waiter](const boost::system::error_code &err) {
+                        if (!err) {
+                            expire(waiter);
+                        }
+                    });
+                }
+                return;
+            }
+        }
+    }
+
+    if (waiter) {
+        shed(waiter);
+    } else {
+        start(host, url, timeout, func, trace);
+    }
+}
+
+void Upstream::setLimits(const Limits &limits)
+{
+    mBufferBudget->setMax(limits.maxBufferedBytes);
+    mHostStats.setBreaker(limits.breakerThreshold, limits.breakerCooldown);
+
+    std::vector<WaiterPtr> ready;
+    {
+        LockGuard g(mMutex);
+        mLimits = limits;
+        takeReady(ready);
+    }
+    startReady(ready);
+}
+
+Upstream::Limits Upstream::getLimits() const
+{
+    LockGuard g(mMutex);
+    return mLimits;
+}
+
+Upstream::Metrics Upstream::getMetrics() const
+{
+    Metrics metrics;
+    {
+        LockGuard g(mMutex);
+        metrics.activeFetches = mActive;
+        metrics.queueDepth = mQueue.size();
+    }
+    metrics.bufferedBytes = mBufferBudget->getUsed();
+    metrics.admitted = mAdmitted;
+    metrics.queued = mQueued;
+    metrics.shed = mShed;
+    metrics.shedResponses = mBufferBudget->getRejected();
+    metrics.hedges = mHedges;
+    metrics.hedgeWins = mHedgeWins;
+    metrics.hedgesOverBudget = mHedgesOverBudget;
+    metrics.openCircuits = mHostStats.getOpenCount();
+    metrics.circuitsOpened = mHostStats.getOpenedCount();
+    metrics.circuitRejected = mCircuitRejected;
+    metrics.client = mClientContext->getStats();
+    return metrics;
+}
+
+bool Upstream::hasSlot(const std::string &host) const
+{
+    if (mLimits.maxFetches > 0 && mActive >= mLimits.maxFetches) {
+        return false;
+    }
+
+    if (mLimits.maxFetchesPerHost > 0) {
+        auto it = mActivePerHost.find(host);
+        if (it != mActivePerHost.end() && it->second >= mLimits.maxFetchesPerHost) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void Upstream::start(const std::string &host, const std::string &url, unsigned timeout, Client::HandlerFunc func,
+                     const TracePtr &trace)
+{
+    mAdmitted++;
+
+    const Limits limits = getLimits();
+    const unsigned firstByteTimeout = getFirstByteTimeout(host, timeout, limits);
+    // a host given longer to respond still gets the whole timeout for the body
+    if (timeout > 0) {
+        timeout = std::max(timeout, firstByteTimeout);
+    }
+
+    FetchPtr fetch = std::make_shared<Fetch>(mIOService);
+    fetch->host = host;
+    fetch->url = url;
+    fetch->timeout = timeout;
+    fetch->firstByteTimeout = firstByteTimeout;
+    fetch->func = func;
+    fetch->started = boost::posix_time::microsec_clock::universal_time();
+    fetch->pending = 1;
+
+    unsigned delay = 0;
+    if (limits.hedgeBudget > 0) {
+        delay = mHostStats.getLatency(host, HEDGE_PERCENTILE);
+        if (delay > 0) {
+            delay = std::max<unsigned>(delay, MIN_HEDGE_DELAY);
+        }
+
+        LockGuard g(mMutex);
+        mHedgeTokens = std::min<double>(mHedgeTokens + limits.hedgeBudget / 100.0, MAX_HEDGE_BURST);
+    }
+
+    // assigned before the request starts, its response may come on another thread
+    std::shared_ptr<Client> client = std::make_shared<Client>(mIOService, mClientContext);
+    client->setTrace(trace);
+    fetch->primary = client;
+    send(fetch, client, timeout, firstByteTimeout, false);
+
+    // a host seen too rarely to have a p95 yet is not hedged
+    if (delay > 0 && delay < firstByteTimeout) {
+        fetch->timer.expires_from_now(boost::posix_time::milliseconds(delay));
+        fetch->timer.async_wait([this, fetch, delay](const boost::system::error_code &err) {
+            if (!err) {
+                startHedge(fetch, delay);
+            }
+        });
+    }
+}
+
+void Upstream::send(const FetchPtr &fetch, const std::shared_ptr<Client> &client, unsigned timeout,
+                    unsigned firstByteTimeout, bool hedge)
+{
+    const boost::posix_time::ptime sent = boost::posix_time::microsec_clock::universal_time();
+    // set and read on the client's steps only, they never run concurrently
+    std::shared_ptr<bool> firstByte = std::make_shared<bool>(false);
+
+    client->setBufferBudget(mBufferBudget);
+    client->setAlternateEndpoint(hedge);
+    client->setFirstByteTimeout(firstByteTimeout);
+    client->setFirstByteFunc([this, fetch, sent, firstByte]() {
+        *firstByte = true;
+        onFirstByte(fetch, sent);
+    });
+    client->sendRequest("GET", fetch->url, timeout, [this, fetch, hedge, sent, firstByteTimeout, firstByte](
+                        const Client::ResponsePtr &res) {
+        unsigned waited = 0;
+        if (!*firstByte) {
+            // a timed out request counts as taking its first byte timeout, no more
+            const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+            waited = (now - sent).total_milliseconds();
+            if (firstByteTimeout > 0) {
+                waited = std::min(waited, firstByteTimeout);
+            }
+        }
+        onResponse(fetch, hedge, res, waited);
+    });
+}
+
+void Upstream::startHedge(const FetchPtr &fetch, unsigned delay)
+{
+    std::shared_ptr<Client> client = std::make_shared<Client>(mIOService, mClientContext);
+    {
+        boost::lock_guard<boost::mutex> g(fetch->mutex);
+        if (fetch->responding || fetch->done) {
+            return;
+        }
+
+        LockGuard gb(mMutex);
+        if (mHedgeTokens < 1) {
+            mHedgesOverBudget++;
+            return;
+        }
+        mHedgeTokens -= 1;
+
+        fetch->hedge = client;
+        fetch->pending++;
+    }
+
+    mHedges++;
+    // the hedge ends when the original request would have, and has to respond by then too
+    send(fetch, client, fetch->timeout - delay, fetch->firstByteTimeout - delay, true);
+}
+
+void Upstream::onFirstByte(const FetchPtr &fetch, const boost::posix_time::ptime &sent)
+{
+    const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+    mHostStats.addLatency(fetch->host, (now - sent).total_milliseconds());
+
+    boost::lock_guard<boost::mutex> g(fetch->mutex);
+    if (!fetch->responding) {
+        fetch->responding = true;
+        boost::system::error_code ec;
+        fetch->timer.cancel(ec);
+    }
+}
+
+void Upstream::onResponse(const FetchPtr &fetch, bool hedge, const Client::ResponsePtr &res, unsigned waited)
+{
+    std::shared_ptr<Client> loser;
+    {
+        boost::lock_guard<boost::mutex> g(fetch->mutex);
+        if (fetch->done) {
+            // the cancelled loser, it waited only as long as the winner took
+            return;
+        }
+
+        // failures and timeouts tell about the host's latency too
+        if (waited > 0) {
+            mHostStats.addLatency(fetch->host, waited);
+        }
+
+        // a failure only counts once the other request has nothing better
+        if (--fetch->pending > 0 && res->httpCode != 200) {
+            return;
+        }
+
+        fetch->done = true;
+        boost::system::error_code ec;
+        fetch->timer.cancel(ec);
+        loser = (hedge ? fetch->primary : fetch->hedge).lock();
+    }
+
+    if (loser) {
+        loser->cancel();
+    }
+
+    // 503 is what the buffer budget answers as well, it says nothing about the origin
+    const bool failed = res->httpCode == REQUESTED_HOST_UNAVAILABLE ||
+            (res->httpCode >= 500 && res->httpCode != 503);
+    mHostStats.addResult(fetch->host, failed);
+
+    if (hedge) {
+        mHedgeWins++;
+    }
+
+    onFinished(fetch->host, fetch->started);
+    fetch->func(res);
+}
+
+void Upstream::onFinished(const std::string &host, const boost::posix_time::ptime &started)
+{
+    const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+    const double durationMs = (now - started).total_microseconds() / 1000.0;
+
+    std::vector<WaiterPtr> ready;
+    {
+        LockGuard g(mMutex);
+
+        mAvgFetchMs += (durationMs - mAvgFetchMs) * FETCH_DURATION_SMOOTHING;
+
+        mActive--;
+        auto it = mActivePerHost.find(host);
+        if (it != mActivePerHost.end() && --it->second == 0) {
+            mActivePerHost.erase(it);
+        }
+
+        takeReady(ready);
+    }
+
+    startReady(ready);
+}
+
+void Upstream::takeReady(std::vector<WaiterPtr> &ready)
+{
+    // oldest first, skipping waiters whose host is still saturated
+    for (auto it = mQueue.begin(); it != mQueue.end(); ) {
+        if (mLimits.maxFetches > 0 && mActive >= mLimits.maxFetches) {
+            break;
+        }
+
+        WaiterPtr waiter = *it;
+        if (hasSlot(waiter->host)) {
+            mActive++;
+            mActivePerHost[waiter->host]++;
+            ready.push_back(waiter);
+            it = mQueue.erase(it);
+        } else {
+            it++;
+        }
+    }
+}
+
+void Upstream::startReady(const std::vector<WaiterPtr> &ready)
+{
+    for (auto it = ready.begin(); it != ready.end(); it++) {
+        const WaiterPtr &waiter = *it;
+        boost::system::error_code ec;
+        waiter->timer.cancel(ec);
+        if (waiter->trace) {
+            waiter->trace->add("queue", waiter->queued, Trace::Clock::now());
+        }
+        start(waiter->host, waiter->url, waiter->timeout, waiter->func, waiter->trace);
+    }
+}
+
+void Upstream::expire(const WaiterPtr &waiter)
+{
+    {
+        LockGuard g(mMutex);
+        auto it = std::find(mQueue.begin(), mQueue.end(), waiter);
+        if (it == mQueue.end()) {
+            // already started
+            return;
+        }
+        mQueue.erase(it);
+    }
+
+    shed(waiter);
+}
+
+unsigned Upstream::getFirstByteTimeout(const std::string &host, unsigned timeout, const Limits &limits) const
+{
+    if (limits.maxTimeout == 0 || timeout == 0) {
+        return timeout;
+    }
+
+    const unsigned p99 = mHostStats.getLatency(host, 0.99);
+    if (p99 == 0) {
+        return timeout;
+    }
+
+    // shorter than the timeout asked for only if the config sets a floor
+    const unsigned minTimeout = limits.minTimeout > 0 ? limits.minTimeout : timeout;
+    return std::max(std::min<unsigned>(p99 * TIMEOUT_LATENCY_FACTOR, limits.maxTimeout), minTimeout);
+}
+
+void Upstream::reject(Client::HandlerFunc func)
+{
+    mIOService.post([func]() {
+        Client::ResponsePtr res(new Client::Response);
+        res->httpCode = REQUESTED_HOST_UNAVAILABLE;
+        res->version = "HTTP/1.1";
+        func(res);
+    });
+}
+
+void Upstream::shed(const WaiterPtr &waiter)
+{
+    mShed++;
+
+    Client::HandlerFunc func = waiter->func;
+    mIOService.post([func]() {
+        Client::ResponsePtr res(new Client::Response);
+        res->httpCode = 503;
+        res->version = "HTTP/1.1";
+        func(res);
+    });
+}
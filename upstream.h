@@ -0,0 +1,165 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+
+#include "client.h"
+#include "hoststats.h"
+
+/// Admission control for upstream fetches: caps concurrent fetches globally
+/// and per host, queues the excess and sheds queued requests with 503 once
+/// they can't be served within the queue latency budget. Fetches slower to
+/// respond than the host usually is get hedged by a second request, hosts
+/// failing too often are refused at once by a circuit breaker, and the time
+/// each host gets to start responding follows its observed latency.
+class Upstream
+{
+public:
+    struct Limits {
+        Limits()
+            : maxFetches(0),
+              maxFetchesPerHost(0),
+              maxBufferedBytes(0),
+              queueTimeout(0),
+              hedgeBudget(0),
+              breakerThreshold(0),
+              breakerCooldown(0),
+              maxTimeout(0),
+              minTimeout(0)
+        { }
+
+        unsigned maxFetches;          // 0 means unlimited
+        unsigned maxFetchesPerHost;   // 0 means unlimited
+        std::size_t maxBufferedBytes; // 0 means unlimited
+        unsigned queueTimeout;        // ms, latency budget of a queued fetch
+        unsigned hedgeBudget;         // hedges per 100 fetches, 0 disables hedging
+        unsigned breakerThreshold;    // failure percentage opening a host's circuit, 0 disables it
+        unsigned breakerCooldown;     // ms an open circuit refuses requests before a probe
+        unsigned maxTimeout;          // ms, ceiling of per-host first byte timeouts, 0 keeps the one passed to fetch
+        unsigned minTimeout;          // ms, floor of per-host first byte timeouts, 0 keeps them from going below the one passed to fetch
+    };
+
+    Upstream(boost::asio::io_service &service, const Limits &limits, const Client::ContextPtr &clientContext);
+
+    /// trace, if given, gets the time spent queued and the spans of the
+    /// primary request; a hedge isn't traced
+    void fetch(const std::string &url, unsigned timeout, Client::HandlerFunc func,
+               const TracePtr &trace = TracePtr());
+
+    /// applies to fetches admitted from now on; fetches in flight keep
+    /// theirs, queued ones start at once if the new limits let them
+    void setLimits(const Limits &limits);
+    Limits getLimits() const;
+
+    struct Metrics {
+        unsigned activeFetches;
+        std::size_t queueDepth;
+        std::size_t bufferedBytes;
+        std::uint64_t admitted;
+        std::uint64_t queued;
+        std::uint64_t shed;
+        std::uint64_t shedResponses; // dropped over the buffered bytes budget
+        std::uint64_t hedges;
+        std::uint64_t hedgeWins;
+        std::uint64_t hedgesOverBudget;
+        std::size_t openCircuits;
+        std::uint64_t circuitsOpened;
+        std::uint64_t circuitRejected;
+        Client::Context::Stats client;
+    };
+    Metrics getMetrics() const;
+
+private:
+    struct Waiter {
+        Waiter(boost::asio::io_service &service)
+            : timer(service)
+        { }
+
+        std::string host;
+        std::string url;
+        unsigned timeout;
+        Client::HandlerFunc func;
+        boost::asio::deadline_timer timer;
+        TracePtr trace;
+        Trace::Clock::time_point queued;
+    };
+    typedef std::shared_ptr<Waiter> WaiterPtr;
+
+    /// admitted fetch, raced by a hedge once the origin is slower than usual
+    struct Fetch {
+        Fetch(boost::asio::io_service &service)
+            : timer(service),
+              pending(0),
+              responding(false),
+              done(false)
+        { }
+
+        std::string host;
+        std::string url;
+        unsigned timeout;
+        unsigned firstByteTimeout; // not longer than timeout
+        Client::HandlerFunc func;
+        boost::posix_time::ptime started;
+        boost::asio::deadline_timer timer; // hedge delay
+
+        std::weak_ptr<Client> primary;
+        std::weak_ptr<Client> hedge;
+        unsigned pending;  // requests not answered yet
+        bool responding;   // first byte is in, no point in hedging
+        bool done;         // func was called
+
+        boost::mutex mutex;
+    };
+    typedef std::shared_ptr<Fetch> FetchPtr;
+
+    bool hasSlot(const std::string &host) const;
+    void start(const std::string &host, const std::string &url, unsigned timeout, Client::HandlerFunc func,
+               const TracePtr &trace);
+    void send(const FetchPtr &fetch, const std::shared_ptr<Client> &client, unsigned timeout,
+              unsigned firstByteTimeout, bool hedge);
+    void startHedge(const FetchPtr &fetch, unsigned delay);
+    void onFirstByte(const FetchPtr &fetch, const boost::posix_time::ptime &sent);
+    /// waited is how long a request without a first byte took, ms
+    void onResponse(const FetchPtr &fetch, bool hedge, const Client::ResponsePtr &res, unsigned waited);
+    void onFinished(const std::string &host, const boost::posix_time::ptime &started);
+    /// moves waiters that have a slot now from the queue to ready, mMutex held
+    void takeReady(std::vector<WaiterPtr> &ready);
+    void startReady(const std::vector<WaiterPtr> &ready);
+    void shed(const WaiterPtr &waiter);
+    void reject(Client::HandlerFunc func);
+    /// how long host gets to send a response head, timeout is the one passed to fetch
+    unsigned getFirstByteTimeout(const std::string &host, unsigned timeout, const Limits &limits) const;
+    void expire(const WaiterPtr &waiter);
+
+    boost::asio::io_service &mIOService;
+    Limits mLimits;
+    const Client::ContextPtr mClientContext;
+    const Client::BufferBudgetPtr mBufferBudget;
+
+    unsigned mActive;
+    std::map<std::string, unsigned> mActivePerHost;
+    std::deque<WaiterPtr> mQueue;
+    // moving average of fetch duration, used to predict queue wait
+    double mAvgFetchMs;
+    HostStats mHostStats;
+    double mHedgeTokens;
+
+    std::atomic<std::uint64_t> mAdmitted;
+    std::atomic<std::uint64_t> mQueued;
+    std::atomic<std::uint64_t> mShed;
+    std::atomic<std::uint64_t> mHedges;
+    std::atomic<std::uint64_t> mHedgeWins;
+    std::atomic<std::uint64_t> mHedgesOverBudget;
+    std::atomic<std::uint64_t> mCircuitRejected;
+
+    mutable boost::mutex mMutex;
+    typedef boost::lock_guard<boost::mutex> LockGuard;
+};
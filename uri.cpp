@@ -9,14 +9,6 @@ Uri::Uri(const std::string &uriString)
     parse(decode(uriString));
 }
 
-Uri::Uri(const Uri &other)
-    : mProtocol(other.mProtocol),
-      mHost(other.mHost),
-      mPort(other.mPort),
-      mPath(other.mPath),
-      mQuery(other.mQuery)
-{ }
-
 void Uri::parse(const std::string &uriString)
 {
     using namespace std;
@@ -93,3 +85,30 @@ std::string Uri::encode(const std::string &uriString)
 
     return escaped.str();
 }
+
+Uri::QueryItems Uri::parseQuery(const std::string &query)
+{
+    QueryItems items;
+
+    std::string::size_type begin = 0;
+    while (begin < query.size()) {
+        std::string::size_type end = query.find('&', begin);
+        if (end == std::string::npos) {
+            end = query.size();
+        }
+
+        if (end > begin) {
+            const std::string pair = query.substr(begin, end - begin);
+            const std::string::size_type eq = pair.find('=');
+            if (eq == std::string::npos) {
+                items.push_back(std::make_pair(pair, std::string()));
+            } else {
+                items.push_back(std::make_pair(pair.substr(0, eq), pair.substr(eq + 1)));
+            }
+        }
+
+        begin = end + 1;
+    }
+
+    return items;
+}
@@ -1,12 +1,13 @@
 #pragma once
 
 #include <string>
+#include <utility>
+#include <vector>
 
 class Uri {
 public:
     Uri() { }
     Uri(const std::string &uriString);
-    Uri(const Uri &other);
 
     const std::string &getProtocol() const { return mProtocol; }
     const std::string &getHost() const { return mHost; }
@@ -23,6 +24,10 @@ public:
     static std::string decode(const std::string &uriString);
     static std::string encode(const std::string &uriString);
 
+    typedef std::vector<std::pair<std::string, std::string>> QueryItems;
+    /// splits "a=1&b=2" into key-value pairs, values are left percent-encoded
+    static QueryItems parseQuery(const std::string &query);
+
 private:
     void parse(const std::string &uriString);
 